@@ -0,0 +1,48 @@
+// Microbenchmark for the per-token bookkeeping of the repeat-penalty window.
+//
+// Compares the previous scheme (a vector sized to n_ctx with erase(begin()) + push_back
+// per sampled token) against RepeatWindow for a range of context sizes. The cost of
+// RepeatWindow::push() should stay flat as n_ctx grows.
+#include "repeat_window.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+static const int kRepeatLastN = 64;
+static const int kTokensPerRun = 1 << 20;
+
+// Keep the compiler from optimizing away the windows
+static volatile llama_token sink = 0;
+
+template <typename Fn>
+static double ns_per_token(Fn&& fn)
+{
+    const auto t_start = std::chrono::steady_clock::now();
+    fn();
+    const auto t_end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(t_end - t_start).count() / kTokensPerRun;
+}
+
+int main()
+{
+    printf("%8s %16s %16s\n", "n_ctx", "vector (ns/tok)", "window (ns/tok)");
+    for (int n_ctx : {512, 1024, 2048, 4096, 8192}) {
+        const double t_vector = ns_per_token([n_ctx]() {
+            std::vector<llama_token> last_n_tokens(n_ctx, 0);
+            for (int i = 0; i < kTokensPerRun; i++) {
+                last_n_tokens.erase(last_n_tokens.begin());
+                last_n_tokens.push_back(i);
+                sink = last_n_tokens[n_ctx - kRepeatLastN];
+            }
+        });
+        const double t_window = ns_per_token([]() {
+            RepeatWindow last_n_tokens(kRepeatLastN);
+            for (int i = 0; i < kTokensPerRun; i++) {
+                last_n_tokens.push(i);
+                sink = last_n_tokens.data()[0];
+            }
+        });
+        printf("%8d %16.2f %16.2f\n", n_ctx, t_vector, t_window);
+    }
+    return 0;
+}
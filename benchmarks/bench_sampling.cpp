@@ -0,0 +1,185 @@
+// Microbenchmark for sampling one token from a row of logits.
+//
+// Compares the algorithm of llama_sample_top_p_top_k() in the vendored llama.cpp (repeat
+// penalty by std::find over the window for every vocabulary entry, partial_sort of
+// (logit, id) pairs) against the Sampler chain on synthetic logits with the size of the
+// LLaMA vocabulary. Before timing, checks the nucleus the Sampler keeps on a few small cases
+// and its fallback to EOS when every token is banned.
+#include "llama_sampler.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+static const int kVocab = 32000;
+static const int kRepeatLastN = 64;
+static const int kSamplesPerRun = 2000;
+
+// Keep the compiler from optimizing away the samples
+static volatile llama_token sink = 0;
+
+// Same steps as llama_sample_top_p_top_k() in llama.cpp
+static llama_token sample_top_p_top_k_reference(const float* logits, const std::vector<llama_token>& last_n_tokens,
+                                                int top_k, float top_p, float temp, float repeat_penalty,
+                                                std::mt19937& rng)
+{
+    if (temp <= 0.0f) {
+        return std::max_element(logits, logits + kVocab) - logits;
+    }
+    std::vector<std::pair<float, llama_token>> logits_id;
+    logits_id.reserve(kVocab);
+    const float scale = 1.0f / temp;
+    for (int i = 0; i < kVocab; i++) {
+        if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
+            logits_id.push_back(std::make_pair(logits[i] < 0.0f ? logits[i] * scale * repeat_penalty
+                                                                : logits[i] * scale / repeat_penalty, i));
+        } else {
+            logits_id.push_back(std::make_pair(logits[i] * scale, i));
+        }
+    }
+    const int k = top_k > 0 ? std::min(top_k, kVocab) : kVocab;
+    std::partial_sort(logits_id.begin(), logits_id.begin() + k, logits_id.end(),
+                      [](const std::pair<float, llama_token>& a, const std::pair<float, llama_token>& b) {
+                          return a.first > b.first;
+                      });
+    logits_id.resize(k);
+
+    const double max_logit = logits_id[0].first;
+    std::vector<float> probs;
+    probs.reserve(logits_id.size());
+    double sum = 0.0;
+    for (const auto& kv : logits_id) {
+        const double p = exp(kv.first - max_logit);
+        probs.push_back(p);
+        sum += p;
+    }
+    for (auto& p : probs) {
+        p /= sum;
+    }
+    if (top_p < 1.0f) {
+        double cumsum = 0.0;
+        for (int i = 0; i < (int) probs.size(); i++) {
+            cumsum += probs[i];
+            if (cumsum >= top_p) {
+                probs.resize(i + 1);
+                logits_id.resize(i + 1);
+                break;
+            }
+        }
+    }
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    return logits_id[dist(rng)].second;
+}
+
+// Sampler with only top-p (and optionally typical) sampling on a row of logits at temperature 1
+static std::vector<llama_token> nucleus(const std::vector<float>& logits, float top_p, float typical_p)
+{
+    SamplingParams params;
+    params.top_k = 0;
+    params.top_p = top_p;
+    params.typical_p = typical_p;
+    params.temp = 1.0f;
+    params.repeat_penalty = 1.0f;
+    Sampler sampler(params);
+    const size_t n = sampler.distribution(logits.data(), logits.size(), nullptr, 0);
+    std::vector<llama_token> res;
+    for (size_t i = 0; i < n; i++) {
+        res.push_back(sampler.token(i));
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+// Unsorted candidates that top-p sorts in full, so the probabilities have to follow the sort
+static bool check_nucleus()
+{
+    struct Case { std::vector<float> logits; float top_p; float typical_p; std::vector<llama_token> expected; };
+    const std::vector<float> logits = {0, 5, 1, 4, 2, 3, -1, -2};
+    // p(1) = 0.632, p(3) = 0.233, p(5) = 0.086
+    for (const Case& c : {Case{logits, 0.5f, 1.0f, {1}},
+                          Case{logits, 0.8f, 1.0f, {1, 3}},
+                          Case{logits, 0.9f, 1.0f, {1, 3, 5}},
+                          Case{logits, 0.5f, 0.99f, {1}}}) {
+        if (nucleus(c.logits, c.top_p, c.typical_p) != c.expected) {
+            fprintf(stderr, "wrong nucleus for top_p=%.2f typical_p=%.2f\n", c.top_p, c.typical_p);
+            return false;
+        }
+    }
+    return true;
+}
+
+// With every token banned both paths fall back to EOS instead of a softmax over -inf
+static bool check_all_banned()
+{
+    const std::vector<float> logits = {0, 5, 1, 4, 2, 3, -1, -2};
+    for (const float temp : {0.0f, 1.0f}) {
+        SamplingParams params;
+        params.temp = temp;
+        Sampler sampler(params);
+        for (llama_token id = 0; id < (llama_token) logits.size(); id++) {
+            sampler.get_logit_bias().ban(id);
+        }
+        std::mt19937 rng(0);
+        const llama_token id = sampler.sample(logits.data(), logits.size(), nullptr, 0, rng);
+        if (id != llama_token_eos() || sampler.prob(0) != 1.0f) {
+            fprintf(stderr, "wrong fallback with every token banned at temp=%.1f\n", temp);
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Fn>
+static double us_per_sample(Fn&& fn)
+{
+    const auto t_start = std::chrono::steady_clock::now();
+    fn();
+    const auto t_end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(t_end - t_start).count() / kSamplesPerRun;
+}
+
+int main()
+{
+    if (!check_nucleus() || !check_all_banned()) {
+        return 1;
+    }
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> normal(0.0f, 3.0f);
+    std::vector<float> logits(kVocab);
+    for (auto& logit : logits) {
+        logit = normal(rng);
+    }
+    std::vector<llama_token> last_n_tokens(kRepeatLastN);
+    for (auto& id : last_n_tokens) {
+        id = rng() % kVocab;
+    }
+
+    printf("%-28s %16s %16s\n", "settings", "reference (us)", "sampler (us)");
+    struct Case { const char* name; int top_k; float top_p; float temp; };
+    for (const Case& c : {Case{"top_k=40 top_p=0.95", 40, 0.95f, 0.8f},
+                          Case{"top_k=0 top_p=0.95", 0, 0.95f, 0.8f},
+                          Case{"top_k=0 top_p=1.0", 0, 1.0f, 0.8f},
+                          Case{"top_k=1", 1, 0.95f, 0.8f},
+                          Case{"temp=0", 40, 0.95f, 0.0f}}) {
+        const double t_reference = us_per_sample([&]() {
+            for (int i = 0; i < kSamplesPerRun; i++) {
+                sink = sample_top_p_top_k_reference(logits.data(), last_n_tokens, c.top_k, c.top_p, c.temp, 1.1f, rng);
+            }
+        });
+        SamplingParams params;
+        params.top_k = c.top_k;
+        params.top_p = c.top_p;
+        params.temp = c.temp;
+        Sampler sampler(params);
+        const double t_sampler = us_per_sample([&]() {
+            for (int i = 0; i < kSamplesPerRun; i++) {
+                sink = sampler.sample(logits.data(), kVocab, last_n_tokens.data(), last_n_tokens.size(), rng);
+            }
+        });
+        printf("%-28s %16.1f %16.1f\n", c.name, t_reference, t_sampler);
+    }
+    return 0;
+}
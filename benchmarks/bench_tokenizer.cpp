@@ -0,0 +1,101 @@
+// Benchmark for tokenizing long documents.
+//
+// Compares llama_tokenize() in the vendored llama.cpp against BpeTokenizer on documents of
+// growing size, and checks that both give the same tokens. Only the vocabulary is loaded.
+//
+// Usage: bench_tokenizer <model file> [corpus file]
+// Without a corpus file the documents are built from this file's own source text.
+#include "bpe_tokenizer.h"
+#include "llama.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static const size_t kTokensPerRun = 1 << 20;
+
+static std::string read_file(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    return buffer.str();
+}
+
+template <typename Fn>
+static double seconds(Fn&& fn)
+{
+    const auto t_start = std::chrono::steady_clock::now();
+    fn();
+    const auto t_end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double>(t_end - t_start).count();
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <model file> [corpus file]\n", argv[0]);
+        return 1;
+    }
+    llama_context_params params = llama_context_default_params();
+    params.vocab_only = true;
+    llama_context* ctx = llama_init_from_file(argv[1], params);
+    if (ctx == nullptr) {
+        return 1;
+    }
+    BpeTokenizer tokenizer(argv[1]);
+    if (!tokenizer.is_loaded() || !tokenizer.matches(ctx)) {
+        fprintf(stderr, "%s: the vocabulary in the model file does not match the loaded one\n", argv[0]);
+        return 1;
+    }
+    std::string corpus = read_file(argc > 2 ? argv[2] : __FILE__);
+    if (corpus.empty()) {
+        fprintf(stderr, "%s: empty corpus\n", argv[0]);
+        return 1;
+    }
+
+    printf("%10s %22s %22s\n", "doc bytes", "llama_tokenize (tok/s)", "BpeTokenizer (tok/s)");
+    for (size_t doc_size : {256, 4096, 65536, 1 << 20}) {
+        std::string doc;
+        while (doc.size() < doc_size) {
+            doc += corpus;
+        }
+        doc.resize(doc_size);
+        // Do not end inside a UTF-8 sequence
+        while (!doc.empty() && (static_cast<uint8_t>(doc.back()) & 0xC0) == 0x80) {
+            doc.pop_back();
+        }
+
+        std::vector<llama_token> expected(doc.size() + 1);
+        expected.resize(llama_tokenize(ctx, doc.c_str(), expected.data(), expected.size(), true));
+        std::vector<llama_token> tokens;
+        tokenizer.tokenize(doc.c_str(), strlen(doc.c_str()), true, tokens);
+        if (tokens != expected) {
+            fprintf(stderr, "%s: different tokens for a document of %zu bytes\n", argv[0], doc.size());
+            return 1;
+        }
+
+        const size_t n_runs = std::max<size_t>(1, kTokensPerRun / expected.size());
+        std::vector<llama_token> buffer(doc.size() + 1);
+        const double t_reference = seconds([&]() {
+            for (size_t i = 0; i < n_runs; i++) {
+                llama_tokenize(ctx, doc.c_str(), buffer.data(), buffer.size(), true);
+            }
+        });
+        const double t_bpe = seconds([&]() {
+            for (size_t i = 0; i < n_runs; i++) {
+                tokens.clear();
+                tokenizer.tokenize(doc.c_str(), strlen(doc.c_str()), true, tokens);
+            }
+        });
+        const double n_tokens = (double) n_runs * expected.size();
+        printf("%10zu %22.0f %22.0f\n", doc.size(), n_tokens / t_reference, n_tokens / t_bpe);
+    }
+    llama_free(ctx);
+    return 0;
+}
@@ -0,0 +1,231 @@
+#include "bpe_tokenizer.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <queue>
+
+namespace {
+
+const uint32_t magic_ggml = 0x67676d6c; // unversioned, no scores
+const uint32_t magic_ggmf = 0x67676d66;
+const uint32_t magic_ggjt = 0x67676a74;
+// n_vocab, n_embd, n_mult, n_head, n_layer, n_rot, ftype
+const int n_hparams = 7;
+
+uint32_t hash_bytes(const char* text, size_t size)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ static_cast<uint8_t>(text[i])) * 16777619u;
+    }
+    return hash;
+}
+
+// Length of the UTF-8 sequence starting with `byte`, as llama.cpp's utf8_len()
+size_t utf8_len(char byte)
+{
+    static const size_t lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
+    return lookup[static_cast<uint8_t>(byte) >> 4];
+}
+
+struct Symbol {
+    int prev;
+    int next;
+    uint32_t begin;
+    uint32_t n;
+};
+
+struct Bigram {
+    int left;
+    int right;
+    float score;
+    uint32_t size;
+};
+
+// Highest score first, then leftmost. Same order as llama_sp_bigram::comparator, which together with
+// the same sequence of pushes makes the queue pop in exactly the same order.
+struct BigramOrder {
+    bool operator()(const Bigram& l, const Bigram& r) const
+    {
+        return l.score < r.score || (l.score == r.score && l.left > r.left);
+    }
+};
+
+}  // namespace
+
+BpeTokenizer::BpeTokenizer(const std::string& path_model)
+{
+    std::ifstream file(path_model, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path_model.c_str());
+        return;
+    }
+    auto read_u32 = [&file]() {
+        uint32_t value = 0;
+        file.read(reinterpret_cast<char*>(&value), sizeof(value));
+        return value;
+    };
+
+    const uint32_t magic = read_u32();
+    if (magic != magic_ggml && magic != magic_ggmf && magic != magic_ggjt) {
+        fprintf(stderr, "%s: '%s' is not a ggml model file\n", __func__, path_model.c_str());
+        return;
+    }
+    if (magic != magic_ggml) {
+        read_u32(); // file version
+    }
+    const uint32_t n_vocab = read_u32();
+    for (int i = 1; i < n_hparams; i++) {
+        read_u32();
+    }
+
+    std::vector<uint32_t> token_offsets(1, 0);
+    token_offsets.reserve(n_vocab + 1);
+    scores.resize(n_vocab, 0.0f);
+    for (uint32_t id = 0; id < n_vocab && file; id++) {
+        const uint32_t size = read_u32();
+        const size_t begin = pieces.size();
+        pieces.resize(begin + size);
+        file.read(&pieces[begin], size);
+        if (magic != magic_ggml) {
+            file.read(reinterpret_cast<char*>(&scores[id]), sizeof(float));
+        }
+        token_offsets.push_back(pieces.size());
+    }
+    if (!file) {
+        fprintf(stderr, "%s: failed to read the vocabulary from '%s'\n", __func__, path_model.c_str());
+        pieces.clear();
+        scores.clear();
+        return;
+    }
+    offsets.swap(token_offsets);
+
+    // At most half full
+    uint32_t n_slots = 1;
+    while (n_slots < 2 * n_vocab) {
+        n_slots *= 2;
+    }
+    table.assign(n_slots, -1);
+    table_mask = n_slots - 1;
+    for (llama_token id = 0; id < (llama_token) n_vocab; id++) {
+        const char* text = pieces.data() + offsets[id];
+        const size_t size = offsets[id + 1] - offsets[id];
+        if (size == 0) {
+            continue;
+        }
+        for (size_t i = 1; i < size; i++) {
+            pair_in_token.set(byte_pair(text[i - 1], text[i]));
+        }
+        // Later tokens replace earlier ones with the same string, as in llama.cpp's token_to_id map
+        uint32_t slot = hash_bytes(text, size) & table_mask;
+        while (table[slot] >= 0 && !is_piece(table[slot], text, size)) {
+            slot = (slot + 1) & table_mask;
+        }
+        table[slot] = id;
+    }
+}
+
+bool BpeTokenizer::matches(llama_context* ctx) const
+{
+    if (llama_n_vocab(ctx) != n_vocab()) {
+        return false;
+    }
+    for (llama_token id = 0; id < n_vocab(); id++) {
+        const char* expected = llama_token_to_str(ctx, id);
+        const size_t size = offsets[id + 1] - offsets[id];
+        if (strlen(expected) != size || memcmp(expected, pieces.data() + offsets[id], size) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+llama_token BpeTokenizer::find(const char* text, size_t size) const
+{
+    for (uint32_t slot = hash_bytes(text, size) & table_mask; table[slot] >= 0; slot = (slot + 1) & table_mask) {
+        if (is_piece(table[slot], text, size)) {
+            return table[slot];
+        }
+    }
+    return -1;
+}
+
+// Same steps as llama_tokenizer::tokenize() in llama.cpp, one chunk at a time
+void BpeTokenizer::tokenize(const char* text, size_t size, bool add_bos, std::vector<llama_token>& out) const
+{
+    if (size == 0) {
+        return;
+    }
+    if (add_bos) {
+        out.push_back(llama_token_bos());
+    }
+
+    // Symbols of the current chunk, with prev and next local to it
+    std::vector<Symbol> symbols;
+    std::priority_queue<Bigram, std::vector<Bigram>, BigramOrder> queue;
+    auto try_add_bigram = [&](int left, int right) {
+        if (left == -1 || right == -1) {
+            return;
+        }
+        const uint32_t n = symbols[left].n + symbols[right].n;
+        const llama_token id = find(text + symbols[left].begin, n);
+        if (id >= 0) {
+            queue.push({left, right, scores[id], n});
+        }
+    };
+
+    auto tokenize_chunk = [&]() {
+        symbols.back().next = -1;
+        for (size_t i = 1; i < symbols.size(); i++) {
+            try_add_bigram(i - 1, i);
+        }
+        while (!queue.empty()) {
+            const Bigram bigram = queue.top();
+            queue.pop();
+            Symbol& left = symbols[bigram.left];
+            Symbol& right = symbols[bigram.right];
+            // Skip pairs where one side has changed since
+            if (left.n == 0 || right.n == 0 || left.n + right.n != bigram.size) {
+                continue;
+            }
+            left.n += right.n;
+            right.n = 0;
+            left.next = right.next;
+            if (right.next >= 0) {
+                symbols[right.next].prev = bigram.left;
+            }
+            try_add_bigram(left.prev, bigram.left);
+            try_add_bigram(bigram.left, left.next);
+        }
+
+        for (int i = 0; i != -1; i = symbols[i].next) {
+            const Symbol& symbol = symbols[i];
+            const llama_token id = find(text + symbol.begin, symbol.n);
+            if (id >= 0) {
+                out.push_back(id);
+            } else {
+                // Byte tokens follow <unk>, <s> and </s>
+                for (uint32_t j = 0; j < symbol.n; j++) {
+                    out.push_back(static_cast<uint8_t>(text[symbol.begin + j]) + 3);
+                }
+            }
+        }
+        symbols.clear();
+    };
+
+    // No token contains a pair of bytes that is not in pair_in_token, so no merge can cross a character
+    // boundary between two such bytes. Merging the chunks between those boundaries on their own gives the
+    // same tokens as merging the whole text, and keeps the queue small.
+    for (size_t offset = 0; offset < size;) {
+        if (offset > 0 && !pair_in_token[byte_pair(text[offset - 1], text[offset])]) {
+            tokenize_chunk();
+        }
+        const size_t n = std::min(size - offset, utf8_len(text[offset]));
+        const int index = symbols.size();
+        symbols.push_back({index - 1, index + 1, (uint32_t) offset, (uint32_t) n});
+        offset += n;
+    }
+    tokenize_chunk();
+}
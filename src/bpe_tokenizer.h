@@ -0,0 +1,70 @@
+#ifndef BPE_TOKENIZER_H
+#define BPE_TOKENIZER_H
+
+#include "llama.h"
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/* Tokenizer that gives the same tokens as llama_tokenize() in the vendored llama.cpp.
+ *
+ * Both split the text into UTF-8 characters and keep merging the adjacent pair whose concatenation
+ * is the token with the highest score, leftmost first on ties. llama.cpp builds a std::string for
+ * every candidate pair to look it up in an unordered_map and runs one priority queue over the whole
+ * text. Here a candidate is always a contiguous span of the input, so it is hashed in place and
+ * looked up in a flat open-addressing table without allocating, and the text is cut into chunks
+ * that no token can span, each merged with its own small queue. The token scores are not exposed
+ * by llama.h, so they are read from the model file.
+ */
+class BpeTokenizer {
+    public:
+        // Read the vocabulary and the token scores from a ggml, ggmf or ggjt model file
+        explicit BpeTokenizer(const std::string& path_model);
+
+        // Check if the vocabulary was read successfully
+        bool is_loaded() const { return !offsets.empty(); }
+        int n_vocab() const { return (int) scores.size(); }
+        // Check that every token has the same string as in `ctx`
+        bool matches(llama_context* ctx) const;
+
+        // Append the tokens of `text` to `out`. Like llama_tokenize(), an empty text gives no tokens
+        // at all, and characters that are not in the vocabulary are written as byte tokens.
+        void tokenize(const char* text, size_t size, bool add_bos, std::vector<llama_token>& out) const;
+        // True if the valid UTF-8 `text` can be cut at `pos` without changing its tokens: tokenizing
+        // text[0, pos) and text[pos, size) on their own gives the same tokens as the whole text.
+        bool can_split(const char* text, size_t size, size_t pos) const
+        {
+            if (pos == 0 || pos >= size) {
+                return true;
+            }
+            // Not inside a character, and no token spans the two bytes
+            return (static_cast<uint8_t>(text[pos]) & 0xC0) != 0x80 && !pair_in_token[byte_pair(text[pos - 1], text[pos])];
+        }
+
+    private:
+        static size_t byte_pair(char first, char second)
+        {
+            return (size_t) static_cast<uint8_t>(first) << 8 | static_cast<uint8_t>(second);
+        }
+        // Token with exactly this string, -1 if there is none
+        llama_token find(const char* text, size_t size) const;
+        bool is_piece(llama_token id, const char* text, size_t size) const
+        {
+            return offsets[id + 1] - offsets[id] == size && memcmp(pieces.data() + offsets[id], text, size) == 0;
+        }
+
+        std::string pieces{};
+        // The string of token i is pieces[offsets[i], offsets[i + 1])
+        std::vector<uint32_t> offsets{};
+        std::vector<float> scores{};
+        // Open addressing with linear probing, -1 marks an empty slot
+        std::vector<llama_token> table{};
+        uint32_t table_mask = 0;
+        // Bit (a << 8 | b) is set if some token contains byte a followed by byte b
+        std::bitset<65536> pair_in_token{};
+};
+
+#endif /* BPE_TOKENIZER_H */
@@ -0,0 +1,71 @@
+#include "detokenizer.h"
+
+PieceTable::PieceTable(llama_context* ctx)
+{
+    const int n_vocab = llama_n_vocab(ctx);
+    offsets.reserve(n_vocab + 1);
+    offsets.push_back(0);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        text += llama_token_to_str(ctx, id);
+        offsets.push_back(text.size());
+    }
+    text.shrink_to_fit();
+}
+
+size_t PieceTable::text_size(const llama_token* ids, size_t n) const
+{
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += size(ids[i]);
+    }
+    return total;
+}
+
+void PieceTable::append(const llama_token* ids, size_t n, std::string& out) const
+{
+    out.reserve(out.size() + text_size(ids, n));
+    for (size_t i = 0; i < n; i++) {
+        out.append(data(ids[i]), size(ids[i]));
+    }
+}
+
+// Cut off a trailing lead byte whose continuation bytes have not all arrived yet
+size_t utf8_complete_size(const char* text, size_t size)
+{
+    // A sequence is at most 4 bytes, so its lead byte is within the last 4
+    const size_t n_back = size < 4 ? size : 4;
+    for (size_t i = 1; i <= n_back; i++) {
+        const uint8_t byte = static_cast<uint8_t>(text[size - i]);
+        if ((byte & 0xC0) == 0x80) {
+            // Continuation byte
+            continue;
+        }
+        size_t length = 1;
+        if ((byte & 0xE0) == 0xC0) {
+            length = 2;
+        } else if ((byte & 0xF0) == 0xE0) {
+            length = 3;
+        } else if ((byte & 0xF8) == 0xF0) {
+            length = 4;
+        }
+        return length > i ? size - i : size;
+    }
+    // Only continuation bytes, which no later byte can complete
+    return size;
+}
+
+std::string StreamingDetokenizer::feed(const llama_token* ids, size_t n)
+{
+    pieces->append(ids, n, pending);
+    const size_t n_complete = utf8_complete_size(pending.data(), pending.size());
+    std::string out = pending.substr(0, n_complete);
+    pending.erase(0, n_complete);
+    return out;
+}
+
+std::string StreamingDetokenizer::flush()
+{
+    std::string out;
+    out.swap(pending);
+    return out;
+}
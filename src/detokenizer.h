@@ -0,0 +1,65 @@
+#ifndef DETOKENIZER_H
+#define DETOKENIZER_H
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* The strings of every token in a vocabulary, stored back to back in one buffer.
+ *
+ * Detokenizing through the table sums the piece sizes first, so the output is allocated
+ * once, and never calls back into llama.h, so it is safe without holding the context.
+ */
+class PieceTable {
+    public:
+        // Read the vocabulary of a context. Only uses vocabulary queries.
+        explicit PieceTable(llama_context* ctx);
+
+        int n_vocab() const { return (int) offsets.size() - 1; }
+        // String of a token as returned by llama_token_to_str(). `id` must be in range.
+        const char* data(llama_token id) const { return text.data() + offsets[id]; }
+        size_t size(llama_token id) const { return offsets[id + 1] - offsets[id]; }
+        // Total length of the strings of n tokens
+        size_t text_size(const llama_token* ids, size_t n) const;
+        // Append the strings of n tokens to `out`, growing it at most once
+        void append(const llama_token* ids, size_t n, std::string& out) const;
+
+    private:
+        std::string text{};
+        std::vector<uint32_t> offsets{};
+};
+
+// Length of the longest prefix of `text` that does not end inside a UTF-8 sequence. Only an
+// incomplete sequence at the very end is cut off; invalid bytes elsewhere are left alone.
+size_t utf8_complete_size(const char* text, size_t size);
+
+/* Turns a stream of tokens into text one token at a time.
+ *
+ * A character can be split over several tokens (byte fallback tokens carry one byte each), so
+ * the bytes of an incomplete UTF-8 sequence at the end are held until the rest arrives and
+ * only whole characters are returned.
+ */
+class StreamingDetokenizer {
+    public:
+        explicit StreamingDetokenizer(std::shared_ptr<const PieceTable> pieces) : pieces(pieces) {}
+
+        // Add the text of n tokens and return the complete characters that are now available
+        std::string feed(const llama_token* ids, size_t n);
+        std::string feed(llama_token id) { return feed(&id, 1); }
+        // Return the held bytes, even if they do not form a complete character, and start over
+        std::string flush();
+        int n_vocab() const { return pieces->n_vocab(); }
+        // Number of bytes held back
+        size_t n_pending() const { return pending.size(); }
+        // Drop the held bytes
+        void reset() { pending.clear(); }
+
+    private:
+        std::shared_ptr<const PieceTable> pieces;
+        std::string pending{};
+};
+
+#endif /* DETOKENIZER_H */
@@ -0,0 +1,132 @@
+#include "kv_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+namespace {
+
+// Upper bound on the ggml object and tensor headers in front of the K data and between K and V
+const size_t kHeaderSlack = 512;
+// The vendored llama.cpp allocates 2 MB for the headers on top of the K and V data
+const size_t kReserved = 2u * 1024 * 1024;
+
+}  // namespace
+
+KvCacheLayout::KvCacheLayout(llama_context* ctx, bool f16_kv)
+    : buffer_size(llama_get_kv_cache_size(ctx)), n_ctx(llama_n_ctx(ctx))
+{
+    const size_t row = (size_t) llama_n_embd(ctx) * (f16_kv ? 2 : 4);
+    const size_t layer_size = row * n_ctx;
+    // A vocab_only context has no cache
+    if (layer_size == 0 || buffer_size == 0) {
+        return;
+    }
+    const size_t n = buffer_size > kReserved ? (buffer_size - kReserved) / (2 * layer_size) : 0;
+    if (n == 0 || buffer_size != 2 * n * layer_size + kReserved) {
+        fprintf(stderr, "%s: unknown KV cache layout, switching sessions copies the whole cache\n", __func__);
+        return;
+    }
+    row_size = row;
+    n_layer = n;
+    v_offset = n * layer_size;
+    if (!probe(ctx)) {
+        fprintf(stderr, "%s: unexpected KV cache layout, switching sessions copies the whole cache\n", __func__);
+        row_size = 0;
+    }
+}
+
+// Evaluate two tokens from position 0 and check that every byte they write lies in ranges(2), and that
+// each of those ranges is written. Rows of V stored transposed, or any other layout, write elsewhere.
+// The cache, its token count and the timings are put back afterwards.
+bool KvCacheLayout::probe(llama_context* ctx) const
+{
+    const uint8_t* kv = llama_get_kv_cache(ctx);
+    const std::vector<uint8_t> before(kv, kv + buffer_size);
+    const int token_count = llama_get_kv_cache_token_count(ctx);
+    const llama_token tokens[2] = {llama_token_bos(), llama_token_bos()};
+    const int n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    bool ok = llama_eval(ctx, tokens, 2, 0, n_threads) == 0;
+
+    kv = llama_get_kv_cache(ctx);
+    const auto runs = ranges(2);
+    std::vector<bool> written(runs.size(), false);
+    size_t r = 0;
+    for (size_t i = 0; i < buffer_size && ok; i++) {
+        if (kv[i] == before[i]) {
+            continue;
+        }
+        while (r < runs.size() && i >= runs[r].second) {
+            r++;
+        }
+        ok = r < runs.size() && i >= runs[r].first;
+        if (ok) {
+            written[r] = true;
+        }
+    }
+    ok = ok && std::all_of(written.begin(), written.end(), [](bool w) { return w; });
+    llama_set_kv_cache(ctx, before.data(), before.size(), token_count);
+    llama_reset_timings(ctx);
+    return ok;
+}
+
+// One run per layer for K and for V, merged where they touch
+std::vector<std::pair<size_t, size_t>> KvCacheLayout::ranges(int n_tokens) const
+{
+    std::vector<std::pair<size_t, size_t>> res;
+    if (n_tokens <= 0 || buffer_size == 0) {
+        return res;
+    }
+    if (row_size == 0 || n_tokens >= n_ctx) {
+        res.push_back(std::make_pair((size_t) 0, buffer_size));
+        return res;
+    }
+    const size_t layer_size = row_size * n_ctx;
+    const size_t used = row_size * n_tokens;
+    auto add = [&](size_t begin, size_t end) {
+        end = std::min(end, buffer_size);
+        if (!res.empty() && begin <= res.back().second) {
+            res.back().second = std::max(res.back().second, end);
+        } else {
+            res.push_back(std::make_pair(begin, end));
+        }
+    };
+    for (size_t il = 0; il < n_layer; il++) {
+        add(il * layer_size, il * layer_size + used + kHeaderSlack);
+    }
+    for (size_t il = 0; il < n_layer; il++) {
+        add(v_offset + il * layer_size, v_offset + il * layer_size + used + 2 * kHeaderSlack);
+    }
+    return res;
+}
+
+size_t KvCacheLayout::saved_size(int n_tokens) const
+{
+    size_t size = 0;
+    for (const auto& run : ranges(n_tokens)) {
+        size += run.second - run.first;
+    }
+    return size;
+}
+
+void KvCacheLayout::save(llama_context* ctx, int n_tokens, std::vector<uint8_t>& dst) const
+{
+    dst.resize(saved_size(n_tokens));
+    const uint8_t* kv = llama_get_kv_cache(ctx);
+    uint8_t* out = dst.data();
+    for (const auto& run : ranges(n_tokens)) {
+        memcpy(out, kv + run.first, run.second - run.first);
+        out += run.second - run.first;
+    }
+}
+
+void KvCacheLayout::load(llama_context* ctx, int n_tokens, const uint8_t* src) const
+{
+    // llama_set_kv_cache() only takes the whole buffer. The one llama_get_kv_cache() points to
+    // is the context's own, so the used runs are written there directly.
+    uint8_t* kv = const_cast<uint8_t*>(llama_get_kv_cache(ctx));
+    for (const auto& run : ranges(n_tokens)) {
+        memcpy(kv + run.first, src, run.second - run.first);
+        src += run.second - run.first;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef KV_CACHE_H
+#define KV_CACHE_H
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* Copies of the used part of a context's KV cache.
+ *
+ * llama_get_kv_cache() exposes the whole buffer, n_ctx positions per layer, while a session
+ * usually fills only the first few. The vendored llama.cpp stores K and then V, each one row
+ * of n_embd values per position, layer after layer, after a small ggml header. The bytes of
+ * positions [0, n) are therefore 2 * n_layer runs, found from the buffer size alone. Each run
+ * is widened by the largest header size, so the copy is a superset; the extra bytes are
+ * headers that never change or positions the owner does not use.
+ * The layout is checked once, when the context is created, by evaluating two tokens and comparing
+ * the bytes they changed with the runs it predicts. If the buffer size does not fit the layout or
+ * the check fails (e.g. V stored transposed, as newer llama.cpp does), the whole buffer is copied.
+ */
+class KvCacheLayout {
+    public:
+        KvCacheLayout() = default;
+        // Work out the layout of the context's cache. Evaluates a probe, so the context must not be in use.
+        KvCacheLayout(llama_context* ctx, bool f16_kv);
+
+        // Copy positions [0, n_tokens) of the context's cache into `dst`, replacing its contents
+        void save(llama_context* ctx, int n_tokens, std::vector<uint8_t>& dst) const;
+        // Write a copy made by save() with the same n_tokens back into the context's cache
+        void load(llama_context* ctx, int n_tokens, const uint8_t* src) const;
+        void load(llama_context* ctx, int n_tokens, const std::vector<uint8_t>& src) const
+        {
+            load(ctx, n_tokens, src.data());
+        }
+        // Size of a copy made by save() for n_tokens positions
+        size_t saved_size(int n_tokens) const;
+
+    private:
+        // Byte ranges [first, second) of the buffer that hold positions [0, n_tokens)
+        std::vector<std::pair<size_t, size_t>> ranges(int n_tokens) const;
+        // Check the layout against the bytes an eval actually writes
+        bool probe(llama_context* ctx) const;
+
+        size_t buffer_size = 0;
+        int n_ctx = 0;
+        // Bytes of one position in one layer, 0 if the layout is not known
+        size_t row_size = 0;
+        size_t n_layer = 0;
+        // Offset of the V rows
+        size_t v_offset = 0;
+};
+
+#endif /* KV_CACHE_H */
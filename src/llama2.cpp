@@ -1,35 +1,186 @@
 #include "ggml.h"
 #include "llama.h"
+#include "llama_async.h"
+#include "llama_embed.h"
+#include "llama_grammar.h"
+#include "llama_model.h"
+#include "llama_sampler.h"
+#include "llama_scheduler.h"
+#include "detokenizer.h"
+#include "prompt_template.h"
+#include "stop_matcher.h"
 #include "llama_wrapper.h"
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include "pybind11/functional.h"
 #include "pybind11/numpy.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
 #include <iostream>
 namespace py = pybind11;
 using Callback = std::function<void(double)>;
 
 
-class LlamaInference;
-/* Tokenizer for use with text-ui project */
+// Decode generated text for Python. Invalid UTF-8 is replaced instead of raising.
+static py::str decode_utf8(const char* text, size_t size)
+{
+    PyObject* str = PyUnicode_DecodeUTF8(text, size, "replace");
+    if (str == nullptr) {
+        throw py::error_already_set();
+    }
+    return py::reinterpret_steal<py::str>(str);
+}
+
+// Zero-copy float32 view of logits with shape [n_rows, n_vocab].
+// The view keeps `owner` alive, so the buffer must stay at the same address for as long as `owner` lives.
+static py::array_t<float> logits_view(float* logits, int n_rows, int n_vocab, py::object owner)
+{
+    return py::array_t<float>(
+        {(py::ssize_t) n_rows, (py::ssize_t) n_vocab},                          // shape
+        {(py::ssize_t) (sizeof(float) * n_vocab), (py::ssize_t) sizeof(float)}, // strides in bytes
+        logits,
+        owner
+    );
+}
+
+// 1-D numpy array that takes over `data` instead of copying it
+template <typename T>
+static py::array_t<T> vector_array(std::vector<T>&& data)
+{
+    auto owner = new std::vector<T>(std::move(data));
+    py::capsule free_owner(owner, [](void* ptr) { delete reinterpret_cast<std::vector<T>*>(ptr); });
+    return py::array_t<T>({(py::ssize_t) owner->size()}, {(py::ssize_t) sizeof(T)}, owner->data(), free_owner);
+}
+
+// Tokenize texts with the GIL released. Returns (tokens, offsets): an int32 array with the tokens of
+// all texts back to back and an int64 array where text i is tokens[offsets[i]:offsets[i + 1]].
+template <typename Tokenize>
+static py::tuple tokenize_batch_arrays(Tokenize tokenize)
+{
+    std::vector<llama_token> tokens;
+    std::vector<int64_t> offsets;
+    {
+        py::gil_scoped_release release;
+        tokenize(tokens, offsets);
+    }
+    return py::make_tuple(vector_array(std::move(tokens)), vector_array(std::move(offsets)));
+}
+
+// Check that token ids passed from Python are in the vocabulary
+static void check_tokens(const std::vector<llama_token>& tokens, int n_vocab)
+{
+    for (const llama_token id : tokens) {
+        if (id < 0 || id >= n_vocab) {
+            throw std::out_of_range("Token id " + std::to_string(id) + " is out of range");
+        }
+    }
+}
+
+// Parse the name of an embedding pooling mode
+static EmbeddingPooling parse_pooling(const std::string& name)
+{
+    if (name == "last") {
+        return EmbeddingPooling::LAST;
+    } else if (name == "mean") {
+        return EmbeddingPooling::MEAN;
+    } else if (name == "both") {
+        return EmbeddingPooling::BOTH;
+    }
+    throw std::invalid_argument("Unknown pooling '" + name + "', expected 'last', 'mean' or 'both'");
+}
+
+// Output array for embed_batch: [n_texts, n_embd], or [n_texts, 2, n_embd] when pooling both ways
+static py::array_t<float> embeddings_array(size_t n_texts, EmbeddingPooling pooling, int n_embd)
+{
+    if (pooling == EmbeddingPooling::BOTH) {
+        return py::array_t<float>({(py::ssize_t) n_texts, (py::ssize_t) 2, (py::ssize_t) n_embd});
+    }
+    return py::array_t<float>({(py::ssize_t) n_texts, (py::ssize_t) n_embd});
+}
+
+/* Tokenizer for use with text-ui project.
+ * Only uses the vocabulary of the model, so it can be loaded on its own with vocab_only and
+ * shared between threads.
+ */
 class Tokenizer {
-    const LlamaInference& llama;
+    std::shared_ptr<LlamaModel> model;
+    llama_context* ctx;
+    std::shared_ptr<const BpeTokenizer> bpe_tokenizer;
 public:
-    Tokenizer(const LlamaInference& llama): llama(llama) {}
-    std::vector<llama_token> tokenize(const std::string & text, bool bos);
-    std::string detokenize(const std::vector<llama_token>& ids);
-    std::string detokenize(const llama_token& id);
+    // Load only the vocabulary from a model file, without the weights
+    Tokenizer(const std::string& path_model): Tokenizer(load_vocab(path_model)) {}
+    // Vocabulary of a loaded model
+    Tokenizer(std::shared_ptr<LlamaModel> model)
+        : model(model), ctx(model->get_ctx()), bpe_tokenizer(model->get_bpe_tokenizer())
+    {}
+    std::vector<llama_token> tokenize(const std::string & text, bool bos) const;
+    py::tuple tokenize_batch(const std::vector<std::string>& texts, bool add_bos, int n_threads) const;
+    std::string detokenize(const std::vector<llama_token>& ids) const;
+    std::string detokenize(const llama_token& id) const;
+    // Detokenize each sequence. Needs no lease, so it can run without the GIL.
+    std::vector<std::string> detokenize_many(const std::vector<std::vector<llama_token>>& sequences) const;
+    // Detokenizer that only returns complete UTF-8 characters
+    StreamingDetokenizer streaming_detokenizer() const;
+    int get_n_vocab() const { return llama_n_vocab(ctx); }
+
+private:
+    static std::shared_ptr<LlamaModel> load_vocab(const std::string& path_model)
+    {
+        llama_context_params params = llama_context_default_params();
+        params.vocab_only = true;
+        auto model = std::make_shared<LlamaModel>(path_model, params);
+        if (!model->is_loaded()) {
+            throw std::runtime_error("Failed to load vocabulary from " + path_model);
+        }
+        return model;
+    }
 };
 
 // Lower level API that gives more direct access to llama_context
 class LlamaContext
 {
+    std::shared_ptr<LlamaModel> model;
+    mutable LlamaSessionState session{};
     llama_context* ctx;
-public:
-    LlamaContext(std::string path_model, const llama_context_params& params) {
-        ctx = llama_init_from_file(path_model.c_str(), params);
+    Sampler sampler{};
+    std::mt19937 rng{};
+
+    // Logits of the last evaluated token
+    const float* last_logits() const
+    {
+        return session.logits.data() + (size_t) std::max(session.n_logit_rows - 1, 0) * llama_n_vocab(ctx);
+    }
+    // Whether the embeddings of ctx can be handed out as a view: no other session can stash over them
+    bool owns_outputs() const
+    {
+        return model.use_count() == 1;
     }
+public:
+    LlamaContext(std::string path_model, const llama_context_params& params)
+        : LlamaContext(std::make_shared<LlamaModel>(path_model, params))
+    {}
     LlamaContext(std::string path_model, const llama_context_params& params, Callback progress_cb)
+        : LlamaContext(load_with_progress(path_model, params, progress_cb))
+    {}
+    // Context that shares its weights with other contexts created from the same model
+    LlamaContext(std::shared_ptr<LlamaModel> model) : model(model)
+    {
+        if (!model->is_loaded()) {
+            throw std::runtime_error("Failed to load model");
+        }
+        ctx = model->get_ctx();
+        model->init_session(&session);
+        const int seed = model->get_params().seed;
+        rng.seed(seed < 0 ? std::random_device{}() : seed);
+        sampler.set_params(SamplingParams());
+    }
+    ~LlamaContext()
+    {
+        model->release(&session);
+    }
+
+    static std::shared_ptr<LlamaModel> load_with_progress(std::string path_model, const llama_context_params& params, Callback progress_cb)
     {
         llama_context_params params_with_cb = params;
         params_with_cb.progress_callback = [](float progress, void* user_data) {
@@ -38,11 +189,7 @@ public:
         };
         params_with_cb.progress_callback_user_data = &progress_cb;
 
-        ctx = llama_init_from_file(path_model.c_str(), params_with_cb);
-    }
-    ~LlamaContext()
-    {
-        llama_free(ctx);
+        return std::make_shared<LlamaModel>(path_model, params_with_cb);
     }
 
     // Run the llama inference to obtain the logits and probabilities for the next token.
@@ -64,7 +211,15 @@ public:
             throw std::runtime_error("Invalid number of tokens");
         }
         llama_token* tokens_ptr = (llama_token*)tokens.request().ptr;
-        return llama_eval(ctx, tokens_ptr, n_tokens, n_past, n_threads);
+        auto lease = model->acquire(&session);
+        const int res = llama_eval(ctx, tokens_ptr, n_tokens, n_past, n_threads);
+        if (res == 0) {
+            model->take_logits(&session, n_tokens);
+        }
+        session.is_stashed = false;
+        // Like llama_eval(), anything after the new tokens counts as overwritten
+        session.kv_token_count = n_past + n_tokens;
+        return res;
     }
 
     // Sample a token from the logits
@@ -82,34 +237,114 @@ public:
         }
         llama_token* last_n_tokens_ptr = (llama_token*)last_n_tokens_info.ptr;
         size_t last_n_tokens_size = last_n_tokens_info.size;
+        auto lease = model->acquire(&session);
+        // llama_sample_top_p_top_k() reads the context's own buffer, which another session may have
+        // overwritten since. The last row goes back in place, with any changes made through get_logits().
+        if (session.n_logit_rows > 0) {
+            memcpy(llama_get_logits(ctx), last_logits(), sizeof(float) * llama_n_vocab(ctx));
+        }
         return llama_sample_top_p_top_k(ctx, last_n_tokens_ptr, last_n_tokens_size, top_k, top_p, temp, repeat_penalty);
     }
 
+    // Set the sampling parameters (top_k, top_p, min_p, typical_p, temp, penalties, mirostat) used by sample()
+    void set_sampling_params(const InferenceParams& params)
+    {
+        sampler.set_params(get_sampling_params(params));
+    }
+
+    // Sample a token from the logits of the last evaluated token with the sampler chain.
+    // Penalties apply to the tokens in last_n_tokens.
+    llama_token sample(py::buffer last_n_tokens_data)
+    {
+        py::buffer_info last_n_tokens_info = last_n_tokens_data.request();
+        // Check that tokens are integers and one-dimensional
+        if (last_n_tokens_info.format != py::format_descriptor<llama_token>::format() ||
+            last_n_tokens_info.ndim != 1) {
+            throw std::runtime_error("Invalid tokens buffer format");
+        }
+        const llama_token* last_n_tokens_ptr = (const llama_token*)last_n_tokens_info.ptr;
+        py::gil_scoped_release release;
+        auto lease = model->acquire(&session);
+        return sampler.sample(last_logits(), llama_n_vocab(ctx), last_n_tokens_ptr, last_n_tokens_info.size, rng);
+    }
+
+    // Take the most likely token after the repeat penalties, skipping the rest of the sampler chain
+    llama_token sample_greedy(py::buffer last_n_tokens_data)
+    {
+        py::buffer_info last_n_tokens_info = last_n_tokens_data.request();
+        // Check that tokens are integers and one-dimensional
+        if (last_n_tokens_info.format != py::format_descriptor<llama_token>::format() ||
+            last_n_tokens_info.ndim != 1) {
+            throw std::runtime_error("Invalid tokens buffer format");
+        }
+        const llama_token* last_n_tokens_ptr = (const llama_token*)last_n_tokens_info.ptr;
+        py::gil_scoped_release release;
+        auto lease = model->acquire(&session);
+        return sampler.sample_greedy(last_logits(), llama_n_vocab(ctx), last_n_tokens_ptr, last_n_tokens_info.size);
+    }
+
+    // Add a bias to the logits of some tokens on every following sample, replacing previous biases for them
+    void set_logit_bias(const std::map<llama_token, float>& biases)
+    {
+        for (const auto& bias : biases) {
+            check_tokens({bias.first}, llama_n_vocab(ctx));
+        }
+        auto lease = model->acquire(&session);
+        for (const auto& bias : biases) {
+            sampler.get_logit_bias().set_bias(bias.first, bias.second);
+        }
+    }
+    void clear_logit_bias()
+    {
+        auto lease = model->acquire(&session);
+        sampler.get_logit_bias().clear_bias();
+    }
+    // Never sample these tokens until they are unbanned
+    void ban_tokens(const std::vector<llama_token>& tokens)
+    {
+        check_tokens(tokens, llama_n_vocab(ctx));
+        auto lease = model->acquire(&session);
+        for (const llama_token id : tokens) {
+            sampler.get_logit_bias().ban(id);
+        }
+    }
+    void unban_tokens(const std::vector<llama_token>& tokens)
+    {
+        check_tokens(tokens, llama_n_vocab(ctx));
+        auto lease = model->acquire(&session);
+        for (const llama_token id : tokens) {
+            sampler.get_logit_bias().unban(id);
+        }
+    }
+    void clear_bans()
+    {
+        auto lease = model->acquire(&session);
+        sampler.get_logit_bias().clear_bans();
+    }
+
     // Token logits obtained from the last call to eval()
     // The logits for the last token are stored in the last row
-    // Can be mutated in order to change the probabilities of the next token
-    // TODO: Fix this so that it returns a 2D array
-    // Length: n_vocab
-    py::memoryview get_logits() const
+    // Rows: n_tokens of the last eval() if logits_all is set, 1 otherwise
+    // Cols: n_vocab
+    // A view of the session's own buffer, which stays in place across evals and session switches.
+    // The next eval() overwrites it. Can be mutated in order to change the probabilities of the next token.
+    py::array_t<float> get_logits() const
     {
-        const float* logit_ptr = llama_get_logits(ctx);
-        const size_t n_vocab = llama_n_vocab(ctx);
-        return py::memoryview::from_memory(
-            logit_ptr,                // buffer pointer
-            sizeof(float) * n_vocab   // strides in bytes
-        );
+        return logits_view(session.logits.data(), session.n_logit_rows, llama_n_vocab(ctx), py::cast(this));
     }
 
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
-    py::memoryview get_embeddings() const
+    // A view for a context with its own model, a copy otherwise
+    py::array_t<float> get_embeddings() const
     {
-        const float* embd_ptr = llama_get_embeddings(ctx);
+        auto lease = model->acquire(&session);
+        float* embd_ptr = session.is_stashed ? session.embeddings.data() : llama_get_embeddings(ctx);
         const size_t n_embd = llama_n_embd(ctx);
-        return py::memoryview::from_memory(
-            embd_ptr,                // buffer pointer
-            sizeof(float) * n_embd   // strides in bytes
-        );
+        if (owns_outputs()) {
+            return py::array_t<float>({(py::ssize_t) n_embd}, {(py::ssize_t) sizeof(float)}, embd_ptr, py::cast(this));
+        }
+        return vector_array(std::vector<float>(embd_ptr, embd_ptr + n_embd));
     }
 
     // Get the number of tokens in the vocabulary
@@ -137,7 +372,8 @@ public:
         return llama_token_to_str(ctx, token);
     }
 
-    // String -> Token Id. Uses the vocabulary in the provided context
+    // String -> Token Id. Uses the vocabulary in the provided context. Calls llama_tokenize() directly,
+    // so it is the reference for the faster tokenizer used everywhere else.
     py::array str_to_token(const std::string& text, bool add_bos) const
     {
         std::vector<llama_token> res(text.size() + (int)add_bos);
@@ -147,6 +383,49 @@ public:
         return py::array(res.size(), res.data());
     }
 
+    // Tokenize many texts in parallel. Returns (tokens, offsets), see tokenize_batch_arrays().
+    py::tuple tokenize_batch(const std::vector<std::string>& texts, bool add_bos, int n_threads) const
+    {
+        return tokenize_batch_arrays([&](std::vector<llama_token>& tokens, std::vector<int64_t>& offsets) {
+            ::tokenize_batch(ctx, model->get_bpe_tokenizer().get(), texts, add_bos, n_threads, tokens, offsets);
+        });
+    }
+
+    // Embed each text from an empty context, pooling the per-token embeddings.
+    // Overwrites the KV cache. Requires the context to be created with embedding = True.
+    // Returns [n_texts, n_embd], or [n_texts, 2, n_embd] (last, mean) for pooling="both"
+    py::array_t<float> embed_batch(const std::vector<std::string>& texts, const std::string& pooling_name,
+                                   bool add_bos, int n_threads, int n_batch)
+    {
+        if (!model->get_params().embedding) {
+            throw std::runtime_error("The context was not created with embedding enabled");
+        }
+        const EmbeddingPooling pooling = parse_pooling(pooling_name);
+        const int n_embd = llama_n_embd(ctx);
+        py::array_t<float> out = embeddings_array(texts.size(), pooling, n_embd);
+        float* out_ptr = out.mutable_data();
+        bool ok = true;
+        {
+            py::gil_scoped_release release;
+            auto lease = model->acquire(&session);
+            std::vector<llama_token> tokens;
+            for (size_t i = 0; i < texts.size() && ok; i++) {
+                tokens.resize(texts[i].size() + (int) add_bos);
+                const int n = llama_tokenize(ctx, texts[i].c_str(), tokens.data(), tokens.size(), add_bos);
+                tokens.resize(std::max(n, 0));
+                ok = embed_tokens(ctx, tokens, pooling, n_threads, n_batch, out_ptr + i * embedding_size(pooling, n_embd));
+            }
+            session.n_logit_rows = 1;
+            session.is_stashed = false;
+            // The embeddings overwrote the cache from the start
+            session.kv_token_count = 0;
+        }
+        if (!ok) {
+            throw std::runtime_error("Failed to embed texts");
+        }
+        return out;
+    }
+
     // Performance information
     void print_timings() const
     {
@@ -165,14 +444,22 @@ public:
     LlamaWrapper llama{};
     InferenceParams params{};
     LlamaInference(InferenceParams params): params(params), llama(params) {
-        llama.init();
+        if (!llama.init()) {
+            throw std::runtime_error("Failed to load model");
+        }
+    }
+    // Session on a model shared with other LlamaInference/LlamaContext instances
+    LlamaInference(std::shared_ptr<LlamaModel> model, InferenceParams params): params(params), llama(model, params) {
+        if (!llama.init()) {
+            throw std::runtime_error("Failed to load model");
+        }
     }
 
     // Get tokenizer for the provided context
     // Returns a Tokenizer object
     Tokenizer get_tokenizer() const
     {
-        return Tokenizer(*this);
+        return Tokenizer(llama.get_model());
     }
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
@@ -180,6 +467,7 @@ public:
     // Returns 0 on success
     int eval()
     {
+        check_idle();
         return llama.eval();
     }
 
@@ -193,29 +481,44 @@ public:
 
     // Token logits obtained from the last call to eval()
     // The logits for the last token are stored in the last row
-    // Can be mutated in order to change the probabilities of the next token
-    // Rows: n_tokens
+    // Rows: n_tokens of the last eval() if logits_all is set, 1 otherwise
     // Cols: n_vocab
-    py::memoryview get_logits() const
+    // A view of the session's own buffer, which stays in place across evals and session switches.
+    // The next eval overwrites it. Can be mutated in order to change the probabilities of the next token.
+    py::array_t<float> get_logits()
     {
-        const float* logit_ptr = llama.get_logits();
-        const size_t n_vocab = llama.get_n_vocab();
-        return py::memoryview::from_memory(
-            logit_ptr,                // buffer pointer
-            sizeof(float) * n_vocab   // strides in bytes
-        );
+        check_idle();
+        return logits_view(llama.get_logits(), llama.get_n_logit_rows(), llama.get_n_vocab(), py::cast(this));
     }
 
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
-    py::memoryview get_embeddings() const
+    py::array_t<float> get_embeddings() const
     {
-        const float* embd_ptr = llama.get_embeddings();
-        const size_t n_embd = llama.get_n_embd();
-        return py::memoryview::from_memory(
-            embd_ptr,                // buffer pointer
-            sizeof(float) * n_embd   // strides in bytes
-        );
+        check_idle();
+        std::vector<float> embeddings;
+        llama.get_embeddings(embeddings);
+        return vector_array(std::move(embeddings));
+    }
+
+    // Embed each text from an empty context, pooling the per-token embeddings.
+    // Clears the input and the context. Requires ctx_params.embedding = True.
+    // Returns [n_texts, n_embd], or [n_texts, 2, n_embd] (last, mean) for pooling="both"
+    py::array_t<float> embed_batch(const std::vector<std::string>& texts, const std::string& pooling_name, bool add_bos)
+    {
+        check_idle();
+        const EmbeddingPooling pooling = parse_pooling(pooling_name);
+        py::array_t<float> out = embeddings_array(texts.size(), pooling, llama.get_n_embd());
+        float* out_ptr = out.mutable_data();
+        bool ok;
+        {
+            py::gil_scoped_release release;
+            ok = llama.embed_batch(texts, pooling, add_bos, out_ptr);
+        }
+        if (!ok) {
+            throw std::runtime_error("Failed to embed texts");
+        }
+        return out;
     }
 
     // Token Id -> String. Uses the vocabulary in the provided context
@@ -224,59 +527,352 @@ public:
         return llama.token_to_str(token);
     }
 
-    // String -> Token Id. Uses the vocabulary in the provided context
+    // Sample a token from the logits and add it to the input
     llama_token sample()
     {
+        check_idle();
         return llama.sample();
     }
+    // Take the most likely token and add it to the input
+    llama_token sample_greedy()
+    {
+        check_idle();
+        return llama.sample_greedy();
+    }
+    // Add a bias to the logits of some tokens on every following sample, replacing previous biases for them
+    void set_logit_bias(const std::map<llama_token, float>& biases)
+    {
+        check_idle();
+        std::vector<std::pair<llama_token, float>> entries(biases.begin(), biases.end());
+        for (const auto& bias : entries) {
+            check_tokens({bias.first}, llama.get_n_vocab());
+        }
+        llama.set_logit_bias(entries);
+    }
+    void clear_logit_bias()
+    {
+        check_idle();
+        llama.clear_logit_bias();
+    }
+    // Never sample these tokens until they are unbanned
+    void ban_tokens(const std::vector<llama_token>& tokens)
+    {
+        check_idle();
+        check_tokens(tokens, llama.get_n_vocab());
+        llama.ban_tokens(tokens);
+    }
+    void unban_tokens(const std::vector<llama_token>& tokens)
+    {
+        check_idle();
+        check_tokens(tokens, llama.get_n_vocab());
+        llama.unban_tokens(tokens);
+    }
+    void clear_bans()
+    {
+        check_idle();
+        llama.clear_bans();
+    }
+    // Tokenize many texts in parallel. Returns (tokens, offsets), see tokenize_batch_arrays().
+    py::tuple tokenize_batch(const std::vector<std::string>& texts, bool add_bos, int n_threads) const
+    {
+        return tokenize_batch_arrays([&](std::vector<llama_token>& tokens, std::vector<int64_t>& offsets) {
+            llama.tokenize_batch(texts, add_bos, n_threads, tokens, offsets);
+        });
+    }
+    // Counters of the tokenize cache enabled with InferenceParams.n_token_cache
+    TokenCacheStats get_token_cache_stats() const
+    {
+        return llama.get_token_cache_stats();
+    }
+    void clear_token_cache()
+    {
+        llama.clear_token_cache();
+    }
+    // Counters of the drafted tokens of speculative generate() calls
+    SpeculativeStats get_speculative_stats() const
+    {
+        check_idle();
+        return llama.get_speculative_stats();
+    }
+    // Only sample tokens that keep the output within the grammar, starting from its root
+    void set_grammar(std::shared_ptr<Grammar> grammar)
+    {
+        check_idle();
+        llama.set_grammar(grammar);
+    }
+    void clear_grammar()
+    {
+        check_idle();
+        llama.set_grammar(nullptr);
+    }
+    // Change the sampling parameters used for the following tokens. Only the sampling fields
+    // of params (top_k, top_p, min_p, typical_p, temp, penalties, mirostat) are used.
+    void set_sampling_params(const InferenceParams& params)
+    {
+        check_idle();
+        llama.set_sampling_params(get_sampling_params(params));
+    }
+    // Run the decode loop in C++ with the GIL released and return the generated text.
+    // Generation ends at EOS, after n_predict tokens or when one of the stop strings is produced
+    // (the stop string is not included). If a callback is given it is called with the new text
+    // every `callback_interval` tokens, and generation stops if it returns False.
+    py::str generate(int n_predict, const std::vector<std::string>& stop, py::object callback, int callback_interval)
+    {
+        check_idle();
+        StopMatcher matcher(stop);
+        std::string text;
+        size_t n_sent = 0;
+        int n_since_callback = 0;
+
+        // Hand the text that can no longer turn into a stop string to the callback. Needs the GIL.
+        auto send = [&](bool is_final) {
+            const size_t n_held = is_final ? 0 : matcher.n_held();
+            size_t n_ready = text.size() > n_sent + n_held ? text.size() - n_held : n_sent;
+            if (!is_final) {
+                // Wait for the rest of a character split over several tokens
+                n_ready = n_sent + utf8_complete_size(text.data() + n_sent, n_ready - n_sent);
+            }
+            py::object res = callback(decode_utf8(text.data() + n_sent, n_ready - n_sent));
+            n_sent = n_ready;
+            return res.is_none() || res.cast<bool>();
+        };
+
+        {
+            py::gil_scoped_release release;
+            llama.generate(n_predict, [&](llama_token id) {
+                const std::string piece = llama.token_to_str(id);
+                text += piece;
+                if (matcher.feed(piece)) {
+                    text.resize(matcher.match_begin());
+                    return false;
+                }
+                if (!callback.is_none() && ++n_since_callback >= callback_interval) {
+                    n_since_callback = 0;
+                    py::gil_scoped_acquire acquire;
+                    return send(false);
+                }
+                return true;
+            });
+        }
+        if (!callback.is_none() && n_sent < text.size()) {
+            send(true);
+        }
+        return decode_utf8(text.data(), text.size());
+    }
+
+    // Start generating on a background thread. The pieces are taken from the returned object.
+    std::shared_ptr<AsyncGeneration> generate_async(int n_predict, size_t max_queued, const std::vector<std::string>& stop)
+    {
+        check_idle();
+        auto running = std::make_shared<AsyncGeneration>(llama, n_predict, std::max(max_queued, (size_t) 1), stop);
+        async_generation = running;
+        return running;
+    }
+
+    // Generate n completions of one prompt, evaluating the prompt once. Each completion ends at EOS,
+    // after n_predict tokens or at a stop string, which is not included.
+    std::vector<py::str> generate_n(const std::vector<llama_token>& prompt, int n, int n_predict,
+                                    const std::vector<std::string>& stop)
+    {
+        check_idle();
+        check_tokens(prompt, llama.get_n_vocab());
+        std::vector<std::string> texts(std::max(n, 0));
+        std::vector<StopMatcher> matchers(texts.size(), StopMatcher(stop));
+        std::vector<std::vector<llama_token>> tokens;
+        bool is_ok = false;
+        {
+            py::gil_scoped_release release;
+            is_ok = llama.generate_n(prompt, n, n_predict, tokens, [&](int i, llama_token id) {
+                const std::string piece = llama.token_to_str(id);
+                texts[i] += piece;
+                if (matchers[i].feed(piece)) {
+                    texts[i].resize(matchers[i].match_begin());
+                    return false;
+                }
+                return true;
+            });
+        }
+        if (!is_ok) {
+            throw std::runtime_error("Failed to evaluate the prompt");
+        }
+        std::vector<py::str> res;
+        for (const auto& text : texts) {
+            res.push_back(decode_utf8(text.data(), text.size()));
+        }
+        return res;
+    }
+    std::vector<py::str> generate_n(const std::string& prompt, int n, int n_predict, const std::vector<std::string>& stop)
+    {
+        return generate_n(llama.tokenize_text(prompt), n, n_predict, stop);
+    }
+
+    // Beam search from a prompt. Returns (text, score) of the best beam, and the session continues from it.
+    py::tuple beam_search(const std::vector<llama_token>& prompt, int n_beams, int n_predict, float length_penalty)
+    {
+        check_idle();
+        check_tokens(prompt, llama.get_n_vocab());
+        BeamSearchResult result;
+        bool is_ok = false;
+        {
+            py::gil_scoped_release release;
+            is_ok = llama.beam_search(prompt, n_beams, n_predict, length_penalty, result);
+        }
+        if (!is_ok) {
+            throw std::runtime_error("Beam search failed");
+        }
+        std::string text;
+        for (const llama_token id : result.tokens) {
+            text += llama.token_to_str(id);
+        }
+        return py::make_tuple(decode_utf8(text.data(), text.size()), result.score);
+    }
+    py::tuple beam_search(const std::string& prompt, int n_beams, int n_predict, float length_penalty)
+    {
+        return beam_search(llama.tokenize_text(prompt), n_beams, n_predict, length_penalty);
+    }
+
     // Add BOS token to the input
     void add_bos()
     {
+        check_idle();
         llama.add_bos();
     }
+    // set input using tokens, reusing the part of the KV cache that matches
+    void set_input(const std::vector<llama_token>& tokens)
+    {
+        check_idle();
+        llama.set_input(tokens);
+    }
+    // set input using string, reusing the part of the KV cache that matches
+    void set_input(const std::string& text)
+    {
+        check_idle();
+        llama.set_input(text);
+    }
     // update input using tokens
     void update_input(const std::vector<llama_token>& tokens)
     {
+        check_idle();
         llama.update_input(tokens);
     }
     // update input using string
     void update_input(const std::string& text)
     {
+        check_idle();
         llama.update_input(text);
     }
+    // update input using a template filled in with values, without tokenizing its static text again
+    void update_input(const PromptTemplate& prompt, const std::map<std::string, std::string>& values)
+    {
+        check_idle();
+        std::vector<llama_token> tokens;
+        std::string error;
+        if (!prompt.render(values, false, tokens, &error)) {
+            throw std::invalid_argument(error);
+        }
+        llama.update_input(tokens);
+    }
 
     bool has_unconsumed_input() const {
+        check_idle();
         return llama.has_unconsumed_input();
     }
 
+    int get_n_past() const {
+        check_idle();
+        return llama.get_n_past();
+    }
+
     void ingest_all_pending_input()
     {
+        check_idle();
         llama.ingest_all_pending_input();
     }
 
+    // Save the session (KV cache, input, repeat window and RNG state) to a file
+    void save_session(const std::string& path) const
+    {
+        check_idle();
+        if (!llama.save_session(path)) {
+            throw std::runtime_error("Failed to save session to " + path);
+        }
+    }
+    // Restore a session saved with save_session()
+    void load_session(const std::string& path)
+    {
+        check_idle();
+        if (!llama.load_session(path)) {
+            throw std::runtime_error("Failed to load session from " + path);
+        }
+    }
+
     // Performance information
     void print_timings()
     {
+        check_idle();
         llama.print_timings();
     }
     void reset_timings()
     {
+        check_idle();
         llama.reset_timings();
     }
+
+private:
+    // The worker of generate_async() uses the wrapper until it finishes, so everything else that
+    // touches the wrapper has to wait for it
+    void check_idle() const
+    {
+        auto running = async_generation.lock();
+        if (running && !running->is_finished()) {
+            throw std::runtime_error("An async generation is running on this instance, cancel it or wait for it to finish");
+        }
+    }
+
+    std::weak_ptr<AsyncGeneration> async_generation{};
 };
 
-std::vector<llama_token> Tokenizer::tokenize(const std::string & text, bool bos) {
-    return llama.tokenize(text, bos);
-}
-std::string Tokenizer::detokenize(const std::vector<llama_token>& ids) {
-    std::string output = "";
-    for (auto id: ids) {
-        output += detokenize(id);
+std::vector<llama_token> Tokenizer::tokenize(const std::string & text, bool bos) const {
+    if (bpe_tokenizer) {
+        std::vector<llama_token> res;
+        bpe_tokenizer->tokenize(text.c_str(), strlen(text.c_str()), bos, res);
+        return res;
     }
+    std::vector<llama_token> res(text.size() + (int)bos);
+    int n = llama_tokenize(ctx, text.c_str(), res.data(), res.size(), bos);
+    assert(n >= 0);
+    res.resize(n);
+    return res;
+}
+py::tuple Tokenizer::tokenize_batch(const std::vector<std::string>& texts, bool add_bos, int n_threads) const {
+    return tokenize_batch_arrays([&](std::vector<llama_token>& tokens, std::vector<int64_t>& offsets) {
+        ::tokenize_batch(ctx, bpe_tokenizer.get(), texts, add_bos, n_threads, tokens, offsets);
+    });
+}
+std::string Tokenizer::detokenize(const std::vector<llama_token>& ids) const {
+    auto pieces = model->get_piece_table();
+    check_tokens(ids, pieces->n_vocab());
+    std::string output;
+    pieces->append(ids.data(), ids.size(), output);
     return output;
 }
-std::string Tokenizer::detokenize(const llama_token& id) {
-    return llama.token_to_str(id);
+std::string Tokenizer::detokenize(const llama_token& id) const {
+    check_tokens({id}, get_n_vocab());
+    return llama_token_to_str(ctx, id);
+}
+std::vector<std::string> Tokenizer::detokenize_many(const std::vector<std::vector<llama_token>>& sequences) const {
+    auto pieces = model->get_piece_table();
+    for (const auto& ids : sequences) {
+        check_tokens(ids, pieces->n_vocab());
+    }
+    std::vector<std::string> outputs(sequences.size());
+    for (size_t i = 0; i < sequences.size(); i++) {
+        pieces->append(sequences[i].data(), sequences[i].size(), outputs[i]);
+    }
+    return outputs;
+}
+StreamingDetokenizer Tokenizer::streaming_detokenizer() const {
+    return StreamingDetokenizer(model->get_piece_table());
 }
 
 
@@ -312,41 +908,153 @@ PYBIND11_MODULE(llamacpp, m) {
         .def_readwrite("top_p", &InferenceParams::top_p)
         .def_readwrite("temp", &InferenceParams::temp)
         .def_readwrite("repeat_penalty", &InferenceParams::repeat_penalty)
+        .def_readwrite("frequency_penalty", &InferenceParams::frequency_penalty)
+        .def_readwrite("presence_penalty", &InferenceParams::presence_penalty)
+        .def_readwrite("min_p", &InferenceParams::min_p)
+        .def_readwrite("typical_p", &InferenceParams::typical_p)
+        .def_readwrite("mirostat", &InferenceParams::mirostat)
+        .def_readwrite("mirostat_tau", &InferenceParams::mirostat_tau)
+        .def_readwrite("mirostat_eta", &InferenceParams::mirostat_eta)
         .def_readwrite("use_mlock", &InferenceParams::use_mlock)
         .def_readwrite("memory_f16", &InferenceParams::memory_f16)
         .def_readwrite("n_ctx", &InferenceParams::n_ctx)
+        .def_readwrite("n_token_cache", &InferenceParams::n_token_cache)
+        .def_readwrite("path_draft_model", &InferenceParams::path_draft_model)
+        .def_readwrite("n_draft", &InferenceParams::n_draft)
+        .def_readwrite("n_lookup", &InferenceParams::n_lookup)
+        .def_readwrite("lookup_ngram", &InferenceParams::lookup_ngram)
+        .def_readwrite("ctx_shift", &InferenceParams::ctx_shift)
+        .def_readwrite("n_keep", &InferenceParams::n_keep)
         .def_readwrite("callback", &InferenceParams::callback);
 
+    /* Wrapper for Grammar */
+    py::class_<Grammar, std::shared_ptr<Grammar>>(m, "Grammar")
+        .def_static("from_gbnf", [](const std::string& text, const std::string& root) {
+            std::string error;
+            auto grammar = Grammar::from_gbnf(text, root, &error);
+            if (!grammar) {
+                throw std::invalid_argument(error);
+            }
+            return grammar;
+        }, "Parse a grammar in GBNF", py::arg("text"), py::arg("root") = "root")
+        .def_static("from_regex", [](const std::string& pattern) {
+            std::string error;
+            auto grammar = Grammar::from_regex(pattern, &error);
+            if (!grammar) {
+                throw std::invalid_argument(error);
+            }
+            return grammar;
+        }, "Grammar for text that fully matches a regular expression", py::arg("pattern"))
+        .def_static("regex_to_gbnf", [](const std::string& pattern) {
+            std::string gbnf, error;
+            if (!Grammar::regex_to_gbnf(pattern, &gbnf, &error)) {
+                throw std::invalid_argument(error);
+            }
+            return gbnf;
+        }, "Translate a regular expression to GBNF", py::arg("pattern"))
+        .def_static("json", &Grammar::json, "Grammar for a JSON object or array");
+
+    /* Wrapper for PromptTemplate */
+    py::class_<PromptTemplate, std::shared_ptr<PromptTemplate>>(m, "PromptTemplate")
+        .def(py::init([](const LlamaInference& inference, const std::string& text) {
+            std::string error;
+            auto prompt = PromptTemplate::compile(text, inference.llama.get_model(), &error);
+            if (!prompt) {
+                throw std::invalid_argument(error);
+            }
+            return prompt;
+        }), "Compile a prompt with {name} placeholders for the vocabulary of a model", py::arg("model"), py::arg("text"))
+        .def("render", [](const PromptTemplate& prompt, const std::map<std::string, std::string>& values, bool add_bos) {
+            std::vector<llama_token> tokens;
+            std::string error;
+            if (!prompt.render(values, add_bos, tokens, &error)) {
+                throw std::invalid_argument(error);
+            }
+            return tokens;
+        }, "Tokens of the template filled in with values", py::arg("values"), py::arg("add_bos") = false)
+        .def_property_readonly("placeholders", &PromptTemplate::placeholders, "Placeholder names in order of appearance");
+
+    /* Wrapper for LlamaModel */
+    py::class_<LlamaModel, std::shared_ptr<LlamaModel>>(m, "LlamaModel")
+        .def(py::init([](std::string path_model, const llama_context_params& params) {
+            auto model = std::make_shared<LlamaModel>(path_model, params);
+            if (!model->is_loaded()) {
+                throw std::runtime_error("Failed to load model");
+            }
+            return model;
+        }), py::arg("path_model"), py::arg("params"))
+        .def(py::init([](std::string path_model, const llama_context_params& params, Callback progress_cb) {
+            auto model = LlamaContext::load_with_progress(path_model, params, progress_cb);
+            if (!model->is_loaded()) {
+                throw std::runtime_error("Failed to load model");
+            }
+            return model;
+        }), py::arg("path_model"), py::arg("params"), py::arg("progress_callback"));
+
     /* Wrapper for LlamaContext */
     py::class_<LlamaContext>(m, "LlamaContext")
         .def(py::init<std::string, const llama_context_params&>(), py::arg("path_model"), py::arg("params")) 
         .def(py::init<std::string, const llama_context_params&, Callback>(), py::arg("path_model"), py::arg("params"), py::arg("progress_callback"))
+        .def(py::init<std::shared_ptr<LlamaModel>>(), py::arg("model"))
         .def("get_n_vocab", &LlamaContext::get_n_vocab, "Get the number of tokens in the vocabulary")
         .def("get_n_embd", &LlamaContext::get_n_embd, "Get the number of dimensions in the embedding")
         .def("get_n_ctx", &LlamaContext::get_n_ctx, "Get the number of tokens in the context")
+        .def("get_logits", &LlamaContext::get_logits, "Get the logits of the last eval as a [n_tokens, n_vocab] numpy array")
+        .def("embed_batch", &LlamaContext::embed_batch, "Embed many texts into a [n_texts, n_embd] numpy array",
+                py::arg("texts"), py::arg("pooling") = "last", py::arg("add_bos") = true,
+                py::arg("n_threads") = 4, py::arg("n_batch") = 512)
         .def("get_embeddings", &LlamaContext::get_embeddings, "Get the embeddings as a numpy array")
         .def("token_to_str", &LlamaContext::token_to_str, "Convert a token id to a string")
         .def("str_to_token", &LlamaContext::str_to_token, "Convert a string to a token id")
+        .def("tokenize_batch", &LlamaContext::tokenize_batch,
+                "Tokenize a list of texts in parallel into (tokens, offsets) arrays",
+                py::arg("texts"), py::arg("add_bos") = false, py::arg("n_threads") = -1)
         .def("print_timings", &LlamaContext::print_timings, "Print the timings for the last call to eval()")
         .def("reset_timings", &LlamaContext::reset_timings, "Reset the timings for the last call to eval()")
         .def("eval", &LlamaContext::eval, "Run the llama inference to obtain the logits and probabilities for the next token",
                 py::call_guard<py::gil_scoped_release>())
-        .def("sample_top_p_top_k", &LlamaContext::sample_top_p_top_k, "Sample a token from the logits using top-p and top-k");
+        .def("sample_top_p_top_k", &LlamaContext::sample_top_p_top_k, "Sample a token from the logits using top-p and top-k")
+        .def("set_sampling_params", &LlamaContext::set_sampling_params, "Set the sampling parameters used by sample()",
+                py::arg("params"))
+        .def("sample", &LlamaContext::sample, "Sample a token from the logits with the sampler chain",
+                py::arg("last_n_tokens"))
+        .def("sample_greedy", &LlamaContext::sample_greedy, "Take the most likely token after the repeat penalties",
+                py::arg("last_n_tokens") = py::array_t<llama_token>(0))
+        .def("set_logit_bias", &LlamaContext::set_logit_bias, "Add {token: bias} to the logits on every following sample",
+                py::arg("biases"))
+        .def("clear_logit_bias", &LlamaContext::clear_logit_bias, "Remove all logit biases")
+        .def("ban_tokens", &LlamaContext::ban_tokens, "Never sample the given tokens", py::arg("tokens"))
+        .def("unban_tokens", &LlamaContext::unban_tokens, "Allow banned tokens again", py::arg("tokens"))
+        .def("clear_bans", &LlamaContext::clear_bans, "Remove all token bans");
 
     /* Wrapper for LlamaInference methods */
     py::class_<LlamaInference>(m, "LlamaInference")
         .def(py::init<InferenceParams>(), py::arg("params"))
+        .def(py::init<std::shared_ptr<LlamaModel>, InferenceParams>(), py::arg("model"), py::arg("params"))
+        .def("set_input", py::overload_cast<const std::vector<llama_token>&>(&LlamaInference::set_input), "Replace the input with the provided tokens, reusing any cached prefix")
+        .def("set_input", py::overload_cast<const std::string&>(&LlamaInference::set_input), "Replace the input with the provided text, reusing any cached prefix")
         .def("update_input", py::overload_cast<const std::vector<llama_token>&>(&LlamaInference::update_input), "Update the input with the provided tokens")
         .def("update_input", py::overload_cast<const std::string&>(&LlamaInference::update_input), "Update the input with the provided text")
+        .def("update_input", py::overload_cast<const PromptTemplate&, const std::map<std::string, std::string>&>(&LlamaInference::update_input),
+                "Update the input with a PromptTemplate filled in with values", py::arg("prompt"), py::arg("values"))
         .def("eval", &LlamaInference::eval, "Run the llama inference to obtain the logits and probabilities for the next token",
                 py::call_guard<py::gil_scoped_release>())
         .def("add_bos", &LlamaInference::add_bos)
         .def("tokenize", &LlamaInference::tokenize, "Convert the provided text into tokens",
                 py::arg("text"), py::arg("add_bos"))
+        .def("get_token_cache_stats", &LlamaInference::get_token_cache_stats, "Get the hit and miss counters of the tokenize cache")
+        .def("clear_token_cache", &LlamaInference::clear_token_cache, "Empty the tokenize cache and reset its counters")
+        .def("get_speculative_stats", &LlamaInference::get_speculative_stats, "Get the counts of drafted, accepted and rejected tokens")
+        .def("tokenize_batch", &LlamaInference::tokenize_batch,
+                "Tokenize a list of texts in parallel into (tokens, offsets) arrays",
+                py::arg("texts"), py::arg("add_bos") = false, py::arg("n_threads") = -1)
         .def("has_unconsumed_input", &LlamaInference::has_unconsumed_input, "Check if there is unconsumed input")
+        .def("get_n_past", &LlamaInference::get_n_past, "Get the number of tokens in the KV cache")
         .def("ingest_all_pending_input", &LlamaInference::ingest_all_pending_input, "Ingest all pending input")
-        .def("get_logits", &LlamaInference::get_logits, "Get the logits for the last token", py::call_guard<py::gil_scoped_release>())
+        .def("get_logits", &LlamaInference::get_logits, "Get the logits of the last eval as a [n_tokens, n_vocab] numpy array")
         .def("get_embeddings", &LlamaInference::get_embeddings, "Get the embeddings for the last token")
+        .def("embed_batch", &LlamaInference::embed_batch, "Embed many texts into a [n_texts, n_embd] numpy array",
+                py::arg("texts"), py::arg("pooling") = "last", py::arg("add_bos") = true)
         .def("token_to_str", &LlamaInference::token_to_str, "Convert a token to a string",
                 py::arg("token"))
         .def_static("token_bos", &llama_token_bos, "Get the token for the beginning of a sentence")
@@ -355,14 +1063,145 @@ PYBIND11_MODULE(llamacpp, m) {
         .def("reset_timings", &LlamaInference::reset_timings, "Reset the timings for the last call to eval()")
         .def_static("system_info", &llama_print_system_info, "Print system information")
         .def("sample", &LlamaInference::sample, "Sample a token from the logits")
+        .def("sample_greedy", &LlamaInference::sample_greedy, "Take the most likely token and add it to the input")
+        .def("set_logit_bias", &LlamaInference::set_logit_bias, "Add {token: bias} to the logits on every following sample",
+                py::arg("biases"))
+        .def("clear_logit_bias", &LlamaInference::clear_logit_bias, "Remove all logit biases")
+        .def("ban_tokens", &LlamaInference::ban_tokens, "Never sample the given tokens", py::arg("tokens"))
+        .def("unban_tokens", &LlamaInference::unban_tokens, "Allow banned tokens again", py::arg("tokens"))
+        .def("clear_bans", &LlamaInference::clear_bans, "Remove all token bans")
+        .def("set_grammar", &LlamaInference::set_grammar, "Constrain the following samples to a Grammar",
+                py::arg("grammar"))
+        .def("clear_grammar", &LlamaInference::clear_grammar, "Remove the grammar constraint")
+        .def("set_sampling_params", &LlamaInference::set_sampling_params, "Change the sampling parameters for the following tokens",
+                py::arg("params"))
+        .def("generate", &LlamaInference::generate, "Generate text in C++, optionally streaming it to a callback",
+                py::arg("n_predict") = -1, py::arg("stop") = std::vector<std::string>{},
+                py::arg("callback") = py::none(), py::arg("callback_interval") = 1)
+        .def("generate_n", py::overload_cast<const std::vector<llama_token>&, int, int, const std::vector<std::string>&>(&LlamaInference::generate_n),
+                "Generate n completions of the prompt tokens, evaluating the prompt once",
+                py::arg("prompt"), py::arg("n"), py::arg("n_predict") = -1, py::arg("stop") = std::vector<std::string>{})
+        .def("generate_n", py::overload_cast<const std::string&, int, int, const std::vector<std::string>&>(&LlamaInference::generate_n),
+                "Generate n completions of the prompt text, evaluating the prompt once",
+                py::arg("prompt"), py::arg("n"), py::arg("n_predict") = -1, py::arg("stop") = std::vector<std::string>{})
+        .def("beam_search", py::overload_cast<const std::vector<llama_token>&, int, int, float>(&LlamaInference::beam_search),
+                "Replace the input with the prompt tokens and return (text, score) of the best beam",
+                py::arg("prompt"), py::arg("n_beams") = 4, py::arg("n_predict") = -1, py::arg("length_penalty") = 1.0f)
+        .def("beam_search", py::overload_cast<const std::string&, int, int, float>(&LlamaInference::beam_search),
+                "Replace the input with the prompt text and return (text, score) of the best beam",
+                py::arg("prompt"), py::arg("n_beams") = 4, py::arg("n_predict") = -1, py::arg("length_penalty") = 1.0f)
+        .def("generate_async", &LlamaInference::generate_async, "Generate on a background thread and return an AsyncGeneration",
+                py::arg("n_predict") = -1, py::arg("max_queued") = 64, py::arg("stop") = std::vector<std::string>{},
+                py::keep_alive<0, 1>())
+        .def("save_session", &LlamaInference::save_session, "Save the session state to a file",
+                py::arg("path"), py::call_guard<py::gil_scoped_release>())
+        .def("load_session", &LlamaInference::load_session, "Restore the session state from a file",
+                py::arg("path"), py::call_guard<py::gil_scoped_release>())
         .def("get_tokenizer", &LlamaInference::get_tokenizer, "Get the tokenizer");
         
 
+    /* Wrapper for AsyncGeneration */
+    py::class_<AsyncGeneration, std::shared_ptr<AsyncGeneration>>(m, "AsyncGeneration")
+        .def("poll", [](AsyncGeneration& generation, int max_items) {
+            py::list pieces;
+            for (const auto& piece : generation.poll(max_items)) {
+                pieces.append(py::make_tuple(piece.id, decode_utf8(piece.text.data(), piece.text.size())));
+            }
+            return pieces;
+        }, "Take up to max_items (token, text) pairs without blocking", py::arg("max_items") = -1)
+        .def("wait", [](const AsyncGeneration& generation, double timeout) {
+            return generation.wait(timeout < 0 ? -1 : (int) (timeout * 1000));
+        }, "Wait until there is something to poll or the generation is done. Returns False on timeout",
+                py::arg("timeout") = -1.0, py::call_guard<py::gil_scoped_release>())
+        .def("cancel", &AsyncGeneration::cancel, "Stop generating at the next token boundary")
+        .def_property_readonly("finished", &AsyncGeneration::is_finished, "True once no more tokens will be produced")
+        .def_property_readonly("done", &AsyncGeneration::is_done, "True once finished and everything has been polled");
+
+    /* Wrapper for TokenCacheStats */
+    py::class_<TokenCacheStats>(m, "TokenCacheStats")
+        .def_readonly("hits", &TokenCacheStats::hits)
+        .def_readonly("misses", &TokenCacheStats::misses)
+        .def_readonly("size", &TokenCacheStats::size)
+        .def_readonly("capacity", &TokenCacheStats::capacity);
+
+    /* Wrapper for SpeculativeStats */
+    py::class_<SpeculativeStats>(m, "SpeculativeStats")
+        .def_readonly("n_drafted", &SpeculativeStats::n_drafted)
+        .def_readonly("n_accepted", &SpeculativeStats::n_accepted)
+        .def_readonly("n_rejected", &SpeculativeStats::n_rejected);
+
+    py::class_<GenerationResult>(m, "GenerationResult")
+        .def_readonly("tokens", &GenerationResult::tokens)
+        .def_readonly("text", &GenerationResult::text)
+        .def_readonly("cancelled", &GenerationResult::cancelled)
+        .def_readonly("failed", &GenerationResult::failed);
+
+    /* Wrapper for GenerationScheduler */
+    py::class_<GenerationScheduler>(m, "GenerationScheduler")
+        .def(py::init<std::shared_ptr<LlamaModel>, int>(), py::arg("model"), py::arg("n_turn_tokens") = 8)
+        .def("submit", py::overload_cast<const std::vector<llama_token>&, const InferenceParams&, const std::vector<std::string>&>(&GenerationScheduler::submit),
+                "Queue a generation request for the provided prompt tokens", py::arg("prompt"), py::arg("params"),
+                py::arg("stop") = std::vector<std::string>{})
+        .def("submit", py::overload_cast<const std::string&, const InferenceParams&, const std::vector<std::string>&>(&GenerationScheduler::submit),
+                "Queue a generation request for the provided prompt text", py::arg("prompt"), py::arg("params"),
+                py::arg("stop") = std::vector<std::string>{})
+        .def("is_done", &GenerationScheduler::is_done, "Check if a request has finished", py::arg("id"))
+        .def("wait", &GenerationScheduler::wait, "Wait for a request to finish and return its result",
+                py::arg("id"), py::call_guard<py::gil_scoped_release>())
+        .def("cancel", &GenerationScheduler::cancel, "Stop a request at the next token boundary", py::arg("id"))
+        .def("n_pending", &GenerationScheduler::n_pending, "Number of queued or running requests");
+
     // /* Wrapper for Tokenizer */
     py::class_<Tokenizer>(m, "Tokenizer")
-        .def("tokenize", &Tokenizer::tokenize, "Tokenize text", py::arg("text"), py::arg("add_bos") = false)
-        .def("detokenize", py::overload_cast<const std::vector<llama_token>&>(&Tokenizer::detokenize), "Detokenize text")
-        .def("detokenize", py::overload_cast<const llama_token&>(&Tokenizer::detokenize), "Detokenize single token");
+        .def(py::init<const std::string&>(), "Load only the vocabulary of a model file", py::arg("path_model"),
+                py::call_guard<py::gil_scoped_release>())
+        .def(py::init<std::shared_ptr<LlamaModel>>(), "Use the vocabulary of a loaded model", py::arg("model"))
+        .def_property_readonly("n_vocab", &Tokenizer::get_n_vocab, "Number of tokens in the vocabulary")
+        .def("tokenize", &Tokenizer::tokenize, "Tokenize text", py::arg("text"), py::arg("add_bos") = false,
+                py::call_guard<py::gil_scoped_release>())
+        .def("tokenize_batch", &Tokenizer::tokenize_batch, "Tokenize a list of texts in parallel into (tokens, offsets) arrays",
+                py::arg("texts"), py::arg("add_bos") = false, py::arg("n_threads") = -1)
+        .def("detokenize", [](Tokenizer& tokenizer, const std::vector<llama_token>& ids) {
+            const std::string text = tokenizer.detokenize(ids);
+            return decode_utf8(text.data(), text.size());
+        }, "Detokenize text")
+        .def("detokenize", [](Tokenizer& tokenizer, llama_token id) {
+            const std::string text = tokenizer.detokenize(id);
+            return decode_utf8(text.data(), text.size());
+        }, "Detokenize single token. It can be part of a character; use a StreamingDetokenizer for streams")
+        .def("detokenize_many", [](Tokenizer& tokenizer, const std::vector<std::vector<llama_token>>& sequences) {
+            std::vector<std::string> texts;
+            {
+                py::gil_scoped_release release;
+                texts = tokenizer.detokenize_many(sequences);
+            }
+            py::list res;
+            for (const auto& text : texts) {
+                res.append(decode_utf8(text.data(), text.size()));
+            }
+            return res;
+        }, "Detokenize a list of token sequences", py::arg("sequences"))
+        .def("streaming_detokenizer", &Tokenizer::streaming_detokenizer,
+                "Get a detokenizer that holds back characters split over several tokens");
+
+    /* Wrapper for StreamingDetokenizer */
+    py::class_<StreamingDetokenizer>(m, "StreamingDetokenizer")
+        .def("feed", [](StreamingDetokenizer& detokenizer, llama_token id) {
+            check_tokens({id}, detokenizer.n_vocab());
+            const std::string text = detokenizer.feed(id);
+            return decode_utf8(text.data(), text.size());
+        }, "Add a token and return the complete characters that are now available", py::arg("id"))
+        .def("feed", [](StreamingDetokenizer& detokenizer, const std::vector<llama_token>& ids) {
+            check_tokens(ids, detokenizer.n_vocab());
+            const std::string text = detokenizer.feed(ids.data(), ids.size());
+            return decode_utf8(text.data(), text.size());
+        }, "Add tokens and return the complete characters that are now available", py::arg("ids"))
+        .def("flush", [](StreamingDetokenizer& detokenizer) {
+            const std::string text = detokenizer.flush();
+            return decode_utf8(text.data(), text.size());
+        }, "Return the held bytes, replacing an incomplete character, and start over")
+        .def("reset", &StreamingDetokenizer::reset, "Drop the held bytes")
+        .def_property_readonly("n_pending", &StreamingDetokenizer::n_pending, "Number of bytes held back");
 
     /* Wrapper for llama_model_quantize */
     m.def("llama_model_quantize", &llama_model_quantize, "Quantize the LLaMA model");
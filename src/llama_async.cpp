@@ -0,0 +1,114 @@
+#include "llama_async.h"
+#include <algorithm>
+#include <chrono>
+#include <deque>
+
+// Back off from spinning to short sleeps while waiting on the other end of the queue
+static void wait_backoff(int& n_spins)
+{
+    if (n_spins < 64) {
+        n_spins++;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(n_spins < 1024 ? 50 : 500));
+        n_spins = std::min(n_spins + 1, 1024);
+    }
+}
+
+AsyncGeneration::AsyncGeneration(LlamaWrapper& llama, int n_predict, size_t max_queued,
+                                 const std::vector<std::string>& stop)
+    : queue(max_queued)
+{
+    worker = std::thread([this, &llama, n_predict, stop]() {
+        // Backpressure: wait for the consumer to make room. Returns false if cancelled meanwhile.
+        auto push = [&](GeneratedPiece&& piece) {
+            int n_spins = 0;
+            while (!queue.try_push(std::move(piece))) {
+                if (is_cancelled.load(std::memory_order_relaxed)) {
+                    return false;
+                }
+                wait_backoff(n_spins);
+            }
+            return true;
+        };
+
+        // A character split over several tokens is queued with the token that completes it. Bytes of a
+        // character that is never completed are dropped.
+        StreamingDetokenizer detokenizer(llama.get_piece_table());
+        StopMatcher matcher(stop);
+        // Pieces whose text could still be part of a stop string are held back
+        std::deque<GeneratedPiece> held;
+        size_t n_held_bytes = 0;
+        llama.generate(n_predict, [&](llama_token id) {
+            GeneratedPiece piece;
+            piece.id = id;
+            piece.text = detokenizer.feed(id);
+            n_held_bytes += piece.text.size();
+            const bool is_stopped = matcher.feed(piece.text);
+            held.push_back(std::move(piece));
+            if (is_stopped) {
+                // Hand out the text before the stop string, cutting the piece it starts in
+                size_t n_keep = matcher.match_begin() - (matcher.size() - n_held_bytes);
+                for (auto& held_piece : held) {
+                    if (n_keep == 0) {
+                        break;
+                    }
+                    held_piece.text.resize(std::min(held_piece.text.size(), n_keep));
+                    n_keep -= held_piece.text.size();
+                    if (!push(std::move(held_piece))) {
+                        break;
+                    }
+                }
+                held.clear();
+                return false;
+            }
+            while (!held.empty() && n_held_bytes - held.front().text.size() >= matcher.n_held()) {
+                n_held_bytes -= held.front().text.size();
+                GeneratedPiece ready = std::move(held.front());
+                held.pop_front();
+                if (!push(std::move(ready))) {
+                    return false;
+                }
+            }
+            return !is_cancelled.load(std::memory_order_relaxed);
+        });
+        // Generation ended without a stop string, so the rest is final
+        for (auto& held_piece : held) {
+            if (!push(std::move(held_piece))) {
+                break;
+            }
+        }
+        finished.store(true, std::memory_order_release);
+    });
+}
+
+AsyncGeneration::~AsyncGeneration()
+{
+    cancel();
+    worker.join();
+}
+
+// Take queued pieces
+std::vector<GeneratedPiece> AsyncGeneration::poll(int max_items)
+{
+    std::vector<GeneratedPiece> pieces;
+    GeneratedPiece piece;
+    while ((max_items < 0 || (int) pieces.size() < max_items) && queue.try_pop(piece)) {
+        pieces.push_back(std::move(piece));
+    }
+    return pieces;
+}
+
+// Wait for pieces or the end of the generation
+bool AsyncGeneration::wait(int timeout_ms) const
+{
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    int n_spins = 0;
+    while (queue.size() == 0 && !is_finished()) {
+        if (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        wait_backoff(n_spins);
+    }
+    return true;
+}
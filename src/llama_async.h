@@ -0,0 +1,56 @@
+#ifndef LLAMA_ASYNC_H
+#define LLAMA_ASYNC_H
+
+#include "detokenizer.h"
+#include "llama_wrapper.h"
+#include "spsc_queue.h"
+#include "stop_matcher.h"
+#include <atomic>
+#include <string>
+#include <thread>
+
+/* A token produced by an AsyncGeneration */
+struct GeneratedPiece {
+    llama_token id = 0;
+    // Complete UTF-8 characters, empty if the token only started one
+    std::string text = "";
+};
+
+/* Runs LlamaWrapper::generate() on a dedicated thread.
+ *
+ * Tokens and their text are handed to the consumer through a lock-free single producer,
+ * single consumer queue. When the queue is full the generation thread waits for the
+ * consumer to catch up instead of running ahead. The wrapper must not be used by anyone
+ * else until the generation has finished.
+ */
+class AsyncGeneration {
+    public:
+        // Generation stops before the first of the `stop` strings. Text that could still turn into one
+        // is only queued once it cannot.
+        AsyncGeneration(LlamaWrapper& llama, int n_predict, size_t max_queued,
+                        const std::vector<std::string>& stop = std::vector<std::string>());
+        ~AsyncGeneration();
+        AsyncGeneration(const AsyncGeneration&) = delete;
+        AsyncGeneration& operator=(const AsyncGeneration&) = delete;
+
+        // Take up to max_items queued pieces (all of them if max_items < 0) without blocking
+        std::vector<GeneratedPiece> poll(int max_items);
+        // Block until there is a piece to take or generation has finished, at most timeout_ms
+        // milliseconds (forever if negative). Returns true if poll() would return something
+        // or the generation is done.
+        bool wait(int timeout_ms) const;
+        // Stop generating at the next token boundary
+        void cancel() { is_cancelled.store(true, std::memory_order_relaxed); }
+        // True once the generation thread has stopped producing
+        bool is_finished() const { return finished.load(std::memory_order_acquire); }
+        // True once the generation has finished and everything has been taken
+        bool is_done() const { return is_finished() && queue.size() == 0; }
+
+    private:
+        SpscQueue<GeneratedPiece> queue;
+        std::atomic<bool> is_cancelled{false};
+        std::atomic<bool> finished{false};
+        std::thread worker{};
+};
+
+#endif /* LLAMA_ASYNC_H */
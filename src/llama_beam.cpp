@@ -0,0 +1,262 @@
+#include "llama_wrapper.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+
+/* Beam search over the shared context.
+ *
+ * The vendored llama.h has a single KV cache per context, so every beam keeps a snapshot of the
+ * used part of the cache instead: the prompt is evaluated once, and a beam that is extended by
+ * several tokens hands the same snapshot to all of its children. Each step restores a beam's
+ * snapshot, evaluates its newest token and takes a new snapshot, so no prefix is ever evaluated
+ * twice. Finished beams other than the best one drop their snapshot, as they can only be reported.
+ */
+namespace {
+
+struct KvSnapshot {
+    vector<uint8_t> data{};
+    int token_count = 0;
+};
+
+struct Beam {
+    vector<llama_token> tokens{};
+    // Sum of the log-probabilities of `tokens`, and of EOS for a finished beam
+    float log_prob = 0.0f;
+    // Cache holding the prompt and every token but the newest, which is evaluated when the beam is
+    // extended. A finished beam ended with EOS, which is not in `tokens`, so its cache holds all of them.
+    std::shared_ptr<const KvSnapshot> kv{};
+    std::shared_ptr<const GrammarState> grammar{};
+    bool is_finished = false;
+};
+
+struct Candidate {
+    int beam;
+    llama_token id;
+    float log_prob;
+};
+
+// Log-probability normalized by length, so that short beams are not always preferred
+float beam_score(const Beam& beam, float length_penalty)
+{
+    const int length = std::max((int) beam.tokens.size() + (beam.is_finished ? 1 : 0), 1);
+    return beam.log_prob / std::pow((float) length, length_penalty);
+}
+
+// The k highest scores with their tokens, in no particular order
+void top_tokens(const float* scores, int n_vocab, int k, vector<std::pair<float, llama_token>>& out)
+{
+    out.clear();
+    const auto cmp = std::greater<std::pair<float, llama_token>>();
+    for (llama_token id = 0; id < n_vocab; id++) {
+        if ((int) out.size() < k) {
+            out.emplace_back(scores[id], id);
+            std::push_heap(out.begin(), out.end(), cmp);
+        } else if (scores[id] > out.front().first) {
+            std::pop_heap(out.begin(), out.end(), cmp);
+            out.back() = std::make_pair(scores[id], id);
+            std::push_heap(out.begin(), out.end(), cmp);
+        }
+    }
+}
+
+}  // namespace
+
+// Keep the n_beams most likely continuations of the prompt
+bool LlamaWrapper::beam_search(const vector<llama_token>& prompt, int n_beams, int n_predict, float length_penalty,
+                               BeamSearchResult& result)
+{
+    if (n_beams < 1) {
+        fprintf(stderr, "%s: n_beams must be at least 1\n", __func__);
+        return false;
+    }
+    if (n_predict < 0) {
+        n_predict = inference_params.n_predict;
+    }
+    set_input(prompt);
+    if (!ingest_all_pending_input()) {
+        return false;
+    }
+
+    auto lease = acquire();
+    const int n_vocab = llama_n_vocab(ctx);
+    const int n_base = n_past;
+    n_predict = std::min(n_predict, n_ctx - n_base);
+
+    const KvCacheLayout& kv_layout = model->get_kv_layout();
+    // Copy of the first `token_count` positions of the cache
+    auto snapshot = [&](int token_count) {
+        auto kv = std::make_shared<KvSnapshot>();
+        kv_layout.save(ctx, token_count, kv->data);
+        kv->token_count = token_count;
+        return std::shared_ptr<const KvSnapshot>(kv);
+    };
+
+    vector<Beam> beams(1);
+    beams[0].kv = snapshot(n_base);
+    if (grammar) {
+        beams[0].grammar = std::make_shared<GrammarState>(*grammar);
+    }
+    vector<Beam> finished;
+    // Finished beam with the best score, the only one that keeps its snapshot
+    int best_finished = -1;
+    // Snapshot the context currently matches, to skip restoring it again
+    std::shared_ptr<const KvSnapshot> loaded = beams[0].kv;
+    // Cache of each beam after evaluating its newest token, shared by its children
+    vector<std::shared_ptr<const KvSnapshot>> extended;
+    vector<float> scores(n_vocab);
+    vector<std::pair<float, llama_token>> top;
+    vector<Candidate> candidates;
+
+    for (int step = 0; step < n_predict && !beams.empty(); step++) {
+        candidates.clear();
+        extended.assign(beams.size(), nullptr);
+        for (size_t b = 0; b < beams.size(); b++) {
+            const Beam& beam = beams[b];
+            const float* logits = nullptr;
+            if (beam.tokens.empty()) {
+                // Only the first beam, which continues right after the prompt
+                logits = last_logits();
+                extended[b] = beam.kv;
+            } else {
+                if (loaded != beam.kv) {
+                    kv_layout.load(ctx, beam.kv->token_count, beam.kv->data);
+                }
+                if (llama_eval(ctx, &beam.tokens.back(), 1, n_base + beam.tokens.size() - 1, inference_params.n_threads) != 0) {
+                    fprintf(stderr, "%s: failed to evaluate beam %zu\n", __func__, b);
+                    // The cache no longer matches any known tokens
+                    past_tokens.clear();
+                    n_past = 0;
+                    session.kv_token_count = 0;
+                    return false;
+                }
+                logits = llama_get_logits(ctx);
+                extended[b] = loaded = snapshot(n_base + beam.tokens.size());
+            }
+
+            memcpy(scores.data(), logits, sizeof(float) * n_vocab);
+            if (!sampler.get_logit_bias().empty()) {
+                sampler.get_logit_bias().apply(scores.data(), n_vocab);
+            }
+            if (beam.grammar) {
+                beam.grammar->allowed_tokens(*vocab_trie, grammar_allowed);
+                if (grammar_allowed.empty()) {
+                    grammar_allowed.push_back(llama_token_eos());
+                }
+                masked_logits.assign(n_vocab, -INFINITY);
+                for (const llama_token id : grammar_allowed) {
+                    masked_logits[id] = scores[id];
+                }
+                scores.swap(masked_logits);
+            }
+
+            // Log-softmax normalizer
+            float max_score = *std::max_element(scores.begin(), scores.end());
+            if (max_score == -INFINITY) {
+                // Every token is banned: the beam ends, as the samplers do
+                scores[llama_token_eos()] = max_score = 0.0f;
+            }
+            double sum = 0.0;
+            for (const float s : scores) {
+                sum += std::exp(s - max_score);
+            }
+            const float log_sum = max_score + (float) std::log(sum);
+
+            // Only the n_beams best tokens of a beam can be among the n_beams best extensions overall
+            top_tokens(scores.data(), n_vocab, n_beams, top);
+            for (const auto& entry : top) {
+                if (entry.first > -INFINITY) {
+                    candidates.push_back({(int) b, entry.second, beam.log_prob + entry.first - log_sum});
+                }
+            }
+        }
+
+        // All beams have the same length here, so the raw log-probabilities rank them
+        std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.log_prob > b.log_prob;
+        });
+        vector<Beam> next;
+        for (const Candidate& candidate : candidates) {
+            if ((int) next.size() == n_beams) {
+                break;
+            }
+            const Beam& parent = beams[candidate.beam];
+            Beam child;
+            child.tokens = parent.tokens;
+            child.log_prob = candidate.log_prob;
+            child.kv = extended[candidate.beam];
+            if (candidate.id == llama_token_eos()) {
+                child.is_finished = true;
+                if (best_finished < 0 ||
+                    beam_score(child, length_penalty) > beam_score(finished[best_finished], length_penalty)) {
+                    if (best_finished >= 0) {
+                        finished[best_finished].kv.reset();
+                    }
+                    best_finished = finished.size();
+                } else {
+                    child.kv.reset();
+                }
+                finished.push_back(std::move(child));
+                continue;
+            }
+            child.tokens.push_back(candidate.id);
+            if (parent.grammar) {
+                auto child_grammar = std::make_shared<GrammarState>(*parent.grammar);
+                child_grammar->accept(vocab_trie->piece(candidate.id));
+                child.grammar = child_grammar;
+            }
+            next.push_back(std::move(child));
+        }
+        beams.swap(next);
+        if ((int) finished.size() >= n_beams) {
+            break;
+        }
+    }
+
+    // Best hypothesis, finished or not
+    const Beam* best = nullptr;
+    float best_score = -INFINITY;
+    for (const vector<Beam>* list : {&finished, &beams}) {
+        for (const Beam& beam : *list) {
+            const float score = beam_score(beam, length_penalty);
+            if (best == nullptr || score > best_score) {
+                best = &beam;
+                best_score = score;
+            }
+        }
+    }
+    if (best == nullptr) {
+        fprintf(stderr, "%s: no beam survived\n", __func__);
+        return false;
+    }
+
+    // Continue from the best beam: its newest token, or the EOS that finished it, is left pending
+    if (loaded != best->kv) {
+        kv_layout.load(ctx, best->kv->token_count, best->kv->data);
+    }
+    const int n_evaluated = best->is_finished ? best->tokens.size() : std::max((int) best->tokens.size() - 1, 0);
+    past_tokens.resize(n_base);
+    past_tokens.insert(past_tokens.end(), best->tokens.begin(), best->tokens.begin() + n_evaluated);
+    n_past = n_base + n_evaluated;
+    embd.clear();
+    if (best->is_finished) {
+        embd.push_back(llama_token_eos());
+    } else if (!best->tokens.empty()) {
+        embd.push_back(best->tokens.back());
+    }
+    last_n_tokens.push(best->tokens.data(), best->tokens.size());
+    if (n_prompt < 0 && !embd.empty()) {
+        n_prompt = n_base;
+    }
+    if (grammar && best->grammar) {
+        grammar.reset(new GrammarState(*best->grammar));
+    }
+    // The logits stay those of the prompt; the pending token is evaluated before the next sample
+    session.is_stashed = false;
+    session.kv_token_count = past_tokens.size();
+
+    result.tokens = best->tokens;
+    result.score = best_score;
+    return true;
+}
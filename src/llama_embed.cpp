@@ -0,0 +1,42 @@
+#include "llama_embed.h"
+#include <algorithm>
+#include <cstring>
+
+// Evaluate tokens and pool their embeddings
+bool embed_tokens(llama_context* ctx, const std::vector<llama_token>& tokens, EmbeddingPooling pooling,
+                  int n_threads, int n_batch, float* out)
+{
+    const int n_embd = llama_n_embd(ctx);
+    const int n_tokens = std::min((int) tokens.size(), llama_n_ctx(ctx));
+    std::fill(out, out + embedding_size(pooling, n_embd), 0.0f);
+    if (n_tokens == 0) {
+        return true;
+    }
+
+    float* out_last = pooling == EmbeddingPooling::MEAN ? nullptr : out;
+    float* out_mean = pooling == EmbeddingPooling::LAST ? nullptr : out + (pooling == EmbeddingPooling::BOTH ? n_embd : 0);
+    // Only the mean needs to see the embedding of every token
+    const int n_step = out_mean ? 1 : std::max(n_batch, 1);
+    for (int n_past = 0; n_past < n_tokens; n_past += n_step) {
+        const int n_eval = std::min(n_step, n_tokens - n_past);
+        if (llama_eval(ctx, tokens.data() + n_past, n_eval, n_past, n_threads) != 0) {
+            return false;
+        }
+        if (out_mean) {
+            const float* embd = llama_get_embeddings(ctx);
+            for (int i = 0; i < n_embd; i++) {
+                out_mean[i] += embd[i];
+            }
+        }
+    }
+    if (out_mean) {
+        const float scale = 1.0f / n_tokens;
+        for (int i = 0; i < n_embd; i++) {
+            out_mean[i] *= scale;
+        }
+    }
+    if (out_last) {
+        memcpy(out_last, llama_get_embeddings(ctx), sizeof(float) * n_embd);
+    }
+    return true;
+}
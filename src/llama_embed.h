@@ -0,0 +1,28 @@
+#ifndef LLAMA_EMBED_H
+#define LLAMA_EMBED_H
+
+#include "llama.h"
+#include <vector>
+
+/* How the per-token embeddings of an input are reduced to one vector */
+enum class EmbeddingPooling {
+    LAST,   // embedding of the last token
+    MEAN,   // mean over all tokens
+    BOTH,   // last followed by mean
+};
+
+// Number of floats written per input for a pooling mode
+inline int embedding_size(EmbeddingPooling pooling, int n_embd)
+{
+    return pooling == EmbeddingPooling::BOTH ? 2 * n_embd : n_embd;
+}
+
+// Evaluate `tokens` from position 0 of a context created with `embedding` set and write the
+// pooled embedding to `out` (embedding_size() floats). Inputs longer than n_ctx are truncated.
+// llama_get_embeddings() only exposes the last token of an eval, so mean pooling evaluates one
+// token at a time while last-token pooling uses batches of n_batch tokens.
+// Overwrites the KV cache of the context. Returns false if evaluation fails.
+bool embed_tokens(llama_context* ctx, const std::vector<llama_token>& tokens, EmbeddingPooling pooling,
+                  int n_threads, int n_batch, float* out);
+
+#endif /* LLAMA_EMBED_H */
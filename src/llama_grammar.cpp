@@ -0,0 +1,969 @@
+#include "llama_grammar.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <unordered_map>
+
+// GBNF parser, following the grammar parser of llama.cpp.
+// Errors are thrown as std::runtime_error and turned into a return value by Grammar::from_gbnf().
+namespace {
+
+struct ParseState {
+    std::map<std::string, uint32_t> symbol_ids{};
+    std::vector<GrammarRule> rules{};
+};
+
+uint32_t get_symbol_id(ParseState& state, const std::string& name)
+{
+    const auto it = state.symbol_ids.find(name);
+    if (it != state.symbol_ids.end()) {
+        return it->second;
+    }
+    const uint32_t id = state.symbol_ids.size();
+    state.symbol_ids[name] = id;
+    return id;
+}
+
+// Id for a rule generated for a group or a repetition inside rule `base`
+uint32_t generate_symbol_id(ParseState& state, const std::string& base)
+{
+    const uint32_t id = state.symbol_ids.size();
+    state.symbol_ids[base + '_' + std::to_string(id)] = id;
+    return id;
+}
+
+void add_rule(ParseState& state, uint32_t id, const GrammarRule& rule)
+{
+    if (state.rules.size() <= id) {
+        state.rules.resize(id + 1);
+    }
+    state.rules[id] = rule;
+}
+
+bool is_word_char(char c)
+{
+    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '-' || ('0' <= c && c <= '9');
+}
+
+std::pair<uint32_t, const char*> decode_utf8(const char* src)
+{
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4 };
+    const uint8_t first = static_cast<uint8_t>(*src);
+    const int len = lookup[first >> 4];
+    uint32_t value = first & ((1 << (8 - len)) - 1);
+    const char* end = src + len;
+    const char* pos = src + 1;
+    for (; pos < end && *pos; pos++) {
+        value = (value << 6) + (static_cast<uint8_t>(*pos) & 0x3F);
+    }
+    return std::make_pair(value, pos);
+}
+
+std::pair<uint32_t, const char*> parse_hex(const char* src, int size)
+{
+    const char* pos = src;
+    const char* end = src + size;
+    uint32_t value = 0;
+    for (; pos < end && *pos; pos++) {
+        value <<= 4;
+        const char c = *pos;
+        if ('a' <= c && c <= 'f') {
+            value += c - 'a' + 10;
+        } else if ('A' <= c && c <= 'F') {
+            value += c - 'A' + 10;
+        } else if ('0' <= c && c <= '9') {
+            value += c - '0';
+        } else {
+            break;
+        }
+    }
+    if (pos != end) {
+        throw std::runtime_error("expecting " + std::to_string(size) + " hex chars at " + src);
+    }
+    return std::make_pair(value, pos);
+}
+
+const char* parse_space(const char* src, bool newline_ok)
+{
+    const char* pos = src;
+    while (*pos == ' ' || *pos == '\t' || *pos == '#' || (newline_ok && (*pos == '\r' || *pos == '\n'))) {
+        if (*pos == '#') {
+            while (*pos && *pos != '\r' && *pos != '\n') {
+                pos++;
+            }
+        } else {
+            pos++;
+        }
+    }
+    return pos;
+}
+
+const char* parse_name(const char* src)
+{
+    const char* pos = src;
+    while (is_word_char(*pos)) {
+        pos++;
+    }
+    if (pos == src) {
+        throw std::runtime_error(std::string("expecting name at ") + src);
+    }
+    return pos;
+}
+
+std::pair<uint32_t, const char*> parse_char(const char* src)
+{
+    if (*src == '\\') {
+        switch (src[1]) {
+            case 'x': return parse_hex(src + 2, 2);
+            case 'u': return parse_hex(src + 2, 4);
+            case 'U': return parse_hex(src + 2, 8);
+            case 't': return std::make_pair((uint32_t) '\t', src + 2);
+            case 'r': return std::make_pair((uint32_t) '\r', src + 2);
+            case 'n': return std::make_pair((uint32_t) '\n', src + 2);
+            case '\\':
+            case '"':
+            case '[':
+            case ']':
+                return std::make_pair((uint32_t) src[1], src + 2);
+            default:
+                throw std::runtime_error(std::string("unknown escape at ") + src);
+        }
+    } else if (*src) {
+        return decode_utf8(src);
+    }
+    throw std::runtime_error("unexpected end of input");
+}
+
+const char* parse_alternates(ParseState& state, const char* src, const std::string& rule_name, uint32_t rule_id,
+                             bool is_nested);
+
+const char* parse_sequence(ParseState& state, const char* src, const std::string& rule_name, GrammarRule& out,
+                           bool is_nested)
+{
+    size_t last_sym_start = out.size();
+    const char* pos = src;
+    while (*pos) {
+        if (*pos == '"') {
+            // Literal string
+            pos++;
+            last_sym_start = out.size();
+            while (*pos != '"') {
+                const auto char_pair = parse_char(pos);
+                pos = char_pair.second;
+                out.push_back({GrammarElementType::CHAR, char_pair.first});
+            }
+            pos = parse_space(pos + 1, is_nested);
+        } else if (*pos == '[') {
+            // Character class
+            pos++;
+            GrammarElementType start_type = GrammarElementType::CHAR;
+            if (*pos == '^') {
+                pos++;
+                start_type = GrammarElementType::CHAR_NOT;
+            }
+            last_sym_start = out.size();
+            while (*pos != ']') {
+                const auto char_pair = parse_char(pos);
+                pos = char_pair.second;
+                const GrammarElementType type = last_sym_start < out.size() ? GrammarElementType::CHAR_ALT : start_type;
+                out.push_back({type, char_pair.first});
+                if (pos[0] == '-' && pos[1] != ']') {
+                    const auto upper_pair = parse_char(pos + 1);
+                    pos = upper_pair.second;
+                    out.push_back({GrammarElementType::CHAR_RNG_UPPER, upper_pair.first});
+                }
+            }
+            pos = parse_space(pos + 1, is_nested);
+        } else if (is_word_char(*pos)) {
+            // Rule reference
+            const char* name_end = parse_name(pos);
+            const uint32_t ref_rule_id = get_symbol_id(state, std::string(pos, name_end - pos));
+            pos = parse_space(name_end, is_nested);
+            last_sym_start = out.size();
+            out.push_back({GrammarElementType::RULE_REF, ref_rule_id});
+        } else if (*pos == '(') {
+            // Grouping, parsed into a generated rule
+            const uint32_t sub_rule_id = generate_symbol_id(state, rule_name);
+            pos = parse_alternates(state, parse_space(pos + 1, true), rule_name, sub_rule_id, true);
+            last_sym_start = out.size();
+            out.push_back({GrammarElementType::RULE_REF, sub_rule_id});
+            if (*pos != ')') {
+                throw std::runtime_error(std::string("expecting ')' at ") + pos);
+            }
+            pos = parse_space(pos + 1, is_nested);
+        } else if (*pos == '*' || *pos == '+' || *pos == '?') {
+            if (last_sym_start == out.size()) {
+                throw std::runtime_error(std::string("expecting preceding item to */+/? at ") + pos);
+            }
+            // Rewrite the preceding item S into a generated rule:
+            //   S* --> S' ::= S S' |
+            //   S+ --> S' ::= S S' | S
+            //   S? --> S' ::= S |
+            const uint32_t sub_rule_id = generate_symbol_id(state, rule_name);
+            GrammarRule sub_rule(out.begin() + last_sym_start, out.end());
+            if (*pos == '*' || *pos == '+') {
+                sub_rule.push_back({GrammarElementType::RULE_REF, sub_rule_id});
+            }
+            sub_rule.push_back({GrammarElementType::ALT, 0});
+            if (*pos == '+') {
+                sub_rule.insert(sub_rule.end(), out.begin() + last_sym_start, out.end());
+            }
+            sub_rule.push_back({GrammarElementType::END, 0});
+            add_rule(state, sub_rule_id, sub_rule);
+            out.resize(last_sym_start);
+            out.push_back({GrammarElementType::RULE_REF, sub_rule_id});
+            pos = parse_space(pos + 1, is_nested);
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+const char* parse_alternates(ParseState& state, const char* src, const std::string& rule_name, uint32_t rule_id,
+                             bool is_nested)
+{
+    GrammarRule rule;
+    const char* pos = parse_sequence(state, src, rule_name, rule, is_nested);
+    while (*pos == '|') {
+        rule.push_back({GrammarElementType::ALT, 0});
+        pos = parse_space(pos + 1, true);
+        pos = parse_sequence(state, pos, rule_name, rule, is_nested);
+    }
+    rule.push_back({GrammarElementType::END, 0});
+    add_rule(state, rule_id, rule);
+    return pos;
+}
+
+const char* parse_rule(ParseState& state, const char* src)
+{
+    const char* name_end = parse_name(src);
+    const char* pos = parse_space(name_end, false);
+    const std::string name(src, name_end - src);
+    const uint32_t rule_id = get_symbol_id(state, name);
+
+    if (!(pos[0] == ':' && pos[1] == ':' && pos[2] == '=')) {
+        throw std::runtime_error(std::string("expecting ::= at ") + pos);
+    }
+    pos = parse_space(pos + 3, true);
+    pos = parse_alternates(state, pos, name, rule_id, false);
+
+    if (*pos == '\r') {
+        pos += pos[1] == '\n' ? 2 : 1;
+    } else if (*pos == '\n') {
+        pos++;
+    } else if (*pos) {
+        throw std::runtime_error(std::string("expecting newline or end at ") + pos);
+    }
+    return parse_space(pos, true);
+}
+
+// Grammar matching, following the stack-based approach of llama.cpp
+
+bool is_end_of_sequence(const GrammarElement* pos)
+{
+    return pos->type == GrammarElementType::END || pos->type == GrammarElementType::ALT;
+}
+
+// Match a code point against the character class at `pos`. Returns whether it matched and
+// the element after the class.
+std::pair<bool, const GrammarElement*> match_char(const GrammarElement* pos, uint32_t chr)
+{
+    bool found = false;
+    const bool is_positive_char = pos->type == GrammarElementType::CHAR;
+    do {
+        if (pos[1].type == GrammarElementType::CHAR_RNG_UPPER) {
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == GrammarElementType::CHAR_ALT);
+    return std::make_pair(found == is_positive_char, pos);
+}
+
+// Check if some code point starting with a partial UTF-8 sequence can match the class at `pos`
+bool match_partial_char(const GrammarElement* pos, const PartialUtf8& partial)
+{
+    const bool is_positive_char = pos->type == GrammarElementType::CHAR;
+    const int n_remain = partial.n_remain;
+    // A 7-bit char split across 2 bytes is an overlong encoding
+    if (n_remain == 1 && partial.value < 2) {
+        return false;
+    }
+    // Range of code points the sequence can still turn into
+    uint32_t low = partial.value << (n_remain * 6);
+    const uint32_t high = low | ((1u << (n_remain * 6)) - 1);
+    if (low == 0) {
+        if (n_remain == 2) {
+            low = 1u << 11;
+        } else if (n_remain == 3) {
+            low = 1u << 16;
+        }
+    }
+    do {
+        if (pos[1].type == GrammarElementType::CHAR_RNG_UPPER) {
+            if (pos->value <= high && low <= pos[1].value) {
+                return is_positive_char;
+            }
+            pos += 2;
+        } else {
+            if (low <= pos->value && pos->value <= high) {
+                return is_positive_char;
+            }
+            pos += 1;
+        }
+    } while (pos->type == GrammarElementType::CHAR_ALT);
+    return !is_positive_char;
+}
+
+// Expand the rule references at the top of `stack` until every resulting stack is empty
+// (the grammar is complete) or has a character class on top
+void advance_stack(const std::vector<GrammarRule>& rules, const GrammarStack& stack, std::vector<GrammarStack>& new_stacks)
+{
+    if (stack.empty()) {
+        if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+            new_stacks.push_back(stack);
+        }
+        return;
+    }
+    const GrammarElement* pos = stack.back();
+    switch (pos->type) {
+        case GrammarElementType::RULE_REF: {
+            const GrammarElement* subpos = rules[pos->value].data();
+            for (;;) {
+                // Continue with the rest of the current sequence after the referenced rule
+                GrammarStack new_stack(stack.begin(), stack.end() - 1);
+                if (!is_end_of_sequence(pos + 1)) {
+                    new_stack.push_back(pos + 1);
+                }
+                if (!is_end_of_sequence(subpos)) {
+                    new_stack.push_back(subpos);
+                }
+                advance_stack(rules, new_stack, new_stacks);
+                while (!is_end_of_sequence(subpos)) {
+                    subpos++;
+                }
+                if (subpos->type != GrammarElementType::ALT) {
+                    break;
+                }
+                subpos++;
+            }
+            break;
+        }
+        case GrammarElementType::CHAR:
+        case GrammarElementType::CHAR_NOT:
+            if (std::find(new_stacks.begin(), new_stacks.end(), stack) == new_stacks.end()) {
+                new_stacks.push_back(stack);
+            }
+            break;
+        default:
+            // END, ALT, CHAR_RNG_UPPER and CHAR_ALT never end up on top of a stack
+            break;
+    }
+}
+
+// Stacks reached by matching one code point from `stacks`
+void accept_char(const std::vector<GrammarRule>& rules, const std::vector<GrammarStack>& stacks, uint32_t chr,
+                 std::vector<GrammarStack>& new_stacks)
+{
+    for (const auto& stack : stacks) {
+        if (stack.empty()) {
+            continue;
+        }
+        const auto match = match_char(stack.back(), chr);
+        if (match.first) {
+            GrammarStack new_stack(stack.begin(), stack.end() - 1);
+            if (!is_end_of_sequence(match.second)) {
+                new_stack.push_back(match.second);
+            }
+            advance_stack(rules, new_stack, new_stacks);
+        }
+    }
+}
+
+// True if some stack can continue with the code point that `partial` is the start of
+bool accept_partial(const std::vector<GrammarStack>& stacks, const PartialUtf8& partial)
+{
+    for (const auto& stack : stacks) {
+        if (!stack.empty() && match_partial_char(stack.back(), partial)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Feed one byte to a UTF-8 decoder. Returns 1 and sets `chr` when a code point is complete,
+// 0 when more bytes are needed and -1 for an invalid sequence.
+int decode_utf8_byte(PartialUtf8& partial, uint8_t byte, uint32_t& chr)
+{
+    if (partial.n_remain == 0) {
+        if (byte < 0x80) {
+            chr = byte;
+            return 1;
+        }
+        if ((byte & 0xE0) == 0xC0) {
+            partial.value = byte & 0x1F;
+            partial.n_remain = 1;
+        } else if ((byte & 0xF0) == 0xE0) {
+            partial.value = byte & 0x0F;
+            partial.n_remain = 2;
+        } else if ((byte & 0xF8) == 0xF0) {
+            partial.value = byte & 0x07;
+            partial.n_remain = 3;
+        } else {
+            return -1;
+        }
+        return 0;
+    }
+    if ((byte & 0xC0) != 0x80) {
+        return -1;
+    }
+    partial.value = (partial.value << 6) | (byte & 0x3F);
+    if (--partial.n_remain > 0) {
+        return 0;
+    }
+    chr = partial.value;
+    partial.value = 0;
+    return 1;
+}
+
+// Sets of stacks seen during one walk of the vocabulary trie, with the transitions between them.
+// Most prefixes lead back to a handful of states (e.g. anywhere inside a JSON string), so each
+// transition is computed once instead of once per trie node.
+class GrammarTransitions {
+    public:
+        explicit GrammarTransitions(const std::vector<GrammarRule>& rules)
+            : rules(rules)
+        {
+        }
+
+        int intern(const std::vector<GrammarStack>& stacks)
+        {
+            const auto it = ids.emplace(stacks, (int) states.size());
+            if (it.second) {
+                states.push_back(&it.first->first);
+            }
+            return it.first->second;
+        }
+
+        // State after matching `chr` in `state`, or -1 if no stack accepts it
+        int next(int state, uint32_t chr)
+        {
+            const uint64_t key = (uint64_t(state) << 32) | chr;
+            const auto it = transitions.find(key);
+            if (it != transitions.end()) {
+                return it->second;
+            }
+            scratch.clear();
+            accept_char(rules, *states[state], chr, scratch);
+            const int next_state = scratch.empty() ? -1 : intern(scratch);
+            transitions.emplace(key, next_state);
+            return next_state;
+        }
+
+        const std::vector<GrammarStack>& stacks(int state) const { return *states[state]; }
+
+    private:
+        struct StacksHash {
+            size_t operator()(const std::vector<GrammarStack>& stacks) const
+            {
+                size_t h = stacks.size();
+                for (const auto& stack : stacks) {
+                    for (const GrammarElement* pos : stack) {
+                        h = h * 31 + std::hash<const void*>()(pos);
+                    }
+                    h = h * 31 + stack.size();
+                }
+                return h;
+            }
+        };
+
+        const std::vector<GrammarRule>& rules;
+        std::unordered_map<std::vector<GrammarStack>, int, StacksHash> ids{};
+        std::vector<const std::vector<GrammarStack>*> states{};
+        std::unordered_map<uint64_t, int> transitions{};
+        std::vector<GrammarStack> scratch{};
+};
+
+// Visit the children of a trie node, keeping the subtrees of the prefixes that the grammar accepts
+void walk_trie(const VocabTrie& trie, uint32_t node, GrammarTransitions& transitions, int state,
+               PartialUtf8 partial, std::vector<llama_token>& out)
+{
+    const auto& nodes = trie.nodes();
+    const auto& token_ids = trie.token_ids();
+    const uint32_t end = node + nodes[node].n_nodes;
+    for (uint32_t child = node + 1; child < end; child += nodes[child].n_nodes) {
+        PartialUtf8 child_partial = partial;
+        uint32_t chr = 0;
+        const int res = decode_utf8_byte(child_partial, nodes[child].byte, chr);
+        int child_state = state;
+        if (res < 0) {
+            continue;
+        } else if (res > 0) {
+            child_state = transitions.next(state, chr);
+            if (child_state < 0) {
+                continue;
+            }
+        } else if (!accept_partial(transitions.stacks(state), child_partial)) {
+            continue;
+        }
+        out.insert(out.end(), token_ids.begin() + nodes[child].tokens_begin, token_ids.begin() + nodes[child].tokens_end);
+        walk_trie(trie, child, transitions, child_state, child_partial, out);
+    }
+}
+
+// Regular expression to GBNF translation
+class RegexToGbnf {
+    public:
+        explicit RegexToGbnf(const std::string& pattern)
+        {
+            const char* pos = pattern.c_str();
+            while (*pos) {
+                const auto char_pair = decode_utf8(pos);
+                cps.push_back(char_pair.first);
+                pos = char_pair.second;
+            }
+        }
+
+        std::string convert()
+        {
+            // The whole output has to match, so anchors at the ends change nothing
+            if (peek() == '^') {
+                i++;
+            }
+            const std::string expr = parse_alternation();
+            if (peek() == '$') {
+                i++;
+            }
+            if (i < cps.size()) {
+                throw std::runtime_error("unbalanced ')' at position " + std::to_string(i));
+            }
+            return "root ::= " + expr + "\n";
+        }
+
+    private:
+        uint32_t peek() const { return i < cps.size() ? cps[i] : 0; }
+        bool at_end_of_sequence() const
+        {
+            return i >= cps.size() || cps[i] == '|' || cps[i] == ')' || (cps[i] == '$' && i + 1 == cps.size());
+        }
+
+        std::string parse_alternation()
+        {
+            std::vector<std::string> alternatives{parse_sequence()};
+            while (peek() == '|') {
+                i++;
+                alternatives.push_back(parse_sequence());
+            }
+            if (alternatives.size() == 1) {
+                return alternatives[0];
+            }
+            std::string res = "(";
+            for (size_t k = 0; k < alternatives.size(); k++) {
+                res += (k > 0 ? " | " : "") + alternatives[k];
+            }
+            return res + ")";
+        }
+
+        std::string parse_sequence()
+        {
+            std::string res;
+            while (!at_end_of_sequence()) {
+                const std::string atom = parse_quantifier(parse_atom());
+                res += (res.empty() ? "" : " ") + atom;
+            }
+            return res.empty() ? "\"\"" : res;
+        }
+
+        std::string parse_atom()
+        {
+            const uint32_t c = cps[i++];
+            switch (c) {
+                case '(': {
+                    if (peek() == '?') {
+                        if (i + 1 < cps.size() && cps[i + 1] == ':') {
+                            i += 2;
+                        } else {
+                            throw std::runtime_error("unsupported group syntax at position " + std::to_string(i));
+                        }
+                    }
+                    const std::string inner = parse_alternation();
+                    if (peek() != ')') {
+                        throw std::runtime_error("missing ')'");
+                    }
+                    i++;
+                    return "(" + inner + ")";
+                }
+                case '[':
+                    return parse_class();
+                case '.':
+                    return "[^\\n]";
+                case '\\':
+                    return parse_escape();
+                case '*':
+                case '+':
+                case '?':
+                case '{':
+                    throw std::runtime_error("nothing to repeat at position " + std::to_string(i - 1));
+                default:
+                    return "\"" + escape(c) + "\"";
+            }
+        }
+
+        std::string parse_escape()
+        {
+            if (i >= cps.size()) {
+                throw std::runtime_error("trailing backslash");
+            }
+            const uint32_t c = cps[i++];
+            switch (c) {
+                case 'd': return "[0-9]";
+                case 'D': return "[^0-9]";
+                case 'w': return "[a-zA-Z0-9_]";
+                case 'W': return "[^a-zA-Z0-9_]";
+                case 's': return "[ \\t\\n\\r\\x0B\\x0C]";
+                case 'S': return "[^ \\t\\n\\r\\x0B\\x0C]";
+                default: {
+                    uint32_t chr = 0;
+                    if (!escaped_char(c, chr)) {
+                        throw std::runtime_error("unsupported escape \\" + std::string(1, (char) c));
+                    }
+                    return "\"" + escape(chr) + "\"";
+                }
+            }
+        }
+
+        // Character for escapes that stand for a single character
+        static bool escaped_char(uint32_t c, uint32_t& chr)
+        {
+            switch (c) {
+                case 'n': chr = '\n'; return true;
+                case 't': chr = '\t'; return true;
+                case 'r': chr = '\r'; return true;
+                case 'f': chr = 0x0C; return true;
+                case 'v': chr = 0x0B; return true;
+                case '0': chr = 0; return true;
+                default:
+                    // Escaped punctuation stands for itself
+                    chr = c;
+                    return c < 0x80 && !(('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9'));
+            }
+        }
+
+        std::string parse_class()
+        {
+            std::string res = "[";
+            if (peek() == '^') {
+                res += "^";
+                i++;
+            }
+            bool is_first = true;
+            while (i < cps.size() && (cps[i] != ']' || is_first)) {
+                is_first = false;
+                uint32_t lo = cps[i++];
+                if (lo == '\\') {
+                    if (i >= cps.size()) {
+                        throw std::runtime_error("trailing backslash");
+                    }
+                    const uint32_t c = cps[i++];
+                    if (c == 'd') {
+                        res += "0-9";
+                        continue;
+                    } else if (c == 'w') {
+                        res += "a-zA-Z0-9_";
+                        continue;
+                    } else if (c == 's') {
+                        res += " \\t\\n\\r\\x0B\\x0C";
+                        continue;
+                    } else if (!escaped_char(c, lo)) {
+                        throw std::runtime_error("unsupported escape \\" + std::string(1, (char) c) + " in class");
+                    }
+                }
+                res += escape(lo);
+                if (peek() == '-' && i + 1 < cps.size() && cps[i + 1] != ']') {
+                    i++;
+                    uint32_t hi = cps[i++];
+                    if (hi == '\\') {
+                        if (i >= cps.size() || !escaped_char(cps[i], hi)) {
+                            throw std::runtime_error("unsupported escape in class range");
+                        }
+                        i++;
+                    }
+                    if (hi < lo) {
+                        throw std::runtime_error("invalid class range");
+                    }
+                    res += "-" + escape(hi);
+                }
+            }
+            if (peek() != ']') {
+                throw std::runtime_error("missing ']'");
+            }
+            i++;
+            return res + "]";
+        }
+
+        std::string parse_quantifier(const std::string& atom)
+        {
+            std::string res;
+            const uint32_t c = peek();
+            if (c == '*' || c == '+' || c == '?') {
+                i++;
+                res = atom + std::string(1, (char) c);
+            } else if (c == '{') {
+                i++;
+                const int n_min = parse_int();
+                int n_max = n_min;
+                if (peek() == ',') {
+                    i++;
+                    n_max = peek() == '}' ? -1 : parse_int();
+                }
+                if (peek() != '}' || (n_max >= 0 && n_max < n_min)) {
+                    throw std::runtime_error("invalid repetition at position " + std::to_string(i));
+                }
+                i++;
+                res = repeat(atom, n_min, n_max);
+            } else {
+                return atom;
+            }
+            // Lazy quantifiers match the same set of strings
+            if (peek() == '?') {
+                i++;
+            }
+            return res;
+        }
+
+        int parse_int()
+        {
+            if (!('0' <= peek() && peek() <= '9')) {
+                throw std::runtime_error("expecting a number at position " + std::to_string(i));
+            }
+            int value = 0;
+            while ('0' <= peek() && peek() <= '9') {
+                value = value * 10 + (cps[i++] - '0');
+            }
+            return value;
+        }
+
+        // atom{n_min,n_max}, with n_max < 0 for no upper bound
+        static std::string repeat(const std::string& atom, int n_min, int n_max)
+        {
+            std::string res;
+            for (int k = 0; k < n_min; k++) {
+                res += (res.empty() ? "" : " ") + atom;
+            }
+            std::string optional;
+            if (n_max < 0) {
+                optional = atom + "*";
+            } else {
+                for (int k = n_min; k < n_max; k++) {
+                    optional = "(" + atom + (optional.empty() ? "" : " " + optional) + ")?";
+                }
+            }
+            if (!optional.empty()) {
+                res += (res.empty() ? "" : " ") + optional;
+            }
+            return res.empty() ? "\"\"" : "(" + res + ")";
+        }
+
+        // Code point as it can appear inside a GBNF literal or character class
+        static std::string escape(uint32_t c)
+        {
+            if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || c == ' ') {
+                return std::string(1, (char) c);
+            }
+            char buf[16];
+            if (c < 0x100) {
+                snprintf(buf, sizeof(buf), "\\x%02X", c);
+            } else if (c < 0x10000) {
+                snprintf(buf, sizeof(buf), "\\u%04X", c);
+            } else {
+                snprintf(buf, sizeof(buf), "\\U%08X", c);
+            }
+            return buf;
+        }
+
+        std::vector<uint32_t> cps{};
+        size_t i = 0;
+};
+
+// JSON object or array, after grammars/json.gbnf in llama.cpp. Whitespace between tokens is
+// limited to a few characters so the model cannot pad the output forever.
+const char* json_gbnf = R"(
+root   ::= object | array
+value  ::= object | array | string | number | ("true" | "false" | "null") ws
+
+object ::=
+  "{" ws (
+            string ":" ws value
+    ("," ws string ":" ws value)*
+  )? "}" ws
+
+array  ::=
+  "[" ws (
+            value
+    ("," ws value)*
+  )? "]" ws
+
+string ::=
+  "\"" (
+    [^"\\\x00-\x1F] |
+    "\\" (["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F])
+  )* "\"" ws
+
+number ::= ("-"? ([0-9] | [1-9] [0-9]*)) ("." [0-9]+)? ([eE] [-+]? [0-9]+)? ws
+
+ws ::= ([ \t\n] ([ \t\n] [ \t\n]?)?)?
+)";
+
+}  // namespace
+
+// Parse GBNF text
+std::shared_ptr<Grammar> Grammar::from_gbnf(const std::string& text, const std::string& root, std::string* error)
+{
+    ParseState state;
+    try {
+        const char* pos = parse_space(text.c_str(), true);
+        while (*pos) {
+            pos = parse_rule(state, pos);
+        }
+        // Every referenced rule has to be defined
+        for (const auto& symbol : state.symbol_ids) {
+            if (symbol.second >= state.rules.size() || state.rules[symbol.second].empty()) {
+                throw std::runtime_error("undefined rule '" + symbol.first + "'");
+            }
+        }
+    } catch (const std::exception& err) {
+        if (error) {
+            *error = std::string("failed to parse grammar: ") + err.what();
+        }
+        return nullptr;
+    }
+    const auto root_it = state.symbol_ids.find(root);
+    if (root_it == state.symbol_ids.end()) {
+        if (error) {
+            *error = "grammar does not define the root rule '" + root + "'";
+        }
+        return nullptr;
+    }
+    auto grammar = std::make_shared<Grammar>();
+    grammar->rules = std::move(state.rules);
+    grammar->root = root_it->second;
+    return grammar;
+}
+
+// Translate a regular expression to GBNF
+bool Grammar::regex_to_gbnf(const std::string& pattern, std::string* gbnf, std::string* error)
+{
+    try {
+        *gbnf = RegexToGbnf(pattern).convert();
+    } catch (const std::exception& err) {
+        if (error) {
+            *error = std::string("failed to translate regex: ") + err.what();
+        }
+        return false;
+    }
+    return true;
+}
+
+// Grammar for a regular expression
+std::shared_ptr<Grammar> Grammar::from_regex(const std::string& pattern, std::string* error)
+{
+    std::string gbnf;
+    if (!regex_to_gbnf(pattern, &gbnf, error)) {
+        return nullptr;
+    }
+    return from_gbnf(gbnf, "root", error);
+}
+
+// Built-in JSON grammar
+std::shared_ptr<Grammar> Grammar::json()
+{
+    static const std::shared_ptr<Grammar> grammar = from_gbnf(json_gbnf, "root", nullptr);
+    return grammar;
+}
+
+GrammarState::GrammarState(std::shared_ptr<const Grammar> grammar)
+    : grammar(grammar)
+{
+    reset();
+}
+
+// Start over from the root rule
+void GrammarState::reset()
+{
+    stacks.clear();
+    partial = PartialUtf8();
+    const GrammarElement* pos = grammar->get_rules()[grammar->get_root()].data();
+    for (;;) {
+        GrammarStack stack;
+        if (!is_end_of_sequence(pos)) {
+            stack.push_back(pos);
+        }
+        advance_stack(grammar->get_rules(), stack, stacks);
+        while (!is_end_of_sequence(pos)) {
+            pos++;
+        }
+        if (pos->type != GrammarElementType::ALT) {
+            break;
+        }
+        pos++;
+    }
+}
+
+// Check if some stack has matched the whole grammar
+bool GrammarState::is_complete() const
+{
+    if (partial.n_remain > 0) {
+        return false;
+    }
+    for (const auto& stack : stacks) {
+        if (stack.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Collect the tokens the grammar allows next
+void GrammarState::allowed_tokens(const VocabTrie& trie, std::vector<llama_token>& out) const
+{
+    out.clear();
+    GrammarTransitions transitions(grammar->get_rules());
+    walk_trie(trie, 0, transitions, transitions.intern(stacks), partial, out);
+    if (is_complete()) {
+        out.push_back(llama_token_eos());
+    }
+}
+
+// Advance over the string of an accepted token
+bool GrammarState::accept(const std::string& piece)
+{
+    std::vector<GrammarStack> cur_stacks = stacks;
+    std::vector<GrammarStack> next_stacks;
+    PartialUtf8 cur_partial = partial;
+    for (const char c : piece) {
+        uint32_t chr = 0;
+        const int res = decode_utf8_byte(cur_partial, static_cast<uint8_t>(c), chr);
+        if (res < 0) {
+            return false;
+        }
+        if (res == 0) {
+            continue;
+        }
+        next_stacks.clear();
+        accept_char(grammar->get_rules(), cur_stacks, chr, next_stacks);
+        if (next_stacks.empty()) {
+            return false;
+        }
+        cur_stacks.swap(next_stacks);
+    }
+    if (cur_partial.n_remain > 0 && !accept_partial(cur_stacks, cur_partial)) {
+        return false;
+    }
+    stacks = std::move(cur_stacks);
+    partial = cur_partial;
+    return true;
+}
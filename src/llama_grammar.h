@@ -0,0 +1,93 @@
+#ifndef LLAMA_GRAMMAR_H
+#define LLAMA_GRAMMAR_H
+
+#include "llama.h"
+#include "vocab_trie.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Element of a grammar rule, using the same encoding as the GBNF grammars of llama.cpp.
+ * A rule is a list of alternatives separated by ALT and terminated by END. */
+enum class GrammarElementType : uint32_t {
+    END,            // end of a rule
+    ALT,            // start of another alternative of the rule
+    RULE_REF,       // non-terminal: value is the rule id
+    CHAR,           // terminal: value is a code point
+    CHAR_NOT,       // inverse character class: [^...], value is the first code point
+    CHAR_RNG_UPPER, // upper bound of a range started by the previous CHAR/CHAR_ALT element
+    CHAR_ALT,       // another code point in the same character class
+};
+
+struct GrammarElement {
+    GrammarElementType type;
+    uint32_t value;
+};
+
+using GrammarRule = std::vector<GrammarElement>;
+// Position in the grammar: the top of the stack is the next element to match, the rest
+// are the elements to continue with once the current rule is done
+using GrammarStack = std::vector<const GrammarElement*>;
+
+/* A parsed GBNF grammar. Immutable and shared by every GrammarState that follows it.
+ *
+ * Supported syntax: `name ::= alternatives` rules, "literals", [character classes] with
+ * ranges and ^ negation, ( groups ), the * + ? operators and # comments. Left-recursive
+ * rules are not supported.
+ */
+class Grammar {
+    public:
+        // Parse GBNF text starting at rule `root`. Returns nullptr and sets `error` on failure.
+        static std::shared_ptr<Grammar> from_gbnf(const std::string& text, const std::string& root, std::string* error);
+        // Grammar for strings that fully match a regular expression. Supports literals, escapes,
+        // classes, ., \d \w \s and their negations, groups, | and the * + ? {m} {m,} {m,n} quantifiers.
+        static std::shared_ptr<Grammar> from_regex(const std::string& pattern, std::string* error);
+        // Grammar for a JSON object or array
+        static std::shared_ptr<Grammar> json();
+
+        // Translate a regular expression to a GBNF rule named root. Returns false and sets `error` on failure.
+        static bool regex_to_gbnf(const std::string& pattern, std::string* gbnf, std::string* error);
+
+        const std::vector<GrammarRule>& get_rules() const { return rules; }
+        uint32_t get_root() const { return root; }
+
+    private:
+        std::vector<GrammarRule> rules{};
+        uint32_t root = 0;
+};
+
+/* UTF-8 sequence that was cut off at the end of a token */
+struct PartialUtf8 {
+    uint32_t value = 0;  // bits decoded so far
+    int n_remain = 0;    // continuation bytes still expected
+};
+
+/* Parse position of the output generated so far within a Grammar.
+ *
+ * Follows the stack-based approach of llama.cpp: the state is the set of stacks the input
+ * can have reached. Tokens are matched code point by code point, and a UTF-8 sequence that
+ * is split across tokens is carried over in a PartialUtf8.
+ */
+class GrammarState {
+    public:
+        explicit GrammarState(std::shared_ptr<const Grammar> grammar);
+
+        // Go back to the start of the grammar
+        void reset();
+        // True when the text so far is a complete match, so EOS may follow
+        bool is_complete() const;
+        // Tokens that can come next. EOS is included when the grammar is complete.
+        // Found by walking the vocabulary trie once, pruning every prefix the grammar rejects.
+        void allowed_tokens(const VocabTrie& trie, std::vector<llama_token>& out) const;
+        // Advance over the string of a token. Returns false if the grammar does not allow it,
+        // in which case the state is left unchanged.
+        bool accept(const std::string& piece);
+
+    private:
+        std::shared_ptr<const Grammar> grammar;
+        std::vector<GrammarStack> stacks{};
+        PartialUtf8 partial{};
+};
+
+#endif /* LLAMA_GRAMMAR_H */
@@ -0,0 +1,140 @@
+#include "llama_model.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+LlamaModel::LlamaModel(const std::string& path_model, const llama_context_params& params)
+    : params(params), path_model(path_model)
+{
+    ctx = llama_init_from_file(path_model.c_str(), params);
+    if (ctx)
+    {
+        kv_layout = KvCacheLayout(ctx, params.f16_kv);
+    }
+    // The progress callback is only valid while loading
+    this->params.progress_callback = nullptr;
+    this->params.progress_callback_user_data = nullptr;
+}
+
+LlamaModel::~LlamaModel()
+{
+    if (ctx)
+    {
+        llama_free(ctx);
+    }
+}
+
+// Switch the context over to `session`
+LlamaModel::Lease LlamaModel::acquire(LlamaSessionState* session)
+{
+    Lease lease(mutex, ctx);
+    if (active != session)
+    {
+        if (active != nullptr)
+        {
+            stash(active);
+        }
+        restore(session);
+        active = session;
+    }
+    return lease;
+}
+
+// Forget a session that is being destroyed
+void LlamaModel::release(LlamaSessionState* session)
+{
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (active == session)
+    {
+        active = nullptr;
+    }
+}
+
+// Reserve room for the most logit rows an eval can produce: one, or n_ctx with logits_all. The
+// buffer is never reallocated after this. Only the rows that are written get committed, so the
+// n_ctx * n_vocab reservation for logits_all costs address space rather than memory.
+void LlamaModel::init_session(LlamaSessionState* session) const
+{
+    const size_t n_vocab = llama_n_vocab(ctx);
+    const size_t max_rows = params.logits_all ? llama_n_ctx(ctx) : 1;
+    session->logits.reserve(max_rows * n_vocab);
+    // A row of zeros until the first eval, so the buffer has an address
+    session->logits.assign(n_vocab, 0.0f);
+}
+
+// Copy the logits of the last eval into the session, within the room reserved by init_session()
+void LlamaModel::take_logits(LlamaSessionState* session, int n_tokens)
+{
+    const size_t n_vocab = llama_n_vocab(ctx);
+    const int n_rows = params.logits_all ? std::max(1, std::min(n_tokens, llama_n_ctx(ctx))) : 1;
+    const float* logits = llama_get_logits(ctx);
+    session->logits.assign(logits, logits + n_rows * n_vocab);
+    session->n_logit_rows = n_rows;
+}
+
+// Build the vocabulary trie once and share it between sessions
+std::shared_ptr<const VocabTrie> LlamaModel::get_vocab_trie()
+{
+    std::lock_guard<std::mutex> lock(trie_mutex);
+    if (!vocab_trie)
+    {
+        vocab_trie = std::make_shared<VocabTrie>(ctx);
+    }
+    return vocab_trie;
+}
+
+// Build the piece table once and share it between sessions
+std::shared_ptr<const PieceTable> LlamaModel::get_piece_table()
+{
+    std::lock_guard<std::mutex> lock(trie_mutex);
+    if (!piece_table)
+    {
+        piece_table = std::make_shared<PieceTable>(ctx);
+    }
+    return piece_table;
+}
+
+// Read the tokenizer once and share it between sessions
+std::shared_ptr<const BpeTokenizer> LlamaModel::get_bpe_tokenizer()
+{
+    std::lock_guard<std::mutex> lock(trie_mutex);
+    if (!is_bpe_tokenizer_read && ctx)
+    {
+        is_bpe_tokenizer_read = true;
+        auto tokenizer = std::make_shared<BpeTokenizer>(path_model);
+        if (tokenizer->is_loaded() && tokenizer->matches(ctx))
+        {
+            bpe_tokenizer = tokenizer;
+        }
+        else
+        {
+            fprintf(stderr, "%s: using llama_tokenize for '%s'\n", __func__, path_model.c_str());
+        }
+    }
+    return bpe_tokenizer;
+}
+
+// Copy the state of the active session out of the context
+void LlamaModel::stash(LlamaSessionState* session)
+{
+    kv_layout.save(ctx, session->kv_token_count, session->kv_cache);
+    if (params.embedding)
+    {
+        const float* embeddings = llama_get_embeddings(ctx);
+        session->embeddings.assign(embeddings, embeddings + llama_n_embd(ctx));
+    }
+    session->is_stashed = true;
+}
+
+// Copy the state of a session back into the context
+void LlamaModel::restore(LlamaSessionState* session)
+{
+    // Positions past kv_token_count, and all of them for a session that never ran, are left as they are.
+    // They are overwritten before they are used.
+    kv_layout.load(ctx, session->kv_token_count, session->kv_cache);
+    if (params.embedding && !session->embeddings.empty())
+    {
+        memcpy(llama_get_embeddings(ctx), session->embeddings.data(), sizeof(float) * session->embeddings.size());
+    }
+    session->is_stashed = false;
+}
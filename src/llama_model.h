@@ -0,0 +1,105 @@
+#ifndef LLAMA_MODEL_H
+#define LLAMA_MODEL_H
+
+#include "bpe_tokenizer.h"
+#include "detokenizer.h"
+#include "kv_cache.h"
+#include "llama.h"
+#include "vocab_trie.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Per-session state that lives inside the shared llama_context while the session is active */
+struct LlamaSessionState {
+    // Used part of the KV cache, as saved by KvCacheLayout
+    std::vector<uint8_t> kv_cache{};
+    // Number of positions of the KV cache the session uses. Kept up to date by the session's
+    // owner whenever it evaluates or replaces the cache, 0 for a session that never ran.
+    int kv_token_count = 0;
+    // Logits of the last eval, copied out of the context by LlamaModel::take_logits(). Reserved once by
+    // LlamaModel::init_session() for the most rows an eval can produce, so the buffer never moves and
+    // can be handed out as a view.
+    std::vector<float> logits{};
+    // Copy of the embeddings of the last eval, filled in when the session is swapped out
+    std::vector<float> embeddings{};
+    // Number of logit rows produced by the last eval (n_tokens with logits_all, 1 otherwise)
+    int n_logit_rows = 0;
+    // True when the embeddings above have to be used instead of the ones in the context
+    bool is_stashed = false;
+};
+
+/* Loaded model weights that can be shared by several sessions.
+ *
+ * The vendored llama.h keeps the KV cache inside the same llama_context as the weights,
+ * so sessions take turns on one context: acquiring it for a session stashes the KV cache and
+ * embeddings of the previously active session and restores its own. Switching sessions copies
+ * the used positions of both caches; consecutive calls from the same session are free. Logits
+ * are copied into the session after every eval, so they do not move when sessions switch.
+ */
+class LlamaModel {
+    public:
+        // Exclusive access to the context on behalf of one session
+        class Lease {
+            public:
+                llama_context* ctx() const { return model_ctx; }
+            private:
+                friend class LlamaModel;
+                Lease(std::recursive_mutex& mutex, llama_context* ctx)
+                    : lock(mutex), model_ctx(ctx)
+                {}
+                std::unique_lock<std::recursive_mutex> lock;
+                llama_context* model_ctx;
+        };
+
+        LlamaModel(const std::string& path_model, const llama_context_params& params);
+        ~LlamaModel();
+        LlamaModel(const LlamaModel&) = delete;
+        LlamaModel& operator=(const LlamaModel&) = delete;
+
+        // Check if the model was loaded successfully
+        bool is_loaded() const { return ctx != nullptr; }
+
+        // Make `session` the active session of the context and lock it until the lease is dropped
+        Lease acquire(LlamaSessionState* session);
+        // Forget a session that is being destroyed
+        void release(LlamaSessionState* session);
+        // Set up the logits buffer of a new session
+        void init_session(LlamaSessionState* session) const;
+        // Copy the logits of an eval of n_tokens from the context into the active session. Requires a lease.
+        void take_logits(LlamaSessionState* session, int n_tokens);
+
+        // Raw context. Only vocabulary and hyperparameter queries are safe without a lease.
+        llama_context* get_ctx() const { return ctx; }
+        const llama_context_params& get_params() const { return params; }
+        // Copies the used part of the KV cache
+        const KvCacheLayout& get_kv_layout() const { return kv_layout; }
+        // Trie over the vocabulary for grammar-constrained sampling, built on first use
+        std::shared_ptr<const VocabTrie> get_vocab_trie();
+        // Strings of every token in one buffer for detokenizing, built on first use
+        std::shared_ptr<const PieceTable> get_piece_table();
+        // Tokenizer that reproduces llama_tokenize() faster, read from the model file on first use.
+        // Null if the file cannot be read or its vocabulary differs from the loaded one.
+        std::shared_ptr<const BpeTokenizer> get_bpe_tokenizer();
+
+    private:
+        void stash(LlamaSessionState* session);
+        void restore(LlamaSessionState* session);
+
+        llama_context* ctx = nullptr;
+        llama_context_params params{};
+        KvCacheLayout kv_layout{};
+        std::string path_model = "";
+        std::recursive_mutex mutex{};
+        LlamaSessionState* active = nullptr;
+        // Separate from `mutex` so building the vocabulary tables does not hold up other sessions
+        std::mutex trie_mutex{};
+        std::shared_ptr<const VocabTrie> vocab_trie{};
+        std::shared_ptr<const PieceTable> piece_table{};
+        std::shared_ptr<const BpeTokenizer> bpe_tokenizer{};
+        bool is_bpe_tokenizer_read = false;
+};
+
+#endif /* LLAMA_MODEL_H */
@@ -0,0 +1,662 @@
+#include "llama_sampler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <numeric>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Vectorized reductions for the softmax. The scalar loops handle the tail.
+
+static float max_floats(const float* x, size_t n)
+{
+    float res = -INFINITY;
+    size_t i = 0;
+#if defined(__SSE2__)
+    if (n >= 16) {
+        // Independent accumulators hide the latency of maxps
+        __m128 acc0 = _mm_loadu_ps(x);
+        __m128 acc1 = _mm_loadu_ps(x + 4);
+        __m128 acc2 = _mm_loadu_ps(x + 8);
+        __m128 acc3 = _mm_loadu_ps(x + 12);
+        for (i = 16; i + 16 <= n; i += 16) {
+            acc0 = _mm_max_ps(acc0, _mm_loadu_ps(x + i));
+            acc1 = _mm_max_ps(acc1, _mm_loadu_ps(x + i + 4));
+            acc2 = _mm_max_ps(acc2, _mm_loadu_ps(x + i + 8));
+            acc3 = _mm_max_ps(acc3, _mm_loadu_ps(x + i + 12));
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, _mm_max_ps(_mm_max_ps(acc0, acc1), _mm_max_ps(acc2, acc3)));
+        res = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#elif defined(__ARM_NEON)
+    if (n >= 16) {
+        // Independent accumulators hide the latency of vmaxq
+        float32x4_t acc0 = vld1q_f32(x);
+        float32x4_t acc1 = vld1q_f32(x + 4);
+        float32x4_t acc2 = vld1q_f32(x + 8);
+        float32x4_t acc3 = vld1q_f32(x + 12);
+        for (i = 16; i + 16 <= n; i += 16) {
+            acc0 = vmaxq_f32(acc0, vld1q_f32(x + i));
+            acc1 = vmaxq_f32(acc1, vld1q_f32(x + i + 4));
+            acc2 = vmaxq_f32(acc2, vld1q_f32(x + i + 8));
+            acc3 = vmaxq_f32(acc3, vld1q_f32(x + i + 12));
+        }
+        float lanes[4];
+        vst1q_f32(lanes, vmaxq_f32(vmaxq_f32(acc0, acc1), vmaxq_f32(acc2, acc3)));
+        res = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#endif
+    for (; i < n; i++) {
+        res = std::max(res, x[i]);
+    }
+    return res;
+}
+
+static float sum_floats(const float* x, size_t n)
+{
+    float res = 0.0f;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128 acc = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_ps(acc, _mm_loadu_ps(x + i));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, acc);
+    res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__ARM_NEON)
+    float32x4_t acc = vdupq_n_f32(0.0f);
+    for (; i + 4 <= n; i += 4) {
+        acc = vaddq_f32(acc, vld1q_f32(x + i));
+    }
+    float lanes[4];
+    vst1q_f32(lanes, acc);
+    res = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for (; i < n; i++) {
+        res += x[i];
+    }
+    return res;
+}
+
+static void scale_floats(float* x, size_t n, float scale)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 s = _mm_set1_ps(scale);
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(x + i, _mm_mul_ps(_mm_loadu_ps(x + i), s));
+    }
+#elif defined(__ARM_NEON)
+    const float32x4_t s = vdupq_n_f32(scale);
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vmulq_f32(vld1q_f32(x + i), s));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] *= scale;
+    }
+}
+
+static void add_floats(float* x, const float* y, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(x + i, _mm_add_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 4 <= n; i += 4) {
+        vst1q_f32(x + i, vaddq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+    }
+#endif
+    for (; i < n; i++) {
+        x[i] += y[i];
+    }
+}
+
+// Position of the first largest value. Finding the maximum first keeps the vector loop free
+// of index bookkeeping; the second pass usually stops early.
+static size_t argmax_floats(const float* x, size_t n)
+{
+    const float max_val = max_floats(x, n);
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 target = _mm_set1_ps(max_val);
+    for (; i + 4 <= n; i += 4) {
+        const int mask = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(x + i), target));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float32x4_t target = vdupq_n_f32(max_val);
+    for (; i + 4 <= n; i += 4) {
+        if (vmaxvq_u32(vceqq_f32(vld1q_f32(x + i), target)) != 0) {
+            break;
+        }
+    }
+#endif
+    for (; i < n; i++) {
+        if (x[i] == max_val) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Set the bias of one token
+void LogitBias::set_bias(llama_token id, float value)
+{
+    if (id < 0) {
+        return;
+    }
+    if ((size_t) id >= bias.size()) {
+        bias.resize(id + 1, 0.0f);
+    }
+    bias[id] = value;
+    has_bias = true;
+}
+
+void LogitBias::clear_bias()
+{
+    bias.clear();
+    has_bias = false;
+}
+
+// Ban one token
+void LogitBias::ban(llama_token id)
+{
+    if (id < 0 || is_banned(id)) {
+        return;
+    }
+    if ((size_t) id / 64 >= banned.size()) {
+        banned.resize(id / 64 + 1, 0);
+    }
+    banned[id / 64] |= (uint64_t) 1 << (id % 64);
+    n_banned++;
+}
+
+void LogitBias::unban(llama_token id)
+{
+    if (id < 0 || !is_banned(id)) {
+        return;
+    }
+    banned[id / 64] &= ~((uint64_t) 1 << (id % 64));
+    n_banned--;
+}
+
+void LogitBias::clear_bans()
+{
+    banned.clear();
+    n_banned = 0;
+}
+
+bool LogitBias::is_banned(llama_token id) const
+{
+    return id >= 0 && (size_t) id / 64 < banned.size() && (banned[id / 64] >> (id % 64) & 1) != 0;
+}
+
+// Apply the biases and bans to a row of logits
+void LogitBias::apply(float* logits, int n_vocab) const
+{
+    if (has_bias) {
+        add_floats(logits, bias.data(), std::min(bias.size(), (size_t) n_vocab));
+    }
+    if (n_banned > 0) {
+        // Bans are sparse, so only the non-empty words of the mask are expanded
+        const size_t n_words = std::min(banned.size(), ((size_t) n_vocab + 63) / 64);
+        for (size_t w = 0; w < n_words; w++) {
+            for (uint64_t bits = banned[w]; bits != 0; bits &= bits - 1) {
+                size_t bit = 0;
+                while ((bits >> bit & 1) == 0) {
+                    bit++;
+                }
+                const size_t id = w * 64 + bit;
+                if (id < (size_t) n_vocab) {
+                    logits[id] = -INFINITY;
+                }
+            }
+        }
+    }
+}
+
+// Replace the parameters
+void Sampler::set_params(const SamplingParams& params)
+{
+    this->params = params;
+    mirostat_mu = 2.0f * params.mirostat_tau;
+}
+
+// Pick the most likely token after the penalties
+llama_token Sampler::sample_greedy(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last)
+{
+    this->n_vocab = n_vocab;
+    if (!logit_bias.empty()) {
+        cand_logits.resize(n_vocab);
+        memcpy(cand_logits.data(), logits, sizeof(float) * n_vocab);
+        logit_bias.apply(cand_logits.data(), n_vocab);
+        logits = cand_logits.data();
+    }
+    llama_token best = argmax_floats(logits, n_vocab);
+    if (logits[best] == -INFINITY) {
+        // Every token is banned: end the text, as a grammar with no allowed token does
+        return llama_token_eos();
+    }
+    if (count_penalized(last_n, n_last)) {
+        // Only the penalized tokens can change place with the winner, unless the winner is one of them
+        const bool is_best_penalized = std::any_of(penalized.begin(), penalized.end(),
+            [best](const std::pair<llama_token, int>& token) { return token.first == best; });
+        if (is_best_penalized) {
+            if (logits != cand_logits.data()) {
+                cand_logits.resize(n_vocab);
+                memcpy(cand_logits.data(), logits, sizeof(float) * n_vocab);
+            }
+            for (const auto& token : penalized) {
+                cand_logits[token.first] = penalize(cand_logits[token.first], token.second);
+            }
+            return argmax_floats(cand_logits.data(), n_vocab);
+        }
+        float best_logit = logits[best];
+        for (const auto& token : penalized) {
+            const float logit = penalize(logits[token.first], token.second);
+            if (logit > best_logit || (logit == best_logit && token.first < best)) {
+                best = token.first;
+                best_logit = logit;
+            }
+        }
+    }
+    return best;
+}
+
+// Run the sampler chain over one row of logits
+size_t Sampler::distribution(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last)
+{
+    if (is_greedy()) {
+        // No probabilities are needed to pick the most likely token
+        return only_candidate(sample_greedy(logits, n_vocab, last_n, n_last));
+    }
+
+    this->n_vocab = n_vocab;
+    cand_ids.resize(n_vocab);
+    cand_logits.resize(n_vocab);
+    cand_probs.resize(n_vocab);
+    std::iota(cand_ids.begin(), cand_ids.end(), 0);
+    memcpy(cand_logits.data(), logits, sizeof(float) * n_vocab);
+    n_cand = n_vocab;
+    is_sorted = false;
+    has_probs = false;
+
+    if (!logit_bias.empty()) {
+        logit_bias.apply(cand_logits.data(), n_vocab);
+        // Every token is banned: end the text, as a grammar with no allowed token does.
+        // The softmax would otherwise divide 0 by 0.
+        if (max_floats(cand_logits.data(), n_vocab) == -INFINITY) {
+            return only_candidate(llama_token_eos());
+        }
+    }
+    apply_penalties(last_n, n_last);
+    apply_temperature();
+    if (params.mirostat == 1 || params.mirostat == 2) {
+        apply_mirostat();
+    } else {
+        if (params.top_k > 0 && (size_t) params.top_k < n_cand) {
+            apply_top_k(params.top_k);
+        }
+        apply_typical();
+        apply_top_p();
+        apply_min_p();
+    }
+    softmax();
+    return n_cand;
+}
+
+// Make `id` the only candidate, with probability 1
+size_t Sampler::only_candidate(llama_token id)
+{
+    cand_ids.resize(std::max(cand_ids.size(), (size_t) 1));
+    cand_logits.resize(std::max(cand_logits.size(), (size_t) 1));
+    cand_probs.resize(std::max(cand_probs.size(), (size_t) 1));
+    cand_ids[0] = id;
+    cand_logits[0] = 0.0f;
+    cand_probs[0] = 1.0f;
+    n_cand = 1;
+    is_sorted = true;
+    has_probs = true;
+    return n_cand;
+}
+
+// Draw a token from the last distribution
+llama_token Sampler::draw(std::mt19937& rng)
+{
+    if (n_cand == 1) {
+        update_mirostat(cand_probs[0]);
+        return cand_ids[0];
+    }
+    const float r = std::uniform_real_distribution<float>(0.0f, 1.0f)(rng);
+    float cum = 0.0f;
+    size_t pick = 0;
+    for (size_t i = 0; i < n_cand; i++) {
+        // Banned tokens can be among the candidates with a probability of 0
+        if (cand_probs[i] > 0.0f) {
+            pick = i;
+            cum += cand_probs[i];
+            if (r < cum) {
+                break;
+            }
+        }
+    }
+    update_mirostat(cand_probs[pick]);
+    return cand_ids[pick];
+}
+
+// Update the mirostat state with a token picked outside of draw()
+void Sampler::accept(llama_token id)
+{
+    for (size_t i = 0; i < n_cand; i++) {
+        if (cand_ids[i] == id) {
+            update_mirostat(cand_probs[i]);
+            return;
+        }
+    }
+}
+
+// Run the chain and draw a token
+llama_token Sampler::sample(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last,
+                            std::mt19937& rng)
+{
+    distribution(logits, n_vocab, last_n, n_last);
+    return draw(rng);
+}
+
+// Count the distinct tokens of last_n that the penalties apply to. Returns false if there are none.
+bool Sampler::count_penalized(const llama_token* last_n, size_t n_last)
+{
+    penalized.clear();
+    if (n_last == 0 ||
+        (params.repeat_penalty == 1.0f && params.frequency_penalty == 0.0f && params.presence_penalty == 0.0f)) {
+        return false;
+    }
+    // Sorting the (short) window groups repeated tokens, so the vocabulary is never scanned
+    penalty_tokens.assign(last_n, last_n + n_last);
+    std::sort(penalty_tokens.begin(), penalty_tokens.end());
+    for (size_t i = 0; i < penalty_tokens.size();) {
+        const llama_token id = penalty_tokens[i];
+        size_t n_seen = 1;
+        while (i + n_seen < penalty_tokens.size() && penalty_tokens[i + n_seen] == id) {
+            n_seen++;
+        }
+        i += n_seen;
+        if (id >= 0 && id < n_vocab) {
+            penalized.push_back(std::make_pair(id, (int) n_seen));
+        }
+    }
+    return !penalized.empty();
+}
+
+// Repetition penalty from the CTRL paper (https://arxiv.org/abs/1909.05858), applied once per
+// distinct token, followed by OpenAI-style frequency and presence penalties
+float Sampler::penalize(float logit, int n_seen) const
+{
+    logit = logit < 0.0f ? logit * params.repeat_penalty : logit / params.repeat_penalty;
+    return logit - (n_seen * params.frequency_penalty + params.presence_penalty);
+}
+
+void Sampler::apply_penalties(const llama_token* last_n, size_t n_last)
+{
+    if (!count_penalized(last_n, n_last)) {
+        return;
+    }
+    // Candidates still line up with token ids at this point
+    for (const auto& token : penalized) {
+        cand_logits[token.first] = penalize(cand_logits[token.first], token.second);
+    }
+}
+
+// Keep the k most likely candidates, sorted
+void Sampler::apply_top_k(size_t k)
+{
+    select_top(k);
+    gather(k);
+    is_sorted = true;
+}
+
+// Locally typical sampling (https://arxiv.org/abs/2202.00666): keep the candidates whose
+// surprise is closest to the entropy of the distribution
+void Sampler::apply_typical()
+{
+    if (params.typical_p >= 1.0f) {
+        return;
+    }
+    softmax();
+    float entropy = 0.0f;
+    for (size_t i = 0; i < n_cand; i++) {
+        if (cand_probs[i] > 0.0f) {
+            entropy -= cand_probs[i] * logf(cand_probs[i]);
+        }
+    }
+    scratch_scores.resize(n_cand);
+    for (size_t i = 0; i < n_cand; i++) {
+        scratch_scores[i] = fabsf(-logf(cand_probs[i]) - entropy);
+    }
+    order.resize(n_cand);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](int a, int b) { return scratch_scores[a] < scratch_scores[b]; });
+
+    float cum = 0.0f;
+    size_t n_keep = n_cand;
+    for (size_t i = 0; i < n_cand; i++) {
+        cum += cand_probs[order[i]];
+        if (cum >= params.typical_p) {
+            n_keep = i + 1;
+            break;
+        }
+    }
+    gather(n_keep);
+    is_sorted = false;
+}
+
+// Nucleus sampling: keep the smallest prefix whose probability reaches top_p
+void Sampler::apply_top_p()
+{
+    if (params.top_p >= 1.0f) {
+        return;
+    }
+    softmax();
+    // Without top-k the nucleus is usually a small fraction of the vocabulary, so grow a
+    // partial selection until it holds enough mass instead of sorting everything
+    size_t k = is_sorted ? n_cand : std::min(n_cand, (size_t) 256);
+    for (;;) {
+        if (k < n_cand) {
+            select_top(k);
+        } else {
+            sort();
+        }
+        float cum = 0.0f;
+        for (size_t i = 0; i < k; i++) {
+            cum += cand_probs[is_sorted ? i : order[i]];
+            if (cum >= params.top_p) {
+                k = i + 1;
+                break;
+            }
+        }
+        if (cum >= params.top_p || k >= n_cand) {
+            break;
+        }
+        k = std::min(n_cand, 4 * k);
+    }
+    if (is_sorted) {
+        n_cand = k;
+    } else {
+        gather(k);
+        is_sorted = true;
+    }
+    has_probs = false;
+}
+
+// Drop candidates less likely than min_p times the most likely one
+void Sampler::apply_min_p()
+{
+    if (params.min_p <= 0.0f) {
+        return;
+    }
+    // p_i >= min_p * p_max  <=>  logit_i >= logit_max + log(min_p)
+    const float max_logit = is_sorted ? cand_logits[0] : max_floats(cand_logits.data(), n_cand);
+    const float threshold = max_logit + logf(params.min_p);
+    size_t n_keep = 0;
+    for (size_t i = 0; i < n_cand; i++) {
+        if (cand_logits[i] >= threshold) {
+            cand_ids[n_keep] = cand_ids[i];
+            cand_logits[n_keep] = cand_logits[i];
+            n_keep++;
+        }
+    }
+    n_cand = n_keep;
+    has_probs = false;
+}
+
+void Sampler::apply_temperature()
+{
+    if (params.temp != 1.0f) {
+        scale_floats(cand_logits.data(), n_cand, 1.0f / params.temp);
+    }
+}
+
+// Mirostat (https://arxiv.org/abs/2007.14966): truncate the distribution so the surprise of
+// the sampled tokens tracks mirostat_tau
+void Sampler::apply_mirostat()
+{
+    if (params.mirostat == 1) {
+        // Estimate the Zipf exponent from the m most likely tokens, then derive top-k from mu
+        const size_t m = std::min((size_t) 100, n_cand);
+        sort();
+        softmax();
+        float sum_ti_bi = 0.0f;
+        float sum_ti_sq = 0.0f;
+        for (size_t i = 0; i + 1 < m; i++) {
+            const float t_i = logf((float) (i + 2) / (float) (i + 1));
+            const float b_i = logf(cand_probs[i] / cand_probs[i + 1]);
+            sum_ti_bi += t_i * b_i;
+            sum_ti_sq += t_i * t_i;
+        }
+        const float s_hat = sum_ti_sq > 0.0f ? sum_ti_bi / sum_ti_sq : 1.0f;
+        const float epsilon_hat = s_hat - 1.0f;
+        const float k = powf((epsilon_hat * powf(2.0f, mirostat_mu)) / (1.0f - powf(n_vocab, -epsilon_hat)), 1.0f / s_hat);
+        if (std::isfinite(k)) {
+            n_cand = std::min(n_cand, (size_t) std::max(k, 1.0f));
+        }
+    } else {
+        // Mirostat 2.0: drop the tokens with a surprise above mu, i.e. p < 2^-mu
+        softmax();
+        const float min_prob = powf(2.0f, -mirostat_mu);
+        size_t best = 0;
+        size_t n_keep = 0;
+        for (size_t i = 0; i < n_cand; i++) {
+            if (cand_probs[i] > cand_probs[best]) {
+                best = i;
+            }
+            if (cand_probs[i] >= min_prob) {
+                cand_ids[n_keep] = cand_ids[i];
+                cand_logits[n_keep] = cand_logits[i];
+                n_keep++;
+            }
+        }
+        // Always keep the most likely token
+        if (n_keep == 0) {
+            cand_ids[0] = cand_ids[best];
+            cand_logits[0] = cand_logits[best];
+            n_keep = 1;
+        }
+        n_cand = n_keep;
+    }
+    has_probs = false;
+}
+
+// Move the surprise estimate towards the target after a token with probability p was picked
+void Sampler::update_mirostat(float p)
+{
+    if (params.mirostat != 1 && params.mirostat != 2) {
+        return;
+    }
+    const float surprise = -log2f(std::max(p, 1e-20f));
+    mirostat_mu -= params.mirostat_eta * (surprise - params.mirostat_tau);
+}
+
+// Put the positions of the k most likely candidates into `order`, sorted by descending logit
+void Sampler::select_top(size_t k)
+{
+    // Min-heap of the best k so far. Most candidates lose against its top in one comparison.
+    heap.resize(k);
+    for (size_t i = 0; i < k; i++) {
+        heap[i] = std::make_pair(cand_logits[i], (int) i);
+    }
+    std::make_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+    for (size_t i = k; i < n_cand; i++) {
+        if (cand_logits[i] > heap.front().first) {
+            std::pop_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+            heap.back() = std::make_pair(cand_logits[i], (int) i);
+            std::push_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+        }
+    }
+    std::sort_heap(heap.begin(), heap.end(), std::greater<std::pair<float, int>>());
+    order.resize(k);
+    for (size_t i = 0; i < k; i++) {
+        order[i] = heap[i].second;
+    }
+}
+
+// Sort the candidates by descending logit
+void Sampler::sort()
+{
+    if (is_sorted) {
+        return;
+    }
+    order.resize(n_cand);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [this](int a, int b) { return cand_logits[a] > cand_logits[b]; });
+    gather(n_cand);
+    is_sorted = true;
+}
+
+// Keep the first n candidates listed in `order`
+void Sampler::gather(size_t n)
+{
+    scratch_ids.resize(cand_ids.size());
+    scratch_logits.resize(cand_logits.size());
+    for (size_t i = 0; i < n; i++) {
+        scratch_ids[i] = cand_ids[order[i]];
+        scratch_logits[i] = cand_logits[order[i]];
+    }
+    cand_ids.swap(scratch_ids);
+    cand_logits.swap(scratch_logits);
+    // The probabilities move with their candidates. They still sum to 1 if none were dropped.
+    if (has_probs) {
+        scratch_probs.resize(cand_probs.size());
+        for (size_t i = 0; i < n; i++) {
+            scratch_probs[i] = cand_probs[order[i]];
+        }
+        cand_probs.swap(scratch_probs);
+    }
+    has_probs = has_probs && n == n_cand;
+    n_cand = n;
+}
+
+// Turn the logits of the candidates into probabilities
+void Sampler::softmax()
+{
+    if (has_probs) {
+        return;
+    }
+    const float max_logit = is_sorted ? cand_logits[0] : max_floats(cand_logits.data(), n_cand);
+    for (size_t i = 0; i < n_cand; i++) {
+        cand_probs[i] = expf(cand_logits[i] - max_logit);
+    }
+    scale_floats(cand_probs.data(), n_cand, 1.0f / sum_floats(cand_probs.data(), n_cand));
+    has_probs = true;
+}
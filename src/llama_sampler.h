@@ -0,0 +1,148 @@
+#ifndef LLAMA_SAMPLER_H
+#define LLAMA_SAMPLER_H
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+/* Parameters of the sampler chain. A step is disabled by its neutral value. */
+struct SamplingParams {
+    int32_t top_k             = 40;     // <= 0 to keep the whole vocabulary
+    float   top_p             = 0.95f;  // 1.0 = disabled
+    float   min_p             = 0.0f;   // 0.0 = disabled
+    float   typical_p         = 1.0f;   // 1.0 = disabled
+    float   temp              = 0.80f;  // <= 0 picks the most likely token
+    float   repeat_penalty    = 1.10f;  // 1.0 = disabled
+    float   frequency_penalty = 0.0f;   // 0.0 = disabled
+    float   presence_penalty  = 0.0f;   // 0.0 = disabled
+    int32_t mirostat          = 0;      // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
+    float   mirostat_tau      = 5.0f;   // target surprise in bits
+    float   mirostat_eta      = 0.1f;   // learning rate
+};
+
+/* Persistent additive logit biases and banned tokens.
+ *
+ * Biases are kept as a dense array indexed by token id so they can be added to a row of
+ * logits with a vector loop; bans are a bitmask with one bit per token. Both grow on
+ * demand up to the largest token id that was set.
+ */
+class LogitBias {
+    public:
+        // Add `bias` to the logit of `id` on every step, replacing any previous bias for it
+        void set_bias(llama_token id, float bias);
+        void clear_bias();
+        // Never sample `id`
+        void ban(llama_token id);
+        void unban(llama_token id);
+        void clear_bans();
+        bool is_banned(llama_token id) const;
+
+        // True when apply() would change nothing
+        bool empty() const { return !has_bias && n_banned == 0; }
+        // Add the biases to a row of logits and set the banned ones to -inf
+        void apply(float* logits, int n_vocab) const;
+
+    private:
+        std::vector<float> bias{};
+        std::vector<uint64_t> banned{};
+        bool has_bias = false;
+        size_t n_banned = 0;
+};
+
+/* Turns a row of logits into a token.
+ *
+ * The chain runs over a reused candidate buffer, in this order:
+ *   logit bias and bans -> penalties -> temperature -> top-k -> typical -> top-p -> min-p -> sample
+ * or, with mirostat enabled:
+ *   logit bias and bans -> penalties -> temperature -> mirostat -> sample
+ * Greedy settings (temp <= 0, or top_k == 1 without mirostat) skip the chain and take a
+ * vectorized argmax over the logits.
+ * Top-k and top-p select the most likely candidates with a bounded heap and only sort
+ * the survivors, so the full vocabulary is not sorted for every token.
+ */
+class Sampler {
+    public:
+        Sampler() = default;
+        explicit Sampler(const SamplingParams& params) { set_params(params); }
+
+        // Replace the parameters. Resets the mirostat state.
+        void set_params(const SamplingParams& params);
+        const SamplingParams& get_params() const { return params; }
+        // Mirostat estimate of the maximum surprise, for saving and restoring a session
+        float get_mirostat_mu() const { return mirostat_mu; }
+        void set_mirostat_mu(float mu) { mirostat_mu = mu; }
+        // Biases and bans applied before every other step. Kept across set_params().
+        LogitBias& get_logit_bias() { return logit_bias; }
+
+        // Run the chain and return the number of candidates left. After this call
+        // token(i) and prob(i) describe the distribution to sample from, with the
+        // probabilities summing to 1. `last_n` are the tokens the penalties apply to.
+        // When the bans leave no token, EOS is the only candidate.
+        size_t distribution(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last);
+        llama_token token(size_t i) const { return cand_ids[i]; }
+        float prob(size_t i) const { return cand_probs[i]; }
+
+        // Draw one token from the last distribution() and update the mirostat state with it
+        llama_token draw(std::mt19937& rng);
+        // Update the mirostat state with a token picked from the last distribution() by other means
+        void accept(llama_token id);
+
+        // True when the chain always ends up with the most likely token
+        bool is_greedy() const { return params.temp <= 0.0f || (params.top_k == 1 && params.mirostat == 0); }
+        // Most likely token after the logit bias and penalties. Uses a vectorized argmax over the logits and
+        // never computes probabilities.
+        llama_token sample_greedy(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last);
+
+        // distribution() followed by draw()
+        llama_token sample(const float* logits, int n_vocab, const llama_token* last_n, size_t n_last,
+                           std::mt19937& rng);
+
+    private:
+        bool count_penalized(const llama_token* last_n, size_t n_last);
+        float penalize(float logit, int n_seen) const;
+        void apply_penalties(const llama_token* last_n, size_t n_last);
+        void apply_top_k(size_t k);
+        void apply_typical();
+        void apply_top_p();
+        void apply_min_p();
+        void apply_temperature();
+        void apply_mirostat();
+        void update_mirostat(float p);
+        void select_top(size_t k);
+        // Sort the candidates by descending logit
+        void sort();
+        // Keep the candidates listed in `order`, in that order
+        void gather(size_t n);
+        void softmax();
+        size_t only_candidate(llama_token id);
+
+        SamplingParams params{};
+        LogitBias logit_bias{};
+        // Current estimate of the maximum surprise for mirostat
+        float mirostat_mu = 0.0f;
+        int n_vocab = 0;
+
+        // Candidates as parallel arrays so the softmax can run over contiguous floats
+        std::vector<llama_token> cand_ids{};
+        std::vector<float> cand_logits{};
+        std::vector<float> cand_probs{};
+        size_t n_cand = 0;
+        bool is_sorted = false;
+        bool has_probs = false;
+
+        // Scratch space
+        std::vector<int> order{};
+        std::vector<std::pair<float, int>> heap{};
+        std::vector<llama_token> scratch_ids{};
+        std::vector<float> scratch_logits{};
+        std::vector<float> scratch_probs{};
+        std::vector<float> scratch_scores{};
+        std::vector<llama_token> penalty_tokens{};
+        // Distinct penalized tokens with their number of occurrences
+        std::vector<std::pair<llama_token, int>> penalized{};
+};
+
+#endif /* LLAMA_SAMPLER_H */
@@ -0,0 +1,184 @@
+#include "llama_scheduler.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+GenerationScheduler::GenerationScheduler(std::shared_ptr<LlamaModel> model, int n_turn_tokens)
+    : model(model), n_turn_tokens(std::max(0, n_turn_tokens))
+{
+    worker = std::thread(&GenerationScheduler::run, this);
+}
+
+GenerationScheduler::~GenerationScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_cv.notify_all();
+    worker.join();
+}
+
+// Queue a request
+int GenerationScheduler::submit(const vector<llama_token>& prompt, const InferenceParams& params,
+                                const std::vector<std::string>& stop)
+{
+    std::unique_ptr<Request> request(new Request());
+    request->session.reset(new LlamaWrapper(model, params));
+    if (!request->session->init()) {
+        throw std::runtime_error("Failed to set up a session for the request");
+    }
+    request->session->set_input(prompt);
+    request->n_predict = params.n_predict;
+    request->stop = StopMatcher(stop);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    request->id = next_id++;
+    cancel_flags[request->id] = false;
+    queued.push_back(std::move(request));
+    work_cv.notify_one();
+    return next_id - 1;
+}
+
+// Queue a request from text
+int GenerationScheduler::submit(const std::string& prompt, const InferenceParams& params,
+                                const std::vector<std::string>& stop)
+{
+    vector<llama_token> tokens(prompt.size() + 1);
+    const int n = llama_tokenize(model->get_ctx(), prompt.c_str(), tokens.data(), tokens.size(), true);
+    tokens.resize(std::max(n, 0));
+    return submit(tokens, params, stop);
+}
+
+// Check if a request has finished
+bool GenerationScheduler::is_done(int id) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished.count(id) > 0;
+}
+
+// Wait for a request to finish and take its result
+GenerationResult GenerationScheduler::wait(int id)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (finished.count(id) == 0 && cancel_flags.count(id) == 0) {
+        throw std::invalid_argument("Unknown request id " + std::to_string(id));
+    }
+    done_cv.wait(lock, [&]() { return finished.count(id) > 0; });
+    GenerationResult result = std::move(finished[id]);
+    finished.erase(id);
+    return result;
+}
+
+// Stop a request at the next token boundary
+void GenerationScheduler::cancel(int id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cancel_flags.find(id);
+    if (it != cancel_flags.end()) {
+        it->second = true;
+    }
+}
+
+// Number of requests that are queued or running
+int GenerationScheduler::n_pending() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return cancel_flags.size();
+}
+
+// Worker loop
+void GenerationScheduler::run()
+{
+    std::vector<std::unique_ptr<Request>> active;
+    while (true) {
+        {
+            // Admit new requests at the token boundary
+            std::unique_lock<std::mutex> lock(mutex);
+            work_cv.wait(lock, [&]() { return stopping || !queued.empty() || !active.empty(); });
+            if (stopping) {
+                while (!queued.empty()) {
+                    active.push_back(std::move(queued.front()));
+                    queued.pop_front();
+                }
+                break;
+            }
+            while (!queued.empty()) {
+                active.push_back(std::move(queued.front()));
+                queued.pop_front();
+            }
+        }
+
+        // Give each active request one turn
+        for (auto& request : active) {
+            for (int i = 0; n_turn_tokens == 0 || i < n_turn_tokens; i++) {
+                bool is_cancelled;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    is_cancelled = cancel_flags[request->id];
+                }
+                if (is_cancelled) {
+                    request->result.cancelled = true;
+                }
+                if (is_cancelled || !step(*request)) {
+                    finish(std::move(request));
+                    break;
+                }
+            }
+        }
+        active.erase(std::remove(active.begin(), active.end(), nullptr), active.end());
+    }
+    // Unblock anyone still waiting on a request
+    for (auto& request : active) {
+        request->result.cancelled = true;
+        finish(std::move(request));
+    }
+}
+
+// Ingest one prompt batch, or sample and evaluate one token
+bool GenerationScheduler::step(Request& request)
+{
+    LlamaWrapper& session = *request.session;
+    if (session.has_unconsumed_input()) {
+        session.ingest_input_batch();
+        if (!session.eval()) {
+            request.result.failed = true;
+            return false;
+        }
+        return true;
+    }
+    if ((int) request.result.tokens.size() >= request.n_predict) {
+        return false;
+    }
+    const llama_token id = session.sample();
+    if (id == llama_token_eos()) {
+        return false;
+    }
+    request.result.tokens.push_back(id);
+    const std::string piece = session.token_to_str(id);
+    request.result.text += piece;
+    if (request.stop.feed(piece)) {
+        request.result.text.resize(request.stop.match_begin());
+        return false;
+    }
+    if ((int) request.result.tokens.size() >= request.n_predict) {
+        return false;
+    }
+    if (!session.eval()) {
+        request.result.failed = true;
+        return false;
+    }
+    return true;
+}
+
+// Publish the result of a request and release its session
+void GenerationScheduler::finish(std::unique_ptr<Request> request)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancel_flags.erase(request->id);
+        finished[request->id] = std::move(request->result);
+    }
+    done_cv.notify_all();
+}
@@ -0,0 +1,93 @@
+#ifndef LLAMA_SCHEDULER_H
+#define LLAMA_SCHEDULER_H
+
+#include "llama_model.h"
+#include "llama_wrapper.h"
+#include "stop_matcher.h"
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/* Result of a request submitted to a GenerationScheduler */
+struct GenerationResult {
+    // Tokens up to and including the one that completed a stop string
+    vector<llama_token> tokens{};
+    // Text of the tokens, without the stop string
+    std::string text = "";
+    bool cancelled = false;
+    bool failed = false;
+};
+
+/* Runs many generation requests on one shared model.
+ *
+ * A worker thread keeps a set of active requests, each with its own LlamaWrapper session
+ * (prompt, sampling parameters and KV cache). Every round it gives each active request a turn
+ * of `n_turn_tokens` steps, where a step either ingests one prompt batch or samples and evaluates
+ * one token, and new requests are admitted between rounds. A request submitted while others are
+ * generating therefore starts within a round instead of after them.
+ *
+ * The vendored llama_eval() runs one sequence per context, so requests take turns rather than
+ * being batched together. Moving to another request stashes the used KV positions of one session
+ * and restores those of the other: for the f16 7B model about 0.5 MB per position each way, so
+ * tens of milliseconds for a few hundred tokens, against roughly a hundred for evaluating a single
+ * token on a CPU. With the default turns of 8 tokens the copies add a few percent; longer turns
+ * spread them over more tokens, and n_turn_tokens <= 0 runs each request to the end, which makes
+ * the scheduler a plain queue.
+ */
+class GenerationScheduler {
+    public:
+        GenerationScheduler(std::shared_ptr<LlamaModel> model, int n_turn_tokens = 8);
+        ~GenerationScheduler();
+        GenerationScheduler(const GenerationScheduler&) = delete;
+        GenerationScheduler& operator=(const GenerationScheduler&) = delete;
+
+        // Queue a request. Generates up to params.n_predict tokens, stopping before the first of the `stop`
+        // strings. Returns the request id. Throws std::runtime_error if the session cannot be set up.
+        int submit(const vector<llama_token>& prompt, const InferenceParams& params,
+                   const std::vector<std::string>& stop = std::vector<std::string>());
+        // Queue a request from text. A BOS token is added in front of the prompt.
+        int submit(const std::string& prompt, const InferenceParams& params,
+                   const std::vector<std::string>& stop = std::vector<std::string>());
+        // Check if a request has finished
+        bool is_done(int id) const;
+        // Wait for a request to finish and take its result
+        GenerationResult wait(int id);
+        // Stop a request at the next token boundary
+        void cancel(int id);
+        // Number of requests that are queued or running
+        int n_pending() const;
+
+    private:
+        struct Request {
+            int id = 0;
+            std::unique_ptr<LlamaWrapper> session{};
+            int n_predict = 0;
+            StopMatcher stop{};
+            GenerationResult result{};
+        };
+
+        void run();
+        // Run one step of a request. Returns false once the request has finished.
+        bool step(Request& request);
+        void finish(std::unique_ptr<Request> request);
+
+        std::shared_ptr<LlamaModel> model;
+        // Steps per turn, 0 to run each request to the end
+        const int n_turn_tokens;
+
+        mutable std::mutex mutex{};
+        std::condition_variable work_cv{};
+        std::condition_variable done_cv{};
+        std::deque<std::unique_ptr<Request>> queued{};
+        std::map<int, GenerationResult> finished{};
+        std::map<int, bool> cancel_flags{};  // ids of queued and running requests
+        int next_id = 0;
+        bool stopping = false;
+
+        std::thread worker{};
+};
+
+#endif /* LLAMA_SCHEDULER_H */
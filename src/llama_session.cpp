@@ -0,0 +1,270 @@
+#include "llama_wrapper.h"
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* Session file layout (host byte order)
+ *
+ *   SessionHeader                fixed size, at offset 0
+ *   section 0..SECTION_COUNT-1   each starting on a kSectionAlignment boundary
+ *
+ * The header holds the offset and size of every section, so a reader can map the file
+ * and use the sections in place. The KV cache is by far the largest section. Only its first
+ * kv_token_count positions are stored, in the compact form of KvCacheLayout::save(), and they
+ * are copied straight from the mapping into the context.
+ */
+static const uint32_t kSessionMagic = 0x6c6c7373; // 'llss'
+static const uint32_t kSessionVersion = 2;
+static const uint64_t kSectionAlignment = 64;
+
+enum SessionSectionId {
+    SECTION_KV_CACHE = 0,     // KV cache bytes of positions [0, kv_token_count), see KvCacheLayout
+    SECTION_PAST_TOKENS,      // llama_token[n_past], tokens backing the KV cache
+    SECTION_EMBD_INP,         // llama_token[], input buffer
+    SECTION_EMBD,             // llama_token[], tokens waiting to be evaluated
+    SECTION_REPEAT_WINDOW,    // llama_token[], repeat window from oldest to newest
+    SECTION_RNG,              // text serialization of the std::mt19937 state
+    SECTION_COUNT
+};
+
+struct SessionSection {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SessionHeader {
+    uint32_t magic;
+    uint32_t version;
+    int32_t n_ctx;
+    int32_t n_vocab;
+    int32_t n_embd;
+    int32_t n_past;
+    int32_t n_consumed;
+    int32_t kv_token_count;
+    float mirostat_mu;
+    uint32_t reserved;
+    uint64_t kv_size;         // llama_get_kv_cache_size() of the context the session was saved from
+    SessionSection sections[SECTION_COUNT];
+};
+static_assert(sizeof(SessionHeader) == 48 + SECTION_COUNT * sizeof(SessionSection),
+              "SessionHeader must not contain padding");
+
+static uint64_t align_offset(uint64_t offset)
+{
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+// Read-only view of a whole file. Memory mapped where available.
+class SessionFile {
+    public:
+        ~SessionFile()
+        {
+#ifndef _WIN32
+            if (mapped != nullptr) {
+                munmap(mapped, n_bytes);
+            }
+#endif
+        }
+
+        bool open(const std::string& path)
+        {
+#ifndef _WIN32
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                close(fd);
+                return false;
+            }
+            n_bytes = (size_t) st.st_size;
+            void* addr = mmap(nullptr, n_bytes, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (addr == MAP_FAILED) {
+                return false;
+            }
+            mapped = addr;
+            bytes = static_cast<const uint8_t*>(addr);
+            return true;
+#else
+            FILE* fp = fopen(path.c_str(), "rb");
+            if (fp == nullptr) {
+                return false;
+            }
+            fseek(fp, 0, SEEK_END);
+            buffer.resize((size_t) ftell(fp));
+            fseek(fp, 0, SEEK_SET);
+            const bool ok = fread(buffer.data(), 1, buffer.size(), fp) == buffer.size();
+            fclose(fp);
+            bytes = buffer.data();
+            n_bytes = buffer.size();
+            return ok;
+#endif
+        }
+
+        const uint8_t* data() const { return bytes; }
+        size_t size() const { return n_bytes; }
+
+    private:
+        const uint8_t* bytes = nullptr;
+        size_t n_bytes = 0;
+#ifndef _WIN32
+        void* mapped = nullptr;
+#else
+        std::vector<uint8_t> buffer{};
+#endif
+};
+
+// Save the session to a file
+bool LlamaWrapper::save_session(const std::string& path) const
+{
+    auto lease = acquire();
+    const std::vector<llama_token> repeat_window(last_n_tokens.data(), last_n_tokens.data() + last_n_tokens.size());
+    std::ostringstream rng_state;
+    rng_state << rng;
+    const std::string rng_str = rng_state.str();
+    std::vector<uint8_t> kv_cache;
+    model->get_kv_layout().save(ctx, session.kv_token_count, kv_cache);
+
+    const void* section_data[SECTION_COUNT] = {
+        kv_cache.data(),
+        past_tokens.data(),
+        embd_inp.data(),
+        embd.data(),
+        repeat_window.data(),
+        rng_str.data(),
+    };
+    const uint64_t section_size[SECTION_COUNT] = {
+        kv_cache.size(),
+        n_past * sizeof(llama_token),
+        embd_inp.size() * sizeof(llama_token),
+        embd.size() * sizeof(llama_token),
+        repeat_window.size() * sizeof(llama_token),
+        rng_str.size(),
+    };
+
+    SessionHeader header{};
+    header.magic = kSessionMagic;
+    header.version = kSessionVersion;
+    header.n_ctx = n_ctx;
+    header.n_vocab = llama_n_vocab(ctx);
+    header.n_embd = llama_n_embd(ctx);
+    header.n_past = n_past;
+    header.n_consumed = n_consumed;
+    header.kv_token_count = session.kv_token_count;
+    header.mirostat_mu = sampler.get_mirostat_mu();
+    header.kv_size = llama_get_kv_cache_size(ctx);
+    uint64_t offset = sizeof(SessionHeader);
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        offset = align_offset(offset);
+        header.sections[i].offset = offset;
+        header.sections[i].size = section_size[i];
+        offset += section_size[i];
+    }
+
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) {
+        fprintf(stderr, "%s: failed to open '%s' for writing\n", __func__, path.c_str());
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    const char padding[kSectionAlignment] = {};
+    offset = sizeof(SessionHeader);
+    for (int i = 0; i < SECTION_COUNT && ok; i++) {
+        const uint64_t n_pad = header.sections[i].offset - offset;
+        ok = fwrite(padding, 1, n_pad, fp) == n_pad;
+        if (ok && section_size[i] > 0) {
+            ok = fwrite(section_data[i], 1, section_size[i], fp) == section_size[i];
+        }
+        offset = header.sections[i].offset + section_size[i];
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write '%s'\n", __func__, path.c_str());
+    }
+    return ok;
+}
+
+// Restore a session from a file
+bool LlamaWrapper::load_session(const std::string& path)
+{
+    SessionFile file;
+    if (!file.open(path)) {
+        fprintf(stderr, "%s: failed to open '%s'\n", __func__, path.c_str());
+        return false;
+    }
+    if (file.size() < sizeof(SessionHeader)) {
+        fprintf(stderr, "%s: '%s' is not a session file\n", __func__, path.c_str());
+        return false;
+    }
+    SessionHeader header;
+    memcpy(&header, file.data(), sizeof(header));
+    if (header.magic != kSessionMagic) {
+        fprintf(stderr, "%s: '%s' is not a session file\n", __func__, path.c_str());
+        return false;
+    }
+    if (header.version != kSessionVersion) {
+        fprintf(stderr, "%s: unsupported session version %u (expected %u)\n", __func__, header.version, kSessionVersion);
+        return false;
+    }
+    if (header.n_ctx != n_ctx || header.n_vocab != llama_n_vocab(ctx) || header.n_embd != llama_n_embd(ctx) ||
+        header.kv_size != llama_get_kv_cache_size(ctx)) {
+        fprintf(stderr, "%s: session in '%s' was saved with a different model or context size\n", __func__, path.c_str());
+        return false;
+    }
+    for (int i = 0; i < SECTION_COUNT; i++) {
+        const SessionSection& section = header.sections[i];
+        if (section.offset > file.size() || section.size > file.size() - section.offset) {
+            fprintf(stderr, "%s: '%s' is truncated\n", __func__, path.c_str());
+            return false;
+        }
+    }
+    const KvCacheLayout& kv_layout = model->get_kv_layout();
+    if (header.kv_token_count < 0 || header.kv_token_count > n_ctx || header.n_past > header.kv_token_count ||
+        header.sections[SECTION_KV_CACHE].size != kv_layout.saved_size(header.kv_token_count) ||
+        header.sections[SECTION_PAST_TOKENS].size != header.n_past * sizeof(llama_token) ||
+        header.n_consumed > (int32_t) (header.sections[SECTION_EMBD_INP].size / sizeof(llama_token))) {
+        fprintf(stderr, "%s: '%s' is corrupted\n", __func__, path.c_str());
+        return false;
+    }
+
+    auto read_tokens = [&](SessionSectionId id) {
+        const SessionSection& section = header.sections[id];
+        const llama_token* begin = reinterpret_cast<const llama_token*>(file.data() + section.offset);
+        return vector<llama_token>(begin, begin + section.size / sizeof(llama_token));
+    };
+    auto lease = acquire();
+    kv_layout.load(ctx, header.kv_token_count, file.data() + header.sections[SECTION_KV_CACHE].offset);
+    session.kv_token_count = header.kv_token_count;
+
+    past_tokens = read_tokens(SECTION_PAST_TOKENS);
+    embd_inp = read_tokens(SECTION_EMBD_INP);
+    embd = read_tokens(SECTION_EMBD);
+    const vector<llama_token> repeat_window = read_tokens(SECTION_REPEAT_WINDOW);
+    last_n_tokens.clear();
+    last_n_tokens.push(repeat_window.data(), repeat_window.size());
+
+    const SessionSection& rng_section = header.sections[SECTION_RNG];
+    std::istringstream rng_state(std::string(reinterpret_cast<const char*>(file.data() + rng_section.offset), rng_section.size));
+    rng_state >> rng;
+    sampler.set_mirostat_mu(header.mirostat_mu);
+
+    n_past = header.n_past;
+    n_consumed = header.n_consumed;
+    // Logits are not part of the session, so queue the last cached token for
+    // re-evaluation when there is nothing else to evaluate before sampling.
+    if (embd.empty() && !has_unconsumed_input() && n_past > 0)
+    {
+        n_past--;
+        embd.push_back(past_tokens.back());
+    }
+    return true;
+}
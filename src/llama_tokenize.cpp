@@ -0,0 +1,86 @@
+#include "llama_tokenize.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <thread>
+
+namespace {
+
+// Texts are handed to the threads in blocks of this many, so that long and short texts even out
+const size_t block_size = 64;
+
+struct Block {
+    std::vector<llama_token> tokens{};
+    // Number of tokens of each text in the block
+    std::vector<int64_t> counts{};
+};
+
+void tokenize_block(llama_context* ctx, const BpeTokenizer* bpe_tokenizer, const std::vector<std::string>& texts,
+                    size_t begin, size_t end, bool add_bos, Block& block)
+{
+    block.counts.resize(end - begin);
+    for (size_t i = begin; i < end; i++) {
+        const size_t start = block.tokens.size();
+        if (bpe_tokenizer) {
+            // Cut at the first NUL like llama_tokenize(), which takes a C string
+            bpe_tokenizer->tokenize(texts[i].c_str(), strlen(texts[i].c_str()), add_bos, block.tokens);
+            block.counts[i - begin] = block.tokens.size() - start;
+            continue;
+        }
+        // A text never has more tokens than bytes
+        const size_t n_max = texts[i].size() + (add_bos ? 1 : 0);
+        block.tokens.resize(start + n_max);
+        const int n = llama_tokenize(ctx, texts[i].c_str(), block.tokens.data() + start, (int) n_max, add_bos);
+        assert(n >= 0);
+        block.tokens.resize(start + n);
+        block.counts[i - begin] = n;
+    }
+}
+
+}  // namespace
+
+// Tokenize blocks of texts in parallel, then concatenate them in order
+void tokenize_batch(llama_context* ctx, const BpeTokenizer* bpe_tokenizer, const std::vector<std::string>& texts,
+                    bool add_bos, int n_threads, std::vector<llama_token>& tokens, std::vector<int64_t>& offsets)
+{
+    if (n_threads <= 0) {
+        n_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    }
+    const size_t n_blocks = (texts.size() + block_size - 1) / block_size;
+    std::vector<Block> blocks(n_blocks);
+    std::atomic<size_t> next_block{0};
+    auto work = [&]() {
+        for (size_t b = next_block++; b < n_blocks; b = next_block++) {
+            tokenize_block(ctx, bpe_tokenizer, texts, b * block_size, std::min(texts.size(), (b + 1) * block_size), add_bos,
+                           blocks[b]);
+        }
+    };
+    // The calling thread is one of the workers
+    const size_t n_workers = std::min((size_t) n_threads, n_blocks);
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < n_workers; i++) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    offsets.resize(texts.size() + 1);
+    offsets[0] = 0;
+    size_t i = 0;
+    for (const Block& block : blocks) {
+        for (const int64_t count : block.counts) {
+            offsets[i + 1] = offsets[i] + count;
+            i++;
+        }
+    }
+    tokens.resize(offsets.back());
+    llama_token* out = tokens.data();
+    for (Block& block : blocks) {
+        out = std::copy(block.tokens.begin(), block.tokens.end(), out);
+        // Give the memory back as soon as possible, large batches hold a copy of every token
+        std::vector<llama_token>().swap(block.tokens);
+    }
+}
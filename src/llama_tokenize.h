@@ -0,0 +1,17 @@
+#ifndef LLAMA_TOKENIZE_H
+#define LLAMA_TOKENIZE_H
+
+#include "bpe_tokenizer.h"
+#include "llama.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Tokenize many texts on n_threads threads (all cores if n_threads <= 0). The tokens of all texts
+// are written back to back to `tokens`; the tokens of text i are tokens[offsets[i], offsets[i + 1]),
+// so `offsets` has texts.size() + 1 entries. Uses `bpe_tokenizer` if given and llama_tokenize()
+// otherwise. Only uses vocabulary queries, so it does not need exclusive access to the context.
+void tokenize_batch(llama_context* ctx, const BpeTokenizer* bpe_tokenizer, const std::vector<std::string>& texts,
+                    bool add_bos, int n_threads, std::vector<llama_token>& tokens, std::vector<int64_t>& offsets);
+
+#endif /* LLAMA_TOKENIZE_H */
@@ -1,5 +1,7 @@
 #include "llama_wrapper.h"
 #include <cassert>
+#include <cmath>
+#include <cstring>
 
 static void trigger_cb(float progress, void * user_data) {
     if (user_data == nullptr) {
@@ -16,34 +18,139 @@ bool LlamaWrapper::init()
     {
         return true;
     }
-    // update pointer to callback if needed
-    if(inference_params.callback)
+    if (!model)
     {
-        using raw_cb = void (*)(float, void*);
-        inference_params.ctx_params.progress_callback = (raw_cb)trigger_cb;
-        inference_params.ctx_params.progress_callback_user_data = &inference_params.callback;
-    }else{
-        inference_params.ctx_params.progress_callback = nullptr;
+        // update pointer to callback if needed
+        if(inference_params.callback)
+        {
+            using raw_cb = void (*)(float, void*);
+            inference_params.ctx_params.progress_callback = (raw_cb)trigger_cb;
+            inference_params.ctx_params.progress_callback_user_data = &inference_params.callback;
+        }else{
+            inference_params.ctx_params.progress_callback = nullptr;
+        }
+        inference_params.ctx_params.n_ctx = inference_params.n_ctx;
+        inference_params.ctx_params.seed = inference_params.seed;
+        inference_params.ctx_params.f16_kv = inference_params.memory_f16;
+        inference_params.ctx_params.use_mlock = inference_params.use_mlock;
+        // Checking a draft takes the logits of every drafted position
+        if (is_speculative())
+        {
+            inference_params.ctx_params.logits_all = true;
+        }
+        model = std::make_shared<LlamaModel>(inference_params.path_model, inference_params.ctx_params);
+    }
+    if (!model->is_loaded())
+    {
+        fprintf(stderr, "%s: failed to load model '%s'\n", __func__, inference_params.path_model.c_str());
+        return false;
+    }
+    ctx = model->get_ctx();
+    model->init_session(&session);
+    inference_params.ctx_params = model->get_params();
+    bpe_tokenizer = model->get_bpe_tokenizer();
+    if (inference_params.n_token_cache > 0)
+    {
+        token_cache.reset(new TokenCache(inference_params.n_token_cache));
     }
-    ctx = llama_init_from_file(inference_params.path_model.c_str(), inference_params.ctx_params);
 
     n_ctx = llama_n_ctx(ctx);
-    last_n_tokens = std::vector<llama_token>(n_ctx);
-    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+    rng.seed(inference_params.seed < 0 ? std::random_device{}() : inference_params.seed);
+    sampler.set_params(get_sampling_params(inference_params));
+    // The repeat penalty only ever looks at the last `repeat_last_n` tokens
+    last_n_tokens = RepeatWindow(std::max(0, std::min(inference_params.repeat_last_n, n_ctx)));
+    if (is_speculative() && !inference_params.ctx_params.logits_all)
+    {
+        fprintf(stderr, "%s: speculative decoding needs a model loaded with logits_all\n", __func__);
+        return false;
+    }
+    if (!inference_params.path_draft_model.empty() && !init_draft())
+    {
+        return false;
+    }
     is_initialized = true;
     return true;
 }
+// Load the draft model with the settings of this session
+bool LlamaWrapper::init_draft()
+{
+    InferenceParams draft_params = inference_params;
+    draft_params.path_model = inference_params.path_draft_model;
+    draft_params.path_draft_model = "";
+    draft_params.n_lookup = 0;
+    draft_params.n_token_cache = 0;
+    draft_params.n_ctx = n_ctx;
+    draft_params.callback = nullptr;
+    draft_params.ctx_params = llama_context_default_params();
+    draft.reset(new LlamaWrapper(draft_params));
+    if (!draft->init())
+    {
+        draft.reset();
+        return false;
+    }
+    if (draft->get_n_vocab() != get_n_vocab())
+    {
+        fprintf(stderr, "%s: the draft model has a different vocabulary (%d tokens, expected %d)\n",
+                __func__, draft->get_n_vocab(), get_n_vocab());
+        draft.reset();
+        return false;
+    }
+    // Token ids are exchanged between the models, so each id must stand for the same text in both
+    for (llama_token id = 0; id < get_n_vocab(); id++)
+    {
+        if (draft->token_to_str(id) != token_to_str(id))
+        {
+            fprintf(stderr, "%s: the draft model has a different vocabulary (token %d is '%s', expected '%s')\n",
+                    __func__, id, draft->token_to_str(id).c_str(), token_to_str(id).c_str());
+            draft.reset();
+            return false;
+        }
+    }
+    return true;
+}
+
 // Tokenize text
 const vector<llama_token> LlamaWrapper::tokenize_text(const std::string& text, bool add_bos) const
 {
-    // initialize to prompt numer of chars, since n_tokens <= n_prompt_chars
-    std::vector<llama_token> res(text.size() + (int)add_bos);
-    int n = llama_tokenize(ctx, text.c_str(), res.data(), res.size(), add_bos);
-    assert(n >= 0);
-    res.resize(n);
+    vector<llama_token> res;
+    if (token_cache && token_cache->get(text, add_bos, res))
+    {
+        return res;
+    }
+    if (bpe_tokenizer)
+    {
+        // Cut at the first NUL like llama_tokenize(), which takes a C string
+        bpe_tokenizer->tokenize(text.c_str(), strlen(text.c_str()), add_bos, res);
+    }
+    else
+    {
+        // initialize to prompt numer of chars, since n_tokens <= n_prompt_chars
+        res.resize(text.size() + (int)add_bos);
+        int n = llama_tokenize(ctx, text.c_str(), res.data(), res.size(), add_bos);
+        assert(n >= 0);
+        res.resize(n);
+    }
+    if (token_cache)
+    {
+        token_cache->put(text, add_bos, res);
+    }
     return res;
 }
 
+// Counters of the tokenize_text() cache, all zero when it is off
+TokenCacheStats LlamaWrapper::get_token_cache_stats() const
+{
+    return token_cache ? token_cache->stats() : TokenCacheStats();
+}
+
+void LlamaWrapper::clear_token_cache()
+{
+    if (token_cache)
+    {
+        token_cache->clear();
+    }
+}
+
 // Add BOS token to input
 void LlamaWrapper::add_bos() {
     embd_inp.push_back(llama_token_bos());
@@ -66,7 +173,17 @@ void LlamaWrapper::set_input(const std::string& text)
 void LlamaWrapper::set_input(const vector<llama_token>& tokens)
 {
     embd_inp = tokens;
+    embd.clear();
     n_consumed = 0;
+    n_past = 0;
+    n_prompt = -1;
+    last_n_tokens.clear();
+    // The grammar constrains the text generated for this input
+    if (grammar)
+    {
+        grammar->reset();
+    }
+    reuse_cached_prefix();
 }
 
 // Update input with text
@@ -79,6 +196,27 @@ void LlamaWrapper::update_input(const std::string& text)
 void LlamaWrapper::update_input(const vector<llama_token>& tokens)
 {
     embd_inp.insert(embd_inp.end(), tokens.begin(), tokens.end());
+    reuse_cached_prefix();
+}
+
+// Skip over pending input that matches the tokens already in the KV cache
+void LlamaWrapper::reuse_cached_prefix()
+{
+    // Input only lines up with the cache when nothing else is waiting to be evaluated
+    if (!embd.empty())
+    {
+        return;
+    }
+    const int n_reuse_start = n_consumed;
+    // Always leave the last input token to be evaluated so that there are logits to sample from
+    while (n_consumed + 1 < (int) embd_inp.size() &&
+           n_past < (int) past_tokens.size() &&
+           embd_inp[n_consumed] == past_tokens[n_past])
+    {
+        n_consumed++;
+        n_past++;
+    }
+    last_n_tokens.push(embd_inp.data() + n_reuse_start, n_consumed - n_reuse_start);
 }
 
 // Ingest one batch of input
@@ -91,10 +229,8 @@ void LlamaWrapper::ingest_input_batch()
                 std::back_inserter(embd));
     n_consumed += num_copied;
 
-    // Copy the last `repeat_last_n` elements copied into embd to last_n_tokens
-    size_t num_copied_last_n = std::min(num_copied, (size_t) inference_params.repeat_last_n);
-    last_n_tokens.erase(last_n_tokens.begin(), last_n_tokens.begin()+num_copied_last_n);
-    last_n_tokens.insert(last_n_tokens.end(), embd.end() - num_copied_last_n, embd.end());
+    // Push the elements copied into embd to the repeat window
+    last_n_tokens.push(embd.data() + embd.size() - num_copied, num_copied);
 }
 
 // Ingest all input
@@ -103,7 +239,10 @@ bool LlamaWrapper::ingest_all_pending_input()
     while (has_unconsumed_input())
     {
         ingest_input_batch();
-        eval();
+        if (!eval())
+        {
+            return false;
+        }
     }
     return true;
 }
@@ -118,41 +257,570 @@ bool LlamaWrapper::has_unconsumed_input() const
 bool LlamaWrapper::eval()
 {
     if (embd.size() > 0) {
-        if (llama_eval(ctx, embd.data(), embd.size(), n_past, inference_params.n_threads) != 0) {
-            fprintf(stderr, "Failed to predict\n");
+        auto lease = acquire();
+        if (n_past + (int) embd.size() > n_ctx) {
+            if (!inference_params.ctx_shift) {
+                fprintf(stderr, "%s: context is full (n_past = %d, n_ctx = %d)\n", __func__, n_past, n_ctx);
+                return false;
+            }
+            if (!shift_context(embd.size())) {
+                return false;
+            }
+        }
+        if (!eval_tokens(embd.data(), embd.size())) {
             return false;
         }
     }
-    n_past += embd.size();
     embd.clear();
     return true;
 }
 
+// Evaluate tokens and append them to the context
+bool LlamaWrapper::eval_tokens(const llama_token* tokens, int n_tokens)
+{
+    if (llama_eval(ctx, tokens, n_tokens, n_past, inference_params.n_threads) != 0) {
+        fprintf(stderr, "Failed to predict\n");
+        return false;
+    }
+    model->take_logits(&session, n_tokens);
+    session.is_stashed = false;
+    // Anything past n_past in the cache has now been overwritten
+    past_tokens.resize(n_past);
+    past_tokens.insert(past_tokens.end(), tokens, tokens + n_tokens);
+    session.kv_token_count = past_tokens.size();
+    n_past += n_tokens;
+    return true;
+}
+
+// Drop the oldest half of the context after the first n_keep tokens and re-evaluate the rest
+bool LlamaWrapper::shift_context(int n_tokens)
+{
+    // Batch size used to re-evaluate the part of the context that is kept
+    const int n_shift_batch = 512;
+
+    int n_keep = inference_params.n_keep < 0 ? std::max(n_prompt, 0) : inference_params.n_keep;
+    n_keep = std::min(n_keep, n_past);
+    const int n_left = n_past - n_keep;
+    const int n_discard = n_left / 2;
+    if (n_past - n_discard + n_tokens > n_ctx) {
+        fprintf(stderr, "%s: cannot fit %d tokens in the context (n_keep = %d, n_ctx = %d)\n",
+                __func__, n_tokens, n_keep, n_ctx);
+        return false;
+    }
+
+    // The KV entries depend on their position, so the kept tail has to be evaluated again
+    const vector<llama_token> tail(past_tokens.begin() + n_keep + n_discard, past_tokens.begin() + n_past);
+    n_past = n_keep;
+    for (size_t i = 0; i < tail.size(); i += n_shift_batch) {
+        const int n_eval = std::min((int) (tail.size() - i), n_shift_batch);
+        if (!eval_tokens(tail.data() + i, n_eval)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Sample from logits
 llama_token LlamaWrapper::sample()
 {
-    llama_token id = 0;
+    auto lease = acquire();
+    const float* logits = apply_grammar(last_logits());
+    const llama_token id = sampler.sample(logits, llama_n_vocab(ctx), last_n_tokens.data(), last_n_tokens.size(), rng);
+    accept_grammar(id);
+    push_sampled(id);
+    return id;
+}
+
+// Take the most likely token
+llama_token LlamaWrapper::sample_greedy()
+{
+    auto lease = acquire();
+    const float* logits = apply_grammar(last_logits());
+    const llama_token id = sampler.sample_greedy(logits, llama_n_vocab(ctx), last_n_tokens.data(), last_n_tokens.size());
+    accept_grammar(id);
+    push_sampled(id);
+    return id;
+}
+
+// Add a sampled token to the model input
+void LlamaWrapper::push_sampled(llama_token id)
+{
+    if (n_prompt < 0) {
+        n_prompt = n_past;
+    }
+    last_n_tokens.push(id);
+    embd.push_back(id);
+}
+
+// Set the bias of some tokens. Locked so a generation running on another thread sees the whole update.
+void LlamaWrapper::set_logit_bias(const vector<std::pair<llama_token, float>>& biases)
+{
+    auto lease = acquire();
+    for (const auto& bias : biases) {
+        sampler.get_logit_bias().set_bias(bias.first, bias.second);
+    }
+}
+
+void LlamaWrapper::clear_logit_bias()
+{
+    auto lease = acquire();
+    sampler.get_logit_bias().clear_bias();
+}
+
+// Ban tokens from being sampled
+void LlamaWrapper::ban_tokens(const vector<llama_token>& tokens)
+{
+    auto lease = acquire();
+    for (const llama_token id : tokens) {
+        sampler.get_logit_bias().ban(id);
+    }
+}
+
+void LlamaWrapper::unban_tokens(const vector<llama_token>& tokens)
+{
+    auto lease = acquire();
+    for (const llama_token id : tokens) {
+        sampler.get_logit_bias().unban(id);
+    }
+}
+
+void LlamaWrapper::clear_bans()
+{
+    auto lease = acquire();
+    sampler.get_logit_bias().clear_bans();
+}
+
+// Change the sampler settings, for the draft model as well so its proposals stay close
+void LlamaWrapper::set_sampling_params(const SamplingParams& params)
+{
+    sampler.set_params(params);
+    if (draft) {
+        draft->set_sampling_params(params);
+    }
+}
+
+// Start constraining samples to a grammar
+void LlamaWrapper::set_grammar(std::shared_ptr<const Grammar> new_grammar)
+{
+    // The trie is built outside the lease, it only needs vocabulary queries
+    if (new_grammar && !vocab_trie) {
+        vocab_trie = model->get_vocab_trie();
+    }
+    auto lease = acquire();
+    if (new_grammar) {
+        grammar.reset(new GrammarState(new_grammar));
+    } else {
+        grammar.reset();
+    }
+}
+
+// Mask out the tokens the grammar does not allow. The sampler chain then only sees valid tokens.
+const float* LlamaWrapper::apply_grammar(const float* logits)
+{
+    if (!grammar) {
+        return logits;
+    }
+    grammar->allowed_tokens(*vocab_trie, grammar_allowed);
+    masked_logits.assign(llama_n_vocab(ctx), -INFINITY);
+    if (grammar_allowed.empty()) {
+        // No token continues the grammar, so end the generation
+        fprintf(stderr, "%s: no token matches the grammar, stopping\n", __func__);
+        masked_logits[llama_token_eos()] = 0.0f;
+    }
+    for (const llama_token id : grammar_allowed) {
+        masked_logits[id] = logits[id];
+    }
+    return masked_logits.data();
+}
+
+// Move the grammar past a sampled token
+void LlamaWrapper::accept_grammar(llama_token id)
+{
+    if (grammar && id != llama_token_eos() && !grammar->accept(vocab_trie->piece(id))) {
+        // Only happens when every allowed token was banned and the sampler fell back to another one
+        fprintf(stderr, "%s: sampled token %d does not match the grammar\n", __func__, id);
+    }
+}
 
+// Sample and evaluate tokens until EOS, n_predict or on_token says stop
+vector<llama_token> LlamaWrapper::generate(int n_predict, const std::function<bool(llama_token)>& on_token)
+{
+    vector<llama_token> output;
+    if (n_predict < 0)
+    {
+        n_predict = inference_params.n_predict;
+    }
+    // A token sampled by a previous call may still be waiting to be evaluated
+    if (!ingest_all_pending_input() || !eval())
+    {
+        return output;
+    }
+    vector<llama_token> step;
+    while ((int) output.size() < n_predict)
     {
-        id = llama_sample_top_p_top_k(
-                ctx,
-                last_n_tokens.data() + n_ctx - inference_params.repeat_last_n,
-                inference_params.repeat_last_n,
-                inference_params.top_k,
-                inference_params.top_p,
-                inference_params.temp,
-                inference_params.repeat_penalty
-        );
+        step.clear();
+        // The grammar has to see every token before the next one is chosen, so it rules out drafting
+        if ((draft || inference_params.n_lookup > 0) && !grammar)
+        {
+            if (!sample_speculative(n_predict - output.size(), step))
+            {
+                break;
+            }
+        }
+        else
+        {
+            step.push_back(sample());
+        }
+        bool is_stopped = false;
+        size_t i = 0;
+        for (; i < step.size(); i++)
+        {
+            // EOS can only be the last token of a step
+            if (step[i] == llama_token_eos())
+            {
+                is_stopped = true;
+                break;
+            }
+            output.push_back(step[i]);
+            if (on_token && !on_token(step[i]))
+            {
+                is_stopped = true;
+                break;
+            }
+        }
+        if (is_stopped)
+        {
+            if (i + 1 < step.size())
+            {
+                drop_sampled(step.size() - i - 1);
+            }
+            break;
+        }
+        // The last token is left pending so the next call picks up where this one stopped
+        if ((int) output.size() < n_predict && !eval())
+        {
+            break;
+        }
+    }
+    return output;
+}
 
-        last_n_tokens.erase(last_n_tokens.begin());
-        last_n_tokens.push_back(id);
-        embd.push_back(id);
+// Fork the state after the prompt for every completion. The vendored llama.h has one KV cache per
+// context, so the completions run one after the other, each with all of n_threads, and cost a cache
+// copy instead of a prompt evaluation.
+bool LlamaWrapper::generate_n(const vector<llama_token>& prompt, int n, int n_predict, vector<vector<llama_token>>& out,
+                              const std::function<bool(int, llama_token)>& on_token)
+{
+    out.assign(std::max(n, 0), vector<llama_token>());
+    set_input(prompt);
+    if (!ingest_all_pending_input() || !eval())
+    {
+        return false;
     }
-    return id;
+
+    vector<uint8_t> fork_kv;
+    int fork_kv_token_count = 0;
+    vector<float> fork_logits;
+    {
+        auto lease = acquire();
+        fork_kv_token_count = session.kv_token_count;
+        model->get_kv_layout().save(ctx, fork_kv_token_count, fork_kv);
+        const float* logits = last_logits();
+        fork_logits.assign(logits, logits + llama_n_vocab(ctx));
+    }
+    const vector<llama_token> fork_past_tokens(past_tokens.begin(), past_tokens.begin() + n_past);
+    const RepeatWindow fork_last_n_tokens = last_n_tokens;
+    const Sampler fork_sampler = sampler;
+    const std::unique_ptr<GrammarState> fork_grammar(grammar ? new GrammarState(*grammar) : nullptr);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (i > 0)
+        {
+            auto lease = acquire();
+            model->get_kv_layout().load(ctx, fork_kv_token_count, fork_kv);
+            session.kv_token_count = fork_kv_token_count;
+            // Within the room reserved for the logits, so the buffer does not move
+            session.logits.assign(fork_logits.begin(), fork_logits.end());
+            session.n_logit_rows = 1;
+            session.is_stashed = false;
+            past_tokens = fork_past_tokens;
+            n_past = past_tokens.size();
+            n_prompt = -1;
+            embd.clear();
+            last_n_tokens = fork_last_n_tokens;
+            sampler = fork_sampler;
+            grammar.reset(fork_grammar ? new GrammarState(*fork_grammar) : nullptr);
+        }
+        std::function<bool(llama_token)> on_completion_token = nullptr;
+        if (on_token)
+        {
+            on_completion_token = [&](llama_token id) { return on_token(i, id); };
+        }
+        out[i] = generate(n_predict, on_completion_token);
+    }
+    return true;
+}
+
+// One speculative step with tokens proposed by prompt lookup or by the draft model
+bool LlamaWrapper::sample_speculative(int n_max, vector<llama_token>& out)
+{
+    // Leave room for the drafted tokens and the one sampled after them
+    const int n_room = std::min(n_max - 1, n_ctx - n_past - 1);
+    draft_tokens.clear();
+    draft_probs.clear();
+    if (inference_params.n_lookup > 0)
+    {
+        draft_by_lookup(std::min(inference_params.n_lookup, n_room));
+    }
+    if (draft_tokens.empty() && draft && !draft_by_model(std::min(inference_params.n_draft, n_room)))
+    {
+        return false;
+    }
+    if (draft_tokens.empty())
+    {
+        out.push_back(sample());
+        return true;
+    }
+    return verify_draft(out);
 }
 
-// Get the logits for the last token
-const float* LlamaWrapper::get_logits() const
+// Propose the tokens that followed the latest earlier occurrence of the longest n-gram ending the context.
+// Pays off when the output copies spans of the prompt, as in summaries and code edits.
+void LlamaWrapper::draft_by_lookup(int n_draft_max)
 {
-    return llama_get_logits(ctx);
+    if (n_draft_max < 1)
+    {
+        return;
+    }
+    const llama_token* tokens = past_tokens.data();
+    for (int n_gram = std::min(inference_params.lookup_ngram, n_past - 1); n_gram >= 1; n_gram--)
+    {
+        const llama_token* suffix = tokens + n_past - n_gram;
+        for (int start = n_past - n_gram - 1; start >= 0; start--)
+        {
+            if (std::equal(suffix, suffix + n_gram, tokens + start))
+            {
+                const int from = start + n_gram;
+                draft_tokens.assign(tokens + from, tokens + std::min(from + n_draft_max, n_past));
+                return;
+            }
+        }
+    }
+}
+
+// Let the draft model sample n_draft_max tokens, recording the distribution of each
+bool LlamaWrapper::draft_by_model(int n_draft_max)
+{
+    if (n_draft_max < 1)
+    {
+        return true;
+    }
+    const int n_vocab = llama_n_vocab(ctx);
+    // The draft catches up on the context, reusing whatever prefix is still in its cache
+    draft->set_input(vector<llama_token>(past_tokens.begin(), past_tokens.begin() + n_past));
+    if (!draft->ingest_all_pending_input())
+    {
+        return false;
+    }
+    draft_probs.assign((size_t) n_draft_max * n_vocab, 0.0f);
+    for (int i = 0; i < n_draft_max; i++)
+    {
+        {
+            auto draft_lease = draft->acquire();
+            Sampler& draft_sampler = draft->sampler;
+            const size_t n_cand = draft_sampler.distribution(draft->last_logits(), n_vocab,
+                                                             draft->last_n_tokens.data(), draft->last_n_tokens.size());
+            float* q = draft_probs.data() + (size_t) i * n_vocab;
+            for (size_t c = 0; c < n_cand; c++)
+            {
+                q[draft_sampler.token(c)] = draft_sampler.prob(c);
+            }
+            draft_tokens.push_back(draft_sampler.draw(draft->rng));
+            draft->push_sampled(draft_tokens.back());
+        }
+        if (draft_tokens.back() == llama_token_eos() || i + 1 == n_draft_max)
+        {
+            break;
+        }
+        if (!draft->eval())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Verify the draft tokens and accept or resample, following "Accelerating Large Language Model
+// Decoding with Speculative Sampling" (Chen et al.): draft token d is kept with probability
+// min(1, p(d) / q(d)), and the first rejected one is replaced by a draw from max(0, p - q), so the
+// output has the distribution p of this model whatever the draft proposes. Prompt lookup drafts
+// are deterministic, so q is one-hot for them.
+bool LlamaWrapper::verify_draft(vector<llama_token>& out)
+{
+    const int n_vocab = llama_n_vocab(ctx);
+    const int n_drafted = draft_tokens.size();
+    // Probability of `id` under the distribution draft token i was drawn from
+    auto draft_prob = [&](int i, llama_token id) {
+        if (draft_probs.empty())
+        {
+            return id == draft_tokens[i] ? 1.0f : 0.0f;
+        }
+        return draft_probs[(size_t) i * n_vocab + id];
+    };
+
+    auto lease = acquire();
+    const int n_past_start = n_past;
+    int n_accepted = 0;
+    speculative_stats.n_drafted += n_drafted;
+    llama_token next = llama_token_eos();
+    for (int i = 0; i <= n_drafted; i++)
+    {
+        // Once the first draft token is in, check the rest in one batch. Row j of the logits
+        // then holds the distribution after draft token j.
+        if (i == 1 && !eval_tokens(draft_tokens.data(), n_drafted))
+        {
+            return false;
+        }
+        const float* logits = i == 0 ? last_logits() : llama_get_logits(ctx) + (size_t) (i - 1) * n_vocab;
+        const size_t n_cand = sampler.distribution(logits, n_vocab, last_n_tokens.data(), last_n_tokens.size());
+        if (i == n_drafted)
+        {
+            // Every draft token was accepted, so this model adds one more
+            next = sampler.draw(rng);
+            break;
+        }
+
+        const llama_token id = draft_tokens[i];
+        const float q = draft_prob(i, id);
+        float p = 0.0f;
+        for (size_t c = 0; c < n_cand; c++)
+        {
+            if (sampler.token(c) == id)
+            {
+                p = sampler.prob(c);
+                break;
+            }
+        }
+        if (p >= q || std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) * q < p)
+        {
+            sampler.accept(id);
+            speculative_stats.n_accepted++;
+            if (id == llama_token_eos())
+            {
+                next = id;
+                break;
+            }
+            if (n_prompt < 0)
+            {
+                n_prompt = n_past_start;
+            }
+            last_n_tokens.push(id);
+            out.push_back(id);
+            n_accepted++;
+            continue;
+        }
+
+        // Rejected: draw from the part of this model's distribution the draft under-covers
+        speculative_stats.n_rejected++;
+        residual_probs.resize(n_cand);
+        float sum = 0.0f;
+        for (size_t c = 0; c < n_cand; c++)
+        {
+            residual_probs[c] = std::max(0.0f, sampler.prob(c) - draft_prob(i, sampler.token(c)));
+            sum += residual_probs[c];
+        }
+        if (sum <= 0.0f)
+        {
+            // p and q only differ by rounding
+            next = sampler.draw(rng);
+            break;
+        }
+        const float r = std::uniform_real_distribution<float>(0.0f, sum)(rng);
+        float cum = 0.0f;
+        size_t pick = 0;
+        for (size_t c = 0; c < n_cand; c++)
+        {
+            if (residual_probs[c] > 0.0f)
+            {
+                pick = c;
+                cum += residual_probs[c];
+                if (r < cum)
+                {
+                    break;
+                }
+            }
+        }
+        next = sampler.token(pick);
+        sampler.accept(next);
+        break;
+    }
+    // Drafted tokens after the accepted ones stay in the cache past n_past and get overwritten
+    n_past = n_past_start + n_accepted;
+    push_sampled(next);
+    out.push_back(next);
+    return true;
+}
+
+// Rewind the context to an earlier token of a speculative step. That token was already evaluated,
+// but is put back as pending input to get its logits again.
+void LlamaWrapper::drop_sampled(int n_drop)
+{
+    auto lease = acquire();
+    embd.clear();
+    n_past -= n_drop;
+    embd.push_back(past_tokens[n_past]);
+    last_n_tokens.clear();
+    last_n_tokens.push(past_tokens.data(), n_past);
+    last_n_tokens.push(embd.data(), embd.size());
+}
+
+// Last row of the logits of the last eval
+const float* LlamaWrapper::last_logits() const
+{
+    return session.logits.data() + (size_t) std::max(session.n_logit_rows - 1, 0) * llama_n_vocab(ctx);
+}
+
+// Get the embeddings for the last token
+void LlamaWrapper::get_embeddings(vector<float>& out) const
+{
+    auto lease = acquire();
+    const float* embeddings = session.is_stashed ? session.embeddings.data() : llama_get_embeddings(ctx);
+    out.assign(embeddings, embeddings + llama_n_embd(ctx));
+}
+
+// Embed a batch of texts
+bool LlamaWrapper::embed_batch(const vector<std::string>& texts, EmbeddingPooling pooling, bool add_bos, float* out)
+{
+    // Batch size used to evaluate each text for last-token pooling
+    const int n_embed_batch = 512;
+
+    if (!inference_params.ctx_params.embedding)
+    {
+        fprintf(stderr, "%s: the context was not created with embedding enabled\n", __func__);
+        return false;
+    }
+    auto lease = acquire();
+    // Every text starts from an empty context
+    clear_input();
+    embd.clear();
+    past_tokens.clear();
+    n_past = 0;
+    n_prompt = -1;
+    session.n_logit_rows = 1;
+    session.is_stashed = false;
+    // Nothing the embeddings leave in the cache is used again
+    session.kv_token_count = 0;
+
+    const int n_out = embedding_size(pooling, get_n_embd());
+    for (size_t i = 0; i < texts.size(); i++)
+    {
+        const vector<llama_token> tokens = tokenize_text(texts[i], add_bos);
+        if (!embed_tokens(ctx, tokens, pooling, inference_params.n_threads, n_embed_batch, out + i * n_out))
+        {
+            fprintf(stderr, "%s: failed to embed text %zu\n", __func__, i);
+            return false;
+        }
+    }
+    return true;
 }
@@ -2,6 +2,14 @@
 #define LLAMA_WRAPPER_H
 
 #include "llama.h"
+#include "llama_embed.h"
+#include "llama_grammar.h"
+#include "llama_model.h"
+#include "llama_tokenize.h"
+#include "token_cache.h"
+#include "llama_sampler.h"
+#include "repeat_window.h"
+#include <memory>
 #include <vector>
 #include <random>
 #include <thread>
@@ -25,32 +33,89 @@ struct InferenceParams {
     float   top_p = 0.95f;
     float   temp  = 0.80f;
     float   repeat_penalty  = 1.10f;
+    float   frequency_penalty = 0.0f;
+    float   presence_penalty  = 0.0f;
+    float   min_p     = 0.0f;
+    float   typical_p = 1.0f;
+    int32_t mirostat  = 0;     // 0 = disabled, 1 = mirostat, 2 = mirostat 2.0
+    float   mirostat_tau = 5.0f;
+    float   mirostat_eta = 0.1f;
 
     bool use_mlock = false;
     bool memory_f16 = false;
 
     int n_ctx = 512;  // context size
+    int32_t n_token_cache = 0; // texts whose tokens tokenize_text() keeps for reuse (LRU), 0 = off
+
+    // speculative decoding
+    std::string path_draft_model = ""; // smaller model with the same vocabulary that proposes tokens for generate()
+    int32_t n_draft = 4;               // tokens proposed by the draft model per step
+    int32_t n_lookup = 0;              // tokens proposed per step by matching the context against itself, 0 = off
+    int32_t lookup_ngram = 3;          // longest n-gram at the end of the context that prompt lookup matches
+
+    // context shifting
+    bool    ctx_shift = false; // when the context is full, drop old tokens instead of failing
+    int32_t n_keep    = 0;     // tokens to keep from the start of the context (-1 = the whole prompt)
 
     llama_context_params ctx_params = llama_context_default_params();
 
     Callback callback{};
 };
 
+// Sampler settings of a set of inference parameters
+inline SamplingParams get_sampling_params(const InferenceParams& params)
+{
+    SamplingParams res;
+    res.top_k = params.top_k;
+    res.top_p = params.top_p;
+    res.min_p = params.min_p;
+    res.typical_p = params.typical_p;
+    res.temp = params.temp;
+    res.repeat_penalty = params.repeat_penalty;
+    res.frequency_penalty = params.frequency_penalty;
+    res.presence_penalty = params.presence_penalty;
+    res.mirostat = params.mirostat;
+    res.mirostat_tau = params.mirostat_tau;
+    res.mirostat_eta = params.mirostat_eta;
+    return res;
+}
+
+// Counters of the speculative steps of a LlamaWrapper since it was created
+struct SpeculativeStats {
+    uint64_t n_drafted = 0;   // tokens proposed by the draft model or prompt lookup
+    uint64_t n_accepted = 0;  // proposed tokens kept by the main model
+    uint64_t n_rejected = 0;  // proposed tokens replaced by a token sampled from the main model
+};
+
+// Output of LlamaWrapper::beam_search()
+struct BeamSearchResult {
+    vector<llama_token> tokens{};
+    // Sum of the token log-probabilities divided by length^length_penalty
+    float score = 0.0f;
+};
+
 class LlamaWrapper {
     public:
         // LLAMA API
         LlamaWrapper() = default;
         LlamaWrapper(InferenceParams inference_params) 
-            : is_initialized(false), inference_params(inference_params)
+            : inference_params(inference_params), is_initialized(false)
+        {}
+        // Session on a model that is shared with other wrappers. The context parameters
+        // in inference_params are ignored in favour of the ones the model was loaded with.
+        LlamaWrapper(std::shared_ptr<LlamaModel> model, InferenceParams inference_params)
+            : model(model), inference_params(inference_params), is_initialized(false)
         {}
         ~LlamaWrapper() {
-            if (ctx)
+            if (model)
             {
-                llama_free(ctx);
+                model->release(&session);
             }
         };
+        LlamaWrapper(const LlamaWrapper&) = delete;
+        LlamaWrapper& operator=(const LlamaWrapper&) = delete;
 
-        // Initialize the model
+        // Initialize the model, loading it from inference_params.path_model unless it is shared
         bool init();
         // Check if the model is initialized
         bool is_init() const { return is_initialized; }
@@ -58,11 +123,23 @@ class LlamaWrapper {
         // Input processing and inference
         // Tokenize text
         const vector<llama_token> tokenize_text(const std::string& text, bool add_bos = false) const;
+        // Hits and misses of the tokenize_text() cache enabled by InferenceParams::n_token_cache
+        TokenCacheStats get_token_cache_stats() const;
+        void clear_token_cache();
+        // How many drafted tokens generate() kept or replaced
+        SpeculativeStats get_speculative_stats() const { return speculative_stats; }
+        // Tokenize many texts in parallel into one flat array, see tokenize_batch() in llama_tokenize.h
+        void tokenize_batch(const vector<std::string>& texts, bool add_bos, int n_threads, vector<llama_token>& tokens,
+                            vector<int64_t>& offsets) const
+        {
+            ::tokenize_batch(ctx, bpe_tokenizer.get(), texts, add_bos, n_threads, tokens, offsets);
+        }
         // Queues up a BOS token to the model input
         void add_bos();
         // Clears the model input buffer
         void clear_input();
-        // Set the model input buffer
+        // Set the model input buffer. The input replaces the whole context, but any prefix
+        // that is already in the KV cache is reused instead of being evaluated again.
         void set_input(const std::string& text);
         // Set the model input buffer from tokens
         void set_input(const vector<llama_token>& tokens);
@@ -82,21 +159,69 @@ class LlamaWrapper {
         bool eval();
         // Sample token from the model and add it to the model input
         llama_token sample();
+        // Take the most likely token after the repeat penalties and add it to the model input.
+        // sample() does the same when the sampling parameters are greedy (temp <= 0 or top_k == 1).
+        llama_token sample_greedy();
+        // Change the sampler settings for the following tokens
+        void set_sampling_params(const SamplingParams& params);
+        // Logit biases and banned tokens, applied on every following sample until cleared
+        void set_logit_bias(const vector<std::pair<llama_token, float>>& biases);
+        void clear_logit_bias();
+        void ban_tokens(const vector<llama_token>& tokens);
+        void unban_tokens(const vector<llama_token>& tokens);
+        void clear_bans();
+        // Constrain the following samples to a grammar, starting from its root. nullptr removes the constraint.
+        // Each sampled token advances the grammar; EOS becomes the only choice once nothing else fits.
+        // set_input() starts the grammar over.
+        void set_grammar(std::shared_ptr<const Grammar> grammar);
+        // Run the whole decode loop: ingest pending input, then sample and evaluate up to n_predict
+        // tokens (InferenceParams::n_predict if negative). Stops at EOS or when on_token returns false.
+        // With a draft model or prompt lookup the tokens come from speculative steps, with the same output distribution.
+        vector<llama_token> generate(int n_predict, const std::function<bool(llama_token)>& on_token = nullptr);
+
+        // Replace the input with `prompt` and generate n completions of it, each as generate() would. The prompt is
+        // evaluated once and every completion starts from a copy of its KV cache, logits and sampler state.
+        // on_token gets the completion index and the token; returning false ends that completion.
+        bool generate_n(const vector<llama_token>& prompt, int n, int n_predict, vector<vector<llama_token>>& out,
+                        const std::function<bool(int, llama_token)>& on_token = nullptr);
+        // Replace the input with `prompt` and find the most likely continuation of up to n_predict tokens
+        // (InferenceParams::n_predict if negative) by beam search over n_beams beams. Beams are ranked by their
+        // log-probability divided by length^length_penalty. Logit biases, bans and the grammar apply;
+        // the other sampling settings do not. Afterwards the session continues from the best beam.
+        bool beam_search(const vector<llama_token>& prompt, int n_beams, int n_predict, float length_penalty,
+                         BeamSearchResult& result);
 
         // Output processing
-        // Get logits
-        const float* get_logits() const;
+        // Logits of the last eval, get_n_logit_rows() * n_vocab. The buffer stays at the same address for the
+        // life of the wrapper, even when other sessions use the model, and is overwritten by the next eval.
+        // Changing it changes the next sample().
+        float* get_logits() { return session.logits.data(); }
+        // Number of rows returned by get_logits(): the tokens of the last eval with logits_all, 1 otherwise
+        int get_n_logit_rows() const { return session.n_logit_rows; }
 
-        // Get embeddings
-        const float* get_embeddings() const {
-            return llama_get_embeddings(ctx);
-        }
+        // Copy the embeddings of the last token to `out`. Length: n_embd
+        void get_embeddings(vector<float>& out) const;
+        // Embed each text on its own and write one row of embedding_size(pooling, n_embd) floats per
+        // text to out. Requires ctx_params.embedding. Clears the input and the context.
+        bool embed_batch(const vector<std::string>& texts, EmbeddingPooling pooling, bool add_bos, float* out);
 
         int get_n_vocab() const { return llama_n_vocab(ctx); }
+        // Number of tokens currently in the KV cache
+        int get_n_past() const { return n_past; }
         int get_n_embd() const { return llama_n_embd(ctx); }
 
         // Convert token to str
         std::string token_to_str(llama_token token) const { return llama_token_to_str(ctx, token); }
+        // Model the session runs on, possibly shared with other sessions
+        std::shared_ptr<LlamaModel> get_model() const { return model; }
+        // Strings of the whole vocabulary, shared with the other sessions on the model
+        std::shared_ptr<const PieceTable> get_piece_table() const { return model->get_piece_table(); }
+
+        // Session snapshots
+        // Save the KV cache, input buffers, repeat window and RNG state to a file
+        bool save_session(const std::string& path) const;
+        // Restore a session previously written by save_session() with the same model and n_ctx
+        bool load_session(const std::string& path);
 
         // Print timings
         void print_timings() const { llama_print_timings(ctx); }
@@ -104,22 +229,80 @@ class LlamaWrapper {
         void reset_timings() const { llama_reset_timings(ctx); }
 
     private:
+        // Skip pending input that is already in the KV cache at the same position
+        void reuse_cached_prefix();
+        // Evaluate tokens at position n_past and append them to the context
+        bool eval_tokens(const llama_token* tokens, int n_tokens);
+        // Make room for `n_tokens` more tokens by dropping the oldest half of the context after n_keep
+        bool shift_context(int n_tokens);
+        // Lock the (possibly shared) context and make this wrapper's session the active one
+        LlamaModel::Lease acquire() const { return model->acquire(&session); }
+        // Record a sampled token in the repeat window and queue it for evaluation
+        void push_sampled(llama_token id);
+        // Logits of the last evaluated token. Requires a lease.
+        const float* last_logits() const;
+        // `logits` with the tokens the grammar rejects set to -inf, or `logits` itself without a grammar
+        const float* apply_grammar(const float* logits);
+        // Advance the grammar over a sampled token
+        void accept_grammar(llama_token id);
+        // Speculative decoding is set up with a draft model or prompt lookup
+        bool is_speculative() const { return !inference_params.path_draft_model.empty() || inference_params.n_lookup > 0; }
+        // Load the draft model for speculative decoding
+        bool init_draft();
+        // One speculative step: prompt lookup or the draft model proposes up to n_max - 1 tokens and this model
+        // checks them in a single eval. Appends the accepted tokens and one token sampled by this model to `out`,
+        // the last of which is left pending as after sample(). Needs the logits of the last token and no pending input.
+        bool sample_speculative(int n_max, vector<llama_token>& out);
+        // Fill draft_tokens from an earlier occurrence of the end of the context
+        void draft_by_lookup(int n_draft_max);
+        // Fill draft_tokens and draft_probs by sampling the draft model
+        bool draft_by_model(int n_draft_max);
+        // Check draft_tokens with one eval and sample the step's tokens
+        bool verify_draft(vector<llama_token>& out);
+        // Take back the last `n_drop` tokens of a speculative step, leaving the one before them pending
+        void drop_sampled(int n_drop);
+
         std::string path_model = "";
+        std::shared_ptr<LlamaModel> model{};
+        // Faster equivalent of llama_tokenize(), null if it could not be read from the model file
+        std::shared_ptr<const BpeTokenizer> bpe_tokenizer{};
+        std::unique_ptr<TokenCache> token_cache{};
+        // Owned by the model. Only vocabulary and hyperparameter queries are safe without acquire().
         llama_context* ctx = nullptr;
+        mutable LlamaSessionState session{};
         InferenceParams inference_params{};
 
         // Random number generator
         std::mt19937 rng{};
+        Sampler sampler{};
+        std::unique_ptr<GrammarState> grammar{};
+        std::shared_ptr<const VocabTrie> vocab_trie{};
+        vector<llama_token> grammar_allowed{};
+        vector<float> masked_logits{};
+
+        // Speculative decoding
+        std::unique_ptr<LlamaWrapper> draft{};
+        vector<llama_token> draft_tokens{};
+        // Draft distribution each draft token was drawn from, one row of n_vocab per token.
+        // Empty for prompt lookup, whose drafts are deterministic.
+        vector<float> draft_probs{};
+        vector<float> residual_probs{};
+        SpeculativeStats speculative_stats{};
 
         // Tokens
         vector<llama_token> embd{};
         vector<llama_token> embd_inp{};
-        vector<llama_token> last_n_tokens{};
+        RepeatWindow last_n_tokens{};
+        // Tokens backing the KV cache. The first n_past entries make up the current
+        // context, anything after that is left over from a previous input.
+        vector<llama_token> past_tokens{};
 
         int n_consumed = 0;
         int remaining_tokens = 0;
         int n_past = 0;
         int n_ctx = 0;
+        // Number of tokens evaluated before the first sampled token, -1 until then
+        int n_prompt = -1;
         size_t mem_per_token = 0;
 
         bool is_initialized = false;
@@ -1,4 +1,6 @@
 import llamacpp
 
 # Expose the bindings in module
-from .llamacpp import InferenceParams, LlamaInference, LlamaContext, LlamaContextParams
+from .llamacpp import InferenceParams, LlamaInference, LlamaContext, LlamaContextParams, LlamaModel, GenerationScheduler, AsyncGeneration, \
+    Grammar, Tokenizer, StreamingDetokenizer, TokenCacheStats, SpeculativeStats, PromptTemplate
+from .streaming import AsyncTokenStream, stream_async
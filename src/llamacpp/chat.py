@@ -80,6 +80,12 @@ def parse_chat_params(argv) -> Dict[str, str]:
         default=4096,
         help="size of the prompt context (default: 4096)",
     )
+    parser.add_argument(
+        "--keep",
+        type=int,
+        default=-1,
+        help="number of tokens to keep from the initial prompt when the context is full (default: -1 = all)",
+    )
     parser.add_argument("--temp", type=float, default=0.8, help="temperature (default: 0.7)")
     parser.add_argument(
         "-b",
@@ -68,6 +68,12 @@ def parse_args_into_params(argv) -> Dict[str, str]:
         default=512,
         help="size of the prompt context (default: 512)",
     )
+    parser.add_argument(
+        "--keep",
+        type=int,
+        default=0,
+        help="number of tokens to keep from the initial prompt when the context is full (default: 0, -1 = all)",
+    )
     parser.add_argument("--temp", type=float, default=0.8, help="temperature (default: 0.7)")
     parser.add_argument(
         "-b",
@@ -87,19 +93,20 @@ def parse_args_into_params(argv) -> Dict[str, str]:
     return args
 
 
-def process_interactive_input(model: llamacpp.LlamaInference):
+def process_interactive_input() -> str:
     """Process interactive input similar to the C++ version"""
 
     # Read lines as long as user is entering "\" at the end of the line
-    # Pass each line to the model
+    # The lines are returned as one text so that it is tokenized in one piece
+    lines = []
     while True:
         line = input()
         if line.endswith("\\"):
-            line = line[:-1]
-            model.update_input(line)
+            lines.append(line[:-1])
         else:
-            model.update_input(line)
+            lines.append(line)
             break
+    return "".join(lines)
 
 
 def main(args):
@@ -122,14 +129,17 @@ def main(args):
     params.use_mlock = args.mlock
     params.memory_f16 = args.memory_f16
     params.n_ctx = args.ctx_size
+    params.ctx_shift = True
+    params.n_keep = args.keep
 
     model = llamacpp.LlamaInference(params)
     model.update_input([model.token_bos()])
     model.update_input(args.prompt)
     print(model.system_info())
 
-    inp_pfx = model.tokenize("\n\n### Instruction:\n\n", True)
-    inp_sfx = model.tokenize("\n\n### Response:\n\n", False)
+    # The instruction scaffolding is tokenized once, the user input is tokenized together
+    # with the text around it so that tokens spanning the seams come out as in one text
+    instruction = llamacpp.PromptTemplate(model, "\n\n### Instruction:\n\n{input}\n\n### Response:\n\n")
 
     if args.instruct:
         args.interactive = True
@@ -174,13 +184,15 @@ def main(args):
                 is_interacting = True
             if is_interacting:
                 if args.instruct:
-                    model.update_input_tokens(inp_pfx)
                     print("\n> ", end="")
 
-                process_interactive_input(model)
+                text = process_interactive_input()
 
                 if args.instruct:
-                    model.update_input_tokens(inp_sfx)
+                    model.update_input([model.token_bos()])
+                    model.update_input(instruction, {"input": text})
+                else:
+                    model.update_input(text)
 
                 input_noecho = True
                 is_interacting = False
@@ -0,0 +1,51 @@
+"""asyncio support for streaming generation"""
+import asyncio
+from collections import deque
+from typing import List, Optional
+
+import llamacpp
+
+
+class AsyncTokenStream:
+    """Async iterator over the text produced by LlamaInference.generate_async()
+
+    The generation runs on its own C++ thread. Pieces are taken from its queue without
+    blocking the event loop; waiting for new pieces happens in the default executor.
+    Cancelling the consuming task also stops the generation.
+    """
+
+    def __init__(self, generation: "llamacpp.AsyncGeneration", wait_timeout: float = 0.1):
+        self._generation = generation
+        self._wait_timeout = wait_timeout
+        self._pieces = deque()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self) -> str:
+        loop = asyncio.get_running_loop()
+        try:
+            while not self._pieces:
+                self._pieces.extend(text for _, text in self._generation.poll())
+                if self._pieces:
+                    break
+                if self._generation.done:
+                    raise StopAsyncIteration
+                await loop.run_in_executor(None, self._generation.wait, self._wait_timeout)
+        except asyncio.CancelledError:
+            self._generation.cancel()
+            raise
+        return self._pieces.popleft()
+
+    def cancel(self):
+        """Stop the generation at the next token boundary"""
+        self._generation.cancel()
+
+
+def stream_async(model: "llamacpp.LlamaInference", n_predict: int = -1, max_queued: int = 64,
+                 stop: Optional[List[str]] = None) -> AsyncTokenStream:
+    """Start generating on a background thread and return an async iterator over the text
+
+    Generation ends before the first of the stop strings, which is not part of the text.
+    """
+    return AsyncTokenStream(model.generate_async(n_predict, max_queued, stop or []))
@@ -0,0 +1,145 @@
+#include "prompt_template.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace {
+
+// Split `text` into static segments and placeholder names, unescaping `{{` and `}}`
+bool parse(const std::string& text, std::vector<std::string>& literals, std::vector<std::string>& names,
+           std::string* error)
+{
+    literals.assign(1, "");
+    for (size_t i = 0; i < text.size(); i++) {
+        const char c = text[i];
+        if ((c == '{' || c == '}') && i + 1 < text.size() && text[i + 1] == c) {
+            literals.back() += c;
+            i++;
+        } else if (c == '{') {
+            const size_t end = text.find_first_of("{}", i + 1);
+            if (end == std::string::npos || text[end] != '}') {
+                *error = "unterminated placeholder at offset " + std::to_string(i);
+                return false;
+            }
+            if (end == i + 1) {
+                *error = "empty placeholder at offset " + std::to_string(i);
+                return false;
+            }
+            names.push_back(text.substr(i + 1, end - i - 1));
+            literals.emplace_back();
+            i = end;
+        } else if (c == '}') {
+            *error = "unmatched '}' at offset " + std::to_string(i) + ", write '}}' for a literal brace";
+            return false;
+        } else {
+            literals.back() += c;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+std::shared_ptr<PromptTemplate> PromptTemplate::compile(const std::string& text, std::shared_ptr<LlamaModel> model,
+                                                        std::string* error)
+{
+    std::vector<std::string> literals;
+    std::shared_ptr<PromptTemplate> res(new PromptTemplate(model));
+    if (!parse(text, literals, res->names, error)) {
+        return nullptr;
+    }
+    res->bpe_tokenizer = model->get_bpe_tokenizer();
+    res->segments.resize(literals.size());
+    for (size_t i = 0; i < literals.size(); i++) {
+        res->segments[i].text = literals[i];
+    }
+    // Without the merge scores there is no way to tell where a segment can be cut.
+    // A NUL ends the text for llama_tokenize(), so nothing after it may be pretokenized.
+    if (!res->bpe_tokenizer || text.find('\0') != std::string::npos) {
+        return res;
+    }
+
+    for (size_t i = 0; i < literals.size(); i++) {
+        const std::string& literal = literals[i];
+        Segment& segment = res->segments[i];
+        // The start of the text and its end are always cuts
+        size_t first = i == 0 ? 0 : std::string::npos;
+        size_t last = i + 1 == literals.size() ? literal.size() : 0;
+        for (size_t pos = 1; pos < literal.size(); pos++) {
+            if (res->bpe_tokenizer->can_split(literal.data(), literal.size(), pos)) {
+                first = std::min(first, pos);
+                last = std::max(last, pos);
+            }
+        }
+        if (first == std::string::npos) {
+            continue;
+        }
+        last = std::max(first, last);
+        segment.is_split = true;
+        segment.head = literal.substr(0, first);
+        res->bpe_tokenizer->tokenize(literal.data() + first, last - first, false, segment.tokens);
+        segment.tail = literal.substr(last);
+    }
+    return res;
+}
+
+void PromptTemplate::tokenize(const std::string& text, std::vector<llama_token>& out) const
+{
+    // Cut at the first NUL like llama_tokenize(), which takes a C string
+    const size_t size = strlen(text.c_str());
+    if (bpe_tokenizer) {
+        bpe_tokenizer->tokenize(text.c_str(), size, false, out);
+        return;
+    }
+    // A text never has more tokens than bytes
+    const size_t start = out.size();
+    out.resize(start + size);
+    const int n = llama_tokenize(model->get_ctx(), text.c_str(), out.data() + start, (int) size, false);
+    assert(n >= 0);
+    out.resize(start + n);
+}
+
+// Tokenize the text around each placeholder and put the pretokenized segments in between
+bool PromptTemplate::render(const std::map<std::string, std::string>& values, bool add_bos,
+                            std::vector<llama_token>& out, std::string* error) const
+{
+    std::vector<const std::string*> filled(names.size());
+    bool has_nul = false;
+    for (size_t i = 0; i < names.size(); i++) {
+        const auto found = values.find(names[i]);
+        if (found == values.end()) {
+            *error = "no value for placeholder '" + names[i] + "'";
+            return false;
+        }
+        filled[i] = &found->second;
+        has_nul = has_nul || found->second.find('\0') != std::string::npos;
+    }
+
+    const size_t start = out.size();
+    if (add_bos) {
+        out.push_back(llama_token_bos());
+    }
+    std::string pending;
+    for (size_t i = 0; i < segments.size(); i++) {
+        const Segment& segment = segments[i];
+        // A NUL in a value ends the text for llama_tokenize(), so the pretokenized segments after it
+        // must not be used. Tokenizing the whole text drops them.
+        if (segment.is_split && !has_nul) {
+            pending += segment.head;
+            tokenize(pending, out);
+            out.insert(out.end(), segment.tokens.begin(), segment.tokens.end());
+            pending = segment.tail;
+        } else {
+            pending += segment.text;
+        }
+        if (i < filled.size()) {
+            pending += *filled[i];
+        }
+    }
+    tokenize(pending, out);
+    // llama_tokenize() gives no tokens at all for empty text, not even BOS
+    if (add_bos && out.size() == start + 1) {
+        out.pop_back();
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+#ifndef PROMPT_TEMPLATE_H
+#define PROMPT_TEMPLATE_H
+
+#include "bpe_tokenizer.h"
+#include "llama.h"
+#include "llama_model.h"
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Prompt with `{name}` placeholders whose static text is tokenized once, when it is compiled.
+ *
+ * Rendering gives the same tokens as tokenizing the filled-in text, but only the values and the
+ * text around them are tokenized again. Each static segment is cut where no token can span the
+ * cut (a byte pair that no token contains), so merges across a placeholder are still found in
+ * the text between the last cut before it and the first cut after it. Write `{{` and `}}` for
+ * literal braces. Templates and values are expected to be valid UTF-8.
+ */
+class PromptTemplate {
+    public:
+        // Parse `text` and tokenize its static segments with the vocabulary of `model`.
+        // Returns nullptr and sets `error` if the template is malformed.
+        static std::shared_ptr<PromptTemplate> compile(const std::string& text, std::shared_ptr<LlamaModel> model,
+                                                       std::string* error);
+
+        // Append the tokens of the template filled in with `values` to `out`, as llama_tokenize() would give
+        // for the whole text. Returns false and sets `error` if a placeholder has no value.
+        bool render(const std::map<std::string, std::string>& values, bool add_bos, std::vector<llama_token>& out,
+                    std::string* error) const;
+        // Names of the placeholders in order of appearance, repeated ones included
+        const std::vector<std::string>& placeholders() const { return names; }
+
+    private:
+        // Static text between two placeholders
+        struct Segment {
+            std::string text = "";
+            // Text tokenized together with the placeholder before it
+            std::string head = "";
+            // Tokens of the text between `head` and `tail`
+            std::vector<llama_token> tokens{};
+            // Text tokenized together with the placeholder after it
+            std::string tail = "";
+            // False if the segment has no cut, then all of `text` is tokenized with the placeholders
+            bool is_split = false;
+        };
+
+        PromptTemplate(std::shared_ptr<LlamaModel> model) : model(model) {}
+        // Append the tokens of `text` to `out`
+        void tokenize(const std::string& text, std::vector<llama_token>& out) const;
+
+        std::shared_ptr<LlamaModel> model;
+        // Null if the model file could not be read, then the whole text is tokenized on every render
+        std::shared_ptr<const BpeTokenizer> bpe_tokenizer{};
+        // One more segment than placeholders
+        std::vector<Segment> segments{};
+        std::vector<std::string> names{};
+};
+
+#endif /* PROMPT_TEMPLATE_H */
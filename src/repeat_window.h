@@ -0,0 +1,61 @@
+#ifndef REPEAT_WINDOW_H
+#define REPEAT_WINDOW_H
+
+#include "llama.h"
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+/* Fixed-size window over the most recently seen tokens, used for the repeat penalty.
+ *
+ * Every token is written twice, at `pos` and `pos + capacity`, so the last `capacity`
+ * tokens are always available as one contiguous slice starting at `pos`. Pushing a
+ * token is O(1) regardless of the context size and no memory is ever moved.
+ */
+class RepeatWindow {
+    public:
+        RepeatWindow() = default;
+        explicit RepeatWindow(size_t capacity)
+            : buf(2 * capacity, 0), cap(capacity)
+        {}
+
+        // Number of tokens covered by the window
+        size_t size() const { return cap; }
+
+        // Append a token, evicting the oldest one
+        void push(llama_token token)
+        {
+            if (cap == 0) {
+                return;
+            }
+            buf[pos] = token;
+            buf[pos + cap] = token;
+            pos = pos + 1 == cap ? 0 : pos + 1;
+        }
+
+        // Append a range of tokens. Only the last `size()` of them can end up in the window.
+        void push(const llama_token* tokens, size_t n_tokens)
+        {
+            const size_t n_skip = n_tokens > cap ? n_tokens - cap : 0;
+            for (size_t i = n_skip; i < n_tokens; i++) {
+                push(tokens[i]);
+            }
+        }
+
+        // Reset all entries back to zero
+        void clear()
+        {
+            std::fill(buf.begin(), buf.end(), 0);
+            pos = 0;
+        }
+
+        // Contiguous view of the window, ordered from oldest to newest. Length: size()
+        const llama_token* data() const { return buf.data() + pos; }
+
+    private:
+        std::vector<llama_token> buf{};
+        size_t cap = 0;
+        size_t pos = 0;
+};
+
+#endif /* REPEAT_WINDOW_H */
@@ -0,0 +1,70 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/* Bounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * The capacity is rounded up to a power of two. head is only written by the consumer and
+ * tail only by the producer; each side publishes its index with release semantics after
+ * touching a slot, so a slot is never accessed by both threads at once.
+ */
+template <typename T>
+class SpscQueue {
+    public:
+        explicit SpscQueue(size_t min_capacity)
+        {
+            size_t capacity = 1;
+            while (capacity < min_capacity) {
+                capacity <<= 1;
+            }
+            slots.resize(capacity);
+            mask = capacity - 1;
+        }
+
+        // Producer side. Returns false if the queue is full.
+        bool try_push(T&& item)
+        {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == slots.size()) {
+                return false;
+            }
+            slots[t & mask] = std::move(item);
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side. Returns false if the queue is empty.
+        bool try_pop(T& item)
+        {
+            const size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                return false;
+            }
+            item = std::move(slots[h & mask]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Approximate number of queued items. Exact when called from either end with the other idle.
+        size_t size() const
+        {
+            return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const { return slots.size(); }
+
+    private:
+        std::vector<T> slots{};
+        size_t mask = 0;
+        // Keep the indices on separate cache lines so the two threads do not contend
+        char pad_head[64] = {};
+        std::atomic<size_t> head{0};
+        char pad_tail[64] = {};
+        std::atomic<size_t> tail{0};
+};
+
+#endif /* SPSC_QUEUE_H */
@@ -0,0 +1,78 @@
+#include "stop_matcher.h"
+#include <algorithm>
+
+StopMatcher::StopMatcher(const std::vector<std::string>& stops)
+{
+    // Trie of the stop strings. Node 0 is the root, and 0 doubles as "no edge" while building.
+    for (const auto& stop : stops) {
+        if (stop.empty()) {
+            continue;
+        }
+        uint32_t node = 0;
+        for (const char c : stop) {
+            const uint8_t byte = static_cast<uint8_t>(c);
+            if (nodes[node].next[byte] == 0) {
+                nodes[node].next[byte] = nodes.size();
+                Node child;
+                child.depth = nodes[node].depth + 1;
+                nodes.push_back(child);
+            }
+            node = nodes[node].next[byte];
+        }
+        nodes[node].match_len = stop.size();
+    }
+
+    // Breadth-first, so the failure target of a node is complete before the node itself. Missing edges
+    // are filled in with the edge of the failure target, which turns the trie into a full automaton.
+    std::vector<uint32_t> fail(nodes.size(), 0);
+    std::vector<uint32_t> order;
+    order.reserve(nodes.size());
+    for (int byte = 0; byte < 256; byte++) {
+        if (nodes[0].next[byte] != 0) {
+            order.push_back(nodes[0].next[byte]);
+        }
+    }
+    for (size_t i = 0; i < order.size(); i++) {
+        const uint32_t node = order[i];
+        // The longest stop string ending here may be a suffix found through the failure link
+        nodes[node].match_len = std::max(nodes[node].match_len, nodes[fail[node]].match_len);
+        for (int byte = 0; byte < 256; byte++) {
+            const uint32_t child = nodes[node].next[byte];
+            if (child != 0) {
+                fail[child] = nodes[fail[node]].next[byte];
+                order.push_back(child);
+            } else {
+                nodes[node].next[byte] = nodes[fail[node]].next[byte];
+            }
+        }
+    }
+}
+
+// Advance over a piece of output
+bool StopMatcher::feed(const char* text, size_t size)
+{
+    if (is_match) {
+        return true;
+    }
+    for (size_t i = 0; i < size; i++) {
+        state = nodes[state].next[static_cast<uint8_t>(text[i])];
+        const uint32_t match_len = nodes[state].match_len;
+        if (match_len > 0) {
+            const size_t begin = n_fed + i + 1 - match_len;
+            if (!is_match || begin < match_pos) {
+                match_pos = begin;
+                is_match = true;
+            }
+        }
+    }
+    n_fed += size;
+    return is_match;
+}
+
+void StopMatcher::reset()
+{
+    state = 0;
+    n_fed = 0;
+    match_pos = 0;
+    is_match = false;
+}
@@ -0,0 +1,57 @@
+#ifndef STOP_MATCHER_H
+#define STOP_MATCHER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Finds stop strings in generated text as it is produced.
+ *
+ * An Aho-Corasick automaton over bytes, with the failure links folded into a full transition
+ * table, so feeding a piece costs one table lookup per byte regardless of the number of stop
+ * strings. Matching works on the UTF-8 output rather than on tokens, so a stop string is found
+ * however it happens to be split into tokens.
+ */
+class StopMatcher {
+    public:
+        StopMatcher() = default;
+        // Empty strings in `stops` are ignored
+        explicit StopMatcher(const std::vector<std::string>& stops);
+
+        // True when there are no stop strings
+        bool empty() const { return nodes.size() <= 1; }
+        // Feed the next piece of output. Returns true once a stop string has been completed. If several
+        // are completed within the same piece, the match is the one that starts first.
+        bool feed(const char* text, size_t size);
+        bool feed(const std::string& piece) { return feed(piece.data(), piece.size()); }
+        // Offset in the fed text where the stop string that was found starts
+        size_t match_begin() const { return match_pos; }
+        // Whether a stop string has been found
+        bool is_matched() const { return is_match; }
+        // Number of bytes at the end of the fed text that could still turn out to be the start of a stop
+        // string. Everything before them is final.
+        size_t n_held() const { return nodes[state].depth; }
+        // Bytes fed so far
+        size_t size() const { return n_fed; }
+        // Start over on a new stream
+        void reset();
+
+    private:
+        struct Node {
+            std::array<uint32_t, 256> next{};
+            // Length of the string spelled by the path to this node
+            uint32_t depth = 0;
+            // Length of the longest stop string that ends here, 0 if none does
+            uint32_t match_len = 0;
+        };
+
+        std::vector<Node> nodes{Node()};
+        uint32_t state = 0;
+        size_t n_fed = 0;
+        size_t match_pos = 0;
+        bool is_match = false;
+};
+
+#endif /* STOP_MATCHER_H */
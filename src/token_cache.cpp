@@ -0,0 +1,64 @@
+#include "token_cache.h"
+#include <functional>
+
+uint64_t TokenCache::hash_key(const std::string& text, bool add_bos)
+{
+    const uint64_t hash = std::hash<std::string>()(text);
+    return add_bos ? hash ^ 0x9e3779b97f4a7c15ull : hash;
+}
+
+bool TokenCache::get(const std::string& text, bool add_bos, std::vector<llama_token>& tokens)
+{
+    const uint64_t hash = hash_key(text, add_bos);
+    std::lock_guard<std::mutex> lock(mutex);
+    const auto found = by_hash.find(hash);
+    if (found == by_hash.end() || found->second->add_bos != add_bos || found->second->text != text) {
+        n_misses++;
+        return false;
+    }
+    n_hits++;
+    entries.splice(entries.begin(), entries, found->second);
+    tokens = found->second->tokens;
+    return true;
+}
+
+void TokenCache::put(const std::string& text, bool add_bos, const std::vector<llama_token>& tokens)
+{
+    if (capacity == 0) {
+        return;
+    }
+    const uint64_t hash = hash_key(text, add_bos);
+    std::lock_guard<std::mutex> lock(mutex);
+    // A text with the same hash, or the same text cached by another thread meanwhile, is replaced
+    const auto found = by_hash.find(hash);
+    if (found != by_hash.end()) {
+        entries.erase(found->second);
+        by_hash.erase(found);
+    }
+    if (entries.size() >= capacity) {
+        by_hash.erase(entries.back().hash);
+        entries.pop_back();
+    }
+    entries.push_front({hash, add_bos, text, tokens});
+    by_hash[hash] = entries.begin();
+}
+
+void TokenCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    by_hash.clear();
+    n_hits = 0;
+    n_misses = 0;
+}
+
+TokenCacheStats TokenCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    TokenCacheStats stats;
+    stats.hits = n_hits;
+    stats.misses = n_misses;
+    stats.size = entries.size();
+    stats.capacity = capacity;
+    return stats;
+}
@@ -0,0 +1,55 @@
+#ifndef TOKEN_CACHE_H
+#define TOKEN_CACHE_H
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Counters of a TokenCache */
+struct TokenCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t size = 0;      // texts currently cached
+    size_t capacity = 0;  // most texts kept at once
+};
+
+/* Bounded LRU cache from texts to their tokens, for prompts that are tokenized over and over.
+ *
+ * Entries are found by the hash of the text and checked against the stored text, so a hash
+ * collision is a miss rather than wrong tokens. Safe to use from several threads.
+ */
+class TokenCache {
+    public:
+        explicit TokenCache(size_t capacity) : capacity(capacity) {}
+
+        // Copy the cached tokens of `text` to `tokens`. Returns false if the text is not cached.
+        bool get(const std::string& text, bool add_bos, std::vector<llama_token>& tokens);
+        // Cache the tokens of `text`, evicting the least recently used text if the cache is full
+        void put(const std::string& text, bool add_bos, const std::vector<llama_token>& tokens);
+        void clear();
+        TokenCacheStats stats() const;
+
+    private:
+        struct Entry {
+            uint64_t hash;
+            bool add_bos;
+            std::string text;
+            std::vector<llama_token> tokens;
+        };
+        static uint64_t hash_key(const std::string& text, bool add_bos);
+
+        const size_t capacity;
+        mutable std::mutex mutex{};
+        // Most recently used first
+        std::list<Entry> entries{};
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> by_hash{};
+        uint64_t n_hits = 0;
+        uint64_t n_misses = 0;
+};
+
+#endif /* TOKEN_CACHE_H */
@@ -0,0 +1,49 @@
+#include "vocab_trie.h"
+#include <algorithm>
+
+VocabTrie::VocabTrie(llama_context* ctx)
+{
+    const int n_vocab = llama_n_vocab(ctx);
+    pieces.resize(n_vocab);
+    std::vector<llama_token> sorted;
+    sorted.reserve(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        pieces[id] = llama_token_to_str(ctx, id);
+        if (!pieces[id].empty()) {
+            sorted.push_back(id);
+        }
+    }
+    // A string sorts right before the strings it is a prefix of, so every subtree is a contiguous range
+    std::sort(sorted.begin(), sorted.end(), [this](llama_token a, llama_token b) {
+        return pieces[a] < pieces[b];
+    });
+    trie_tokens.reserve(sorted.size());
+    build(sorted, 0, sorted.size(), 0, 0);
+}
+
+// Add the subtree for sorted[begin, end)
+void VocabTrie::build(const std::vector<llama_token>& sorted, size_t begin, size_t end, size_t depth, uint8_t byte)
+{
+    const size_t index = trie_nodes.size();
+    trie_nodes.emplace_back();
+    trie_nodes[index].byte = byte;
+
+    // Tokens that end here come first
+    trie_nodes[index].tokens_begin = trie_tokens.size();
+    while (begin < end && pieces[sorted[begin]].size() == depth) {
+        trie_tokens.push_back(sorted[begin++]);
+    }
+    trie_nodes[index].tokens_end = trie_tokens.size();
+
+    // One child per distinct next byte
+    while (begin < end) {
+        const uint8_t next = pieces[sorted[begin]][depth];
+        size_t child_end = begin + 1;
+        while (child_end < end && (uint8_t) pieces[sorted[child_end]][depth] == next) {
+            child_end++;
+        }
+        build(sorted, begin, child_end, depth + 1, next);
+        begin = child_end;
+    }
+    trie_nodes[index].n_nodes = trie_nodes.size() - index;
+}
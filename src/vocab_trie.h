@@ -0,0 +1,42 @@
+#ifndef VOCAB_TRIE_H
+#define VOCAB_TRIE_H
+
+#include "llama.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/* Byte-level trie over the strings of every token in a vocabulary.
+ *
+ * Nodes are stored in preorder: the first child of node i is node i + 1 and the next
+ * sibling of a node follows its subtree, so walking the trie only touches one contiguous
+ * array. Tokens with an empty string (BOS, EOS) are not in the trie.
+ */
+class VocabTrie {
+    public:
+        struct Node {
+            uint8_t byte = 0;          // byte on the edge from the parent, unused for the root
+            uint32_t n_nodes = 1;      // size of the subtree rooted here, including this node
+            uint32_t tokens_begin = 0; // tokens whose string ends at this node:
+            uint32_t tokens_end = 0;   //   token_ids()[tokens_begin, tokens_end)
+        };
+
+        // Read the vocabulary of a context. Only uses vocabulary queries.
+        explicit VocabTrie(llama_context* ctx);
+
+        const std::vector<Node>& nodes() const { return trie_nodes; }
+        const std::vector<llama_token>& token_ids() const { return trie_tokens; }
+        // String of a token as returned by llama_token_to_str()
+        const std::string& piece(llama_token id) const { return pieces[id]; }
+        int n_vocab() const { return (int) pieces.size(); }
+
+    private:
+        // Add the subtree for the sorted tokens in [begin, end), which share their first `depth` bytes
+        void build(const std::vector<llama_token>& sorted, size_t begin, size_t end, size_t depth, uint8_t byte);
+
+        std::vector<std::string> pieces{};
+        std::vector<Node> trie_nodes{};
+        std::vector<llama_token> trie_tokens{};
+};
+
+#endif /* VOCAB_TRIE_H */
@@ -0,0 +1,67 @@
+import pytest
+import llamacpp
+
+
+@pytest.fixture(scope="session")
+def model():
+    return llamacpp.LlamaModel('../models/7B/ggml-model-f16.bin', llamacpp.LlamaContextParams())
+
+
+@pytest.fixture(scope="session")
+def scheduler(model):
+    return llamacpp.GenerationScheduler(model)
+
+
+def test_concurrent_requests(scheduler):
+    params = llamacpp.InferenceParams()
+    params.seed = 19472
+    params.n_predict = 8
+    ids = [scheduler.submit(prompt, params) for prompt in [" Llama is", " The capital of France is", " 1, 2, 3,"]]
+    results = [scheduler.wait(id) for id in ids]
+    for result in results:
+        assert not result.failed
+        assert 0 < len(result.tokens) <= params.n_predict
+    assert scheduler.n_pending() == 0
+
+
+def test_stop(scheduler):
+    params = llamacpp.InferenceParams()
+    params.n_predict = 32
+    params.temp = 0.0
+    result = scheduler.wait(scheduler.submit(" 1, 2, 3, 4,", params, stop=[" 7"]))
+    assert not result.failed
+    assert " 7" not in result.text
+    assert len(result.tokens) < params.n_predict
+
+
+def test_cancel(scheduler):
+    params = llamacpp.InferenceParams()
+    params.n_predict = 512
+    id = scheduler.submit(" Once upon a time", params)
+    scheduler.cancel(id)
+    result = scheduler.wait(id)
+    assert result.cancelled
+
+
+def test_turns(model):
+    params = llamacpp.InferenceParams()
+    params.n_predict = 16
+    params.temp = 0.0
+    prompts = [" Llama is", " The capital of France is", " 1, 2, 3,"]
+    outputs = []
+    # Requests that run to the end and requests that take turns of 4 tokens give the same greedy text
+    for n_turn_tokens in [0, 4]:
+        scheduler = llamacpp.GenerationScheduler(model, n_turn_tokens)
+        ids = [scheduler.submit(prompt, params) for prompt in prompts]
+        outputs.append([scheduler.wait(id).tokens for id in ids])
+        del scheduler
+    assert outputs[0] == outputs[1]
+
+
+def test_submit_failure(scheduler):
+    params = llamacpp.InferenceParams()
+    # Prompt lookup needs a model loaded with logits_all
+    params.n_lookup = 4
+    with pytest.raises(RuntimeError):
+        scheduler.submit(" Llama is", params)
+    assert scheduler.n_pending() == 0
@@ -1,4 +1,6 @@
 import array
+import pathlib
+import numpy
 import llamacpp
 import pytest
 
@@ -16,6 +18,19 @@ def test_str_to_token(llama_context):
     assert prompt_tokens == [1, 10994, 2787]
 
 
+def test_tokenizer_matches_llama_tokenize(llama_context):
+    # Tokenizer uses its own implementation of the merges; str_to_token calls llama_tokenize directly
+    tokenizer = llamacpp.Tokenizer("../models/7B/ggml-model-f16.bin")
+    root = pathlib.Path(__file__).resolve().parent.parent
+    documents = [path.read_text(encoding="utf-8") for path in sorted(root.glob("src/*.cpp")) + [root / "README.md"]]
+    documents += ["", " ", "  leading spaces", "trailing  ", "a\tb\nc", "naïve café", "日本語のテキスト",
+                  "emoji 🦙🦙 and Ω≈ç√", "\u00a0\u2003", "x" * 1000, "12345678901234567890"]
+    corpus = documents + [line for document in documents for line in document.splitlines()]
+    for text in corpus:
+        for add_bos in (False, True):
+            assert tokenizer.tokenize(text, add_bos) == list(llama_context.str_to_token(text, add_bos))
+
+
 def test_token_to_str(llama_context):
     tokens = [1, 10994, 2787]
     text = ''.join([llama_context.token_to_str(token) for token in tokens])
@@ -56,3 +71,68 @@ def test_eval(llama_context):
 
         output += ''.join([llama_context.token_to_str(id) for id in embd])
     assert output == " Llama is the newest member of our farm family"
+
+
+def test_sample(llama_context):
+    tokens = llama_context.str_to_token(" Llama is", True)
+    assert llama_context.eval(array.array('i', tokens), len(tokens), 0, 1) == 0
+
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    llama_context.set_sampling_params(params)
+    # Greedy sampling picks the largest logit
+    id = llama_context.sample(array.array('i', []))
+    assert id == int(numpy.argmax(llama_context.get_logits()[-1]))
+
+    assert llama_context.sample_greedy() == id
+
+    params.temp = 0.8
+    params.typical_p = 0.9
+    params.frequency_penalty = 0.5
+    llama_context.set_sampling_params(params)
+    assert 0 <= llama_context.sample(array.array('i', tokens)) < llama_context.get_n_vocab()
+
+
+def test_get_logits_all():
+    params = llamacpp.LlamaContextParams()
+    params.logits_all = True
+    model = llamacpp.LlamaContext("../models/7B/ggml-model-f16.bin", params)
+    tokens = model.str_to_token(" Llama is a mammal", True)
+    assert model.eval(array.array('i', tokens), len(tokens), 0, 1) == 0
+
+    logits = model.get_logits()
+    assert logits.dtype == numpy.float32
+    assert logits.shape == (len(tokens), model.get_n_vocab())
+    # A view of a buffer that stays in place across evals, even with several rows
+    assert logits.base is model
+    logits[0, 0] = 123.0
+    assert model.get_logits()[0, 0] == 123.0
+    assert model.eval(array.array('i', tokens[:2]), 2, 0, 1) == 0
+    assert model.get_logits().__array_interface__['data'][0] == logits.__array_interface__['data'][0]
+
+
+def test_get_logits_view(llama_context):
+    tokens = llama_context.str_to_token(" Llama is", True)
+    assert llama_context.eval(array.array('i', tokens), len(tokens), 0, 1) == 0
+
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    llama_context.set_sampling_params(params)
+    # The logits are a view that sample() sees
+    logits = llama_context.get_logits()
+    assert logits.shape == (1, llama_context.get_n_vocab())
+    logits[-1, 123] = 1e9
+    assert llama_context.sample(array.array('i', [])) == 123
+
+
+def test_embed_batch():
+    params = llamacpp.LlamaContextParams()
+    params.embedding = True
+    model = llamacpp.LlamaContext("../models/7B/ggml-model-f16.bin", params)
+    texts = [" Llama is a mammal", " The capital of France is Paris", " 1, 2, 3"]
+
+    last = model.embed_batch(texts, pooling="last")
+    assert last.shape == (len(texts), model.get_n_embd())
+    both = model.embed_batch(texts, pooling="both")
+    assert both.shape == (len(texts), 2, model.get_n_embd())
+    assert numpy.allclose(both[:, 0], last, atol=1e-4)
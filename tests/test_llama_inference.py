@@ -1,6 +1,13 @@
+import asyncio
+import numpy
+import os
+import re
 import pytest
 import llamacpp
 
+# Context size of the shared_model fixture
+SHARED_N_CTX = 64
+
 
 @pytest.fixture(scope="session")
 def llama_model():
@@ -14,6 +21,30 @@ def llama_model():
     return llamacpp.LlamaInference(params)
 
 
+@pytest.fixture(scope="session")
+def shared_model():
+    # One copy of the weights for the tests that need sessions with their own settings.
+    # The small context keeps context shifts quick, and logits_all allows speculative decoding.
+    params = llamacpp.LlamaContextParams()
+    params.n_ctx = SHARED_N_CTX
+    params.logits_all = True
+    return llamacpp.LlamaModel('../models/7B/ggml-model-f16.bin', params)
+
+
+@pytest.fixture
+def make_session(shared_model):
+    # Session on the shared weights with InferenceParams fields overridden by keyword.
+    # Tests that change sampling settings, bans or the grammar use one, so that the session-scoped
+    # llama_model keeps its defaults for the tests after them.
+    def make(**settings):
+        params = llamacpp.InferenceParams()
+        params.seed = 19472
+        for name, value in settings.items():
+            setattr(params, name, value)
+        return llamacpp.LlamaInference(shared_model, params)
+    return make
+
+
 def test_update_input(llama_model):
     prompt_tokens = [1, 2, 3]
     llama_model.update_input(prompt_tokens)
@@ -34,6 +65,56 @@ def test_token_to_str(llama_model):
     assert text == "Hello World"
 
 
+def test_token_cache(make_session):
+    model = make_session(n_token_cache=2)
+    system = "You are a helpful assistant."
+    tokens = model.tokenize(system, True)
+    assert model.tokenize(system, True) == tokens
+    assert model.tokenize(system, False) == tokens[1:]
+    model.tokenize("one", False)
+    model.tokenize("two", False)
+    stats = model.get_token_cache_stats()
+    assert (stats.hits, stats.misses, stats.size, stats.capacity) == (1, 4, 2, 2)
+    # The first text was evicted
+    model.tokenize(system, True)
+    assert model.get_token_cache_stats().misses == 5
+    model.clear_token_cache()
+    assert model.get_token_cache_stats().size == 0
+
+
+def test_tokenize_batch(llama_model):
+    texts = ["Hello World", "", " Llama is"] * 100
+    tokens, offsets = llama_model.tokenize_batch(texts, add_bos=True, n_threads=4)
+    assert tokens.dtype == numpy.int32 and offsets.dtype == numpy.int64
+    assert len(offsets) == len(texts) + 1 and offsets[-1] == len(tokens)
+    for i, text in enumerate(texts):
+        assert tokens[offsets[i]:offsets[i + 1]].tolist() == llama_model.tokenize(text, True)
+
+
+def test_vocab_only_tokenizer(llama_model):
+    tokenizer = llamacpp.Tokenizer('../models/7B/ggml-model-f16.bin')
+    assert tokenizer.n_vocab == llama_model.get_tokenizer().n_vocab
+    assert tokenizer.tokenize("Hello World", True) == [1, 10994, 2787]
+    assert tokenizer.detokenize([10994, 2787]) == "Hello World"
+    tokens, offsets = tokenizer.tokenize_batch(["Hello World", " Llama is"])
+    assert tokens[offsets[1]:offsets[2]].tolist() == llama_model.tokenize(" Llama is", False)
+
+
+def test_detokenize(llama_model):
+    tokenizer = llama_model.get_tokenizer()
+    texts = [" Hello World", " 🦙 llamas", ""]
+    sequences = [tokenizer.tokenize(text) for text in texts]
+    assert [tokenizer.detokenize(tokens) for tokens in sequences] == texts
+    assert tokenizer.detokenize_many(sequences) == texts
+
+    # The emoji is split into byte tokens, and only whole characters come out
+    detokenizer = tokenizer.streaming_detokenizer()
+    chunks = [detokenizer.feed(token) for token in sequences[1]]
+    assert all('\ufffd' not in chunk for chunk in chunks)
+    assert ''.join(chunks) + detokenizer.flush() == texts[1]
+    assert detokenizer.n_pending == 0
+
+
 def test_eval(llama_model):
     prompt = "Llama is"
     prompt_tokens = llama_model.tokenize(prompt, True)
@@ -46,3 +127,327 @@ def test_eval(llama_model):
         output += llama_model.token_to_str(token)
 
     assert output == " Llama is the newest member of our farm family"
+
+
+def test_set_input_reuses_prefix(llama_model):
+    prompt_tokens = llama_model.tokenize(" Llama is a domesticated animal", True)
+    llama_model.set_input(prompt_tokens)
+    llama_model.ingest_all_pending_input()
+    assert llama_model.get_n_past() == len(prompt_tokens)
+
+    # Only the tokens after the common prefix are left to ingest
+    new_tokens = llama_model.tokenize(" Llama is a mammal", True)
+    n_common = 0
+    while prompt_tokens[n_common] == new_tokens[n_common]:
+        n_common += 1
+    llama_model.set_input(new_tokens)
+    assert llama_model.get_n_past() == n_common
+    llama_model.ingest_all_pending_input()
+    assert llama_model.get_n_past() == len(new_tokens)
+
+
+def test_save_load_session(llama_model, tmp_path):
+    llama_model.set_input(llama_model.tokenize(" Llama is", True))
+    llama_model.ingest_all_pending_input()
+    n_past = llama_model.get_n_past()
+    session_path = str(tmp_path / "session.bin")
+    llama_model.save_session(session_path)
+    # Only the used positions of the cache are written, not all 512 of them (256 MB for the f16 7B model)
+    assert os.path.getsize(session_path) < 8 * 1024 * 1024
+
+    llama_model.set_input(llama_model.tokenize(" Something else entirely", True))
+    llama_model.ingest_all_pending_input()
+    llama_model.load_session(session_path)
+    # The last cached token is re-evaluated to recover the logits
+    assert llama_model.get_n_past() == n_past - 1
+    llama_model.eval()
+    assert llama_model.get_n_past() == n_past
+
+
+def test_context_shift(make_session):
+    model = make_session(ctx_shift=True, n_keep=-1)
+
+    prompt_tokens = model.tokenize(" Llama is", True)
+    model.update_input(prompt_tokens)
+    model.ingest_all_pending_input()
+    for i in range(2 * SHARED_N_CTX):
+        model.eval()
+        model.sample()
+        assert model.get_n_past() <= SHARED_N_CTX
+
+
+def test_shared_model_sessions(make_session):
+    first = make_session()
+    second = make_session()
+
+    first.set_input(first.tokenize(" Llama is", True))
+    first.ingest_all_pending_input()
+    second.set_input(second.tokenize(" The capital of France is", True))
+    second.ingest_all_pending_input()
+
+    # Each session keeps its own KV cache on the shared weights
+    assert first.get_n_past() == len(first.tokenize(" Llama is", True))
+    assert second.get_n_past() == len(second.tokenize(" The capital of France is", True))
+    first.sample()
+    first.eval()
+    assert first.get_n_past() == len(first.tokenize(" Llama is", True)) + 1
+
+
+def test_get_logits_view(make_session):
+    first = make_session(repeat_penalty=1.0)
+    second = make_session()
+    first.set_input(first.tokenize(" Llama is", True))
+    first.ingest_all_pending_input()
+    logits = first.get_logits()
+    assert logits.base is first
+    address = logits.__array_interface__['data'][0]
+    expected = logits.copy()
+
+    # Another session on the same weights does not move or overwrite the buffer
+    second.set_input(second.tokenize(" The capital of France is", True))
+    second.ingest_all_pending_input()
+    assert numpy.array_equal(logits, expected)
+    assert first.get_logits().__array_interface__['data'][0] == address
+
+    # Changes made through the view reach the sampler
+    logits[-1, 123] = 1e9
+    assert first.sample_greedy() == 123
+    first.eval()
+    assert first.get_logits().__array_interface__['data'][0] == address
+
+
+def test_generate(llama_model):
+    llama_model.set_input(llama_model.tokenize(" Llama is", True))
+    chunks = []
+    text = llama_model.generate(8, callback=chunks.append, callback_interval=2)
+    assert text == ''.join(chunks)
+
+
+def test_generate_stop(llama_model):
+    llama_model.set_input(llama_model.tokenize(" 1, 2, 3, 4,", True))
+    text = llama_model.generate(32, stop=[" 7"])
+    assert " 7" not in text
+
+    # The earliest stop string ends generation, however the tokens split it
+    llama_model.set_input(llama_model.tokenize(" 1, 2, 3, 4,", True))
+    stop = ["9,", " 6, 7", "8"]
+    text = llama_model.generate(32, stop=stop)
+    assert not any(s in text for s in stop)
+
+
+def test_generate_async(llama_model):
+    llama_model.set_input(llama_model.tokenize(" Llama is", True))
+
+    async def consume():
+        return [piece async for piece in llamacpp.stream_async(llama_model, 8, max_queued=2)]
+
+    pieces = asyncio.run(consume())
+    assert 0 < len(pieces) <= 8
+
+
+def test_generate_async_stop(llama_model):
+    llama_model.set_input(llama_model.tokenize(" 1, 2, 3, 4,", True))
+
+    async def consume():
+        return [piece async for piece in llamacpp.stream_async(llama_model, 32, stop=[" 7"])]
+
+    text = ''.join(asyncio.run(consume()))
+    assert " 7" not in text
+
+
+def test_generate_async_blocks_session(llama_model):
+    llama_model.set_input(llama_model.tokenize(" Llama is", True))
+    # Nothing is polled, so the worker waits on the full queue and keeps using the session
+    generation = llama_model.generate_async(64, max_queued=1)
+    with pytest.raises(RuntimeError):
+        llama_model.sample()
+    with pytest.raises(RuntimeError):
+        llama_model.set_input(llama_model.tokenize(" Llama is", True))
+    generation.cancel()
+    while not generation.finished:
+        generation.wait(0.1)
+    llama_model.set_input(llama_model.tokenize(" Llama is", True))
+    assert llama_model.sample() >= 0
+
+
+def test_set_sampling_params(make_session):
+    model = make_session()
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    params.repeat_penalty = 1.0
+    model.set_sampling_params(params)
+    outputs = []
+    for _ in range(2):
+        model.set_input(model.tokenize(" Llama is", True))
+        outputs.append(model.generate(8))
+    assert outputs[0] == outputs[1]
+
+    params.temp = 0.8
+    params.top_k = 0
+    params.top_p = 1.0
+    params.min_p = 0.05
+    params.mirostat = 2
+    model.set_sampling_params(params)
+    model.set_input(model.tokenize(" Llama is", True))
+    assert len(model.generate(8)) > 0
+
+
+def test_sample_greedy(make_session):
+    model = make_session()
+    params = llamacpp.InferenceParams()
+    params.repeat_penalty = 1.0
+    model.set_sampling_params(params)
+    model.set_input(model.tokenize(" Llama is", True))
+    model.ingest_all_pending_input()
+    logits = model.get_logits()[-1].copy()
+    id = model.sample_greedy()
+    assert logits[id] == logits.max()
+
+
+def test_logit_bias_and_bans(make_session):
+    model = make_session()
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    params.repeat_penalty = 1.0
+    model.set_sampling_params(params)
+    model.set_input(model.tokenize(" Llama is", True))
+    model.ingest_all_pending_input()
+    logits = model.get_logits()[-1].copy()
+    best = int(logits.argmax())
+
+    # Bans and biases stay in place for every following sample until cleared
+    model.ban_tokens([best])
+    assert model.sample_greedy() != best
+    model.clear_bans()
+    model.set_input(model.tokenize(" Llama is", True))
+    model.ingest_all_pending_input()
+    model.set_logit_bias({500: 1000.0})
+    assert model.sample_greedy() == 500
+    model.clear_logit_bias()
+
+    # With every token banned the text ends
+    model.ban_tokens(list(range(model.get_tokenizer().n_vocab)))
+    model.set_input(model.tokenize(" Llama is", True))
+    model.ingest_all_pending_input()
+    assert model.sample_greedy() == llamacpp.LlamaInference.token_eos()
+    params.temp = 0.8
+    model.set_sampling_params(params)
+    assert model.sample() == llamacpp.LlamaInference.token_eos()
+    model.clear_bans()
+
+    with pytest.raises(IndexError):
+        model.ban_tokens([-1])
+    with pytest.raises(IndexError):
+        model.unban_tokens([model.get_tokenizer().n_vocab])
+
+
+def test_grammar(make_session):
+    model = make_session()
+    params = llamacpp.InferenceParams()
+    params.temp = 0.8
+    model.set_sampling_params(params)
+
+    model.set_grammar(llamacpp.Grammar.from_gbnf('root ::= "yes" | "no"'))
+    model.set_input(model.tokenize("Q: Is the sky blue?\nA:", True))
+    assert model.generate(n_predict=16) in ("yes", "no")
+
+    # EOS is only allowed once the pattern is complete
+    model.set_grammar(llamacpp.Grammar.from_regex("[0-9]{3}"))
+    model.set_input(model.tokenize("Three digits:", True))
+    assert re.fullmatch("[0-9]{3}", model.generate(n_predict=16))
+    # A new input starts the grammar over
+    model.set_input(model.tokenize("Three more digits:", True))
+    assert re.fullmatch("[0-9]{3}", model.generate(n_predict=16))
+    model.clear_grammar()
+
+    with pytest.raises(ValueError):
+        llamacpp.Grammar.from_gbnf('root ::= undefined')
+    with pytest.raises(ValueError):
+        llamacpp.Grammar.from_regex("(unbalanced")
+
+
+def test_generate_n(make_session):
+    model = make_session()
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    params.repeat_penalty = 1.0
+    model.set_sampling_params(params)
+    prompt = model.tokenize(" Llama is", True)
+    completions = model.generate_n(prompt, 3, n_predict=8)
+    assert len(completions) == 3
+    # Greedy completions are all the same as a single generation
+    model.set_input(prompt)
+    expected = model.generate(n_predict=8)
+    assert completions == [expected] * 3
+
+
+def test_beam_search(make_session):
+    model = make_session()
+    prompt = model.tokenize(" Llama is", True)
+    text, score = model.beam_search(prompt, n_beams=3, n_predict=8)
+    assert len(text) > 0
+    assert score <= 0.0
+
+    # A single beam is greedy decoding
+    params = llamacpp.InferenceParams()
+    params.temp = 0.0
+    params.repeat_penalty = 1.0
+    model.set_sampling_params(params)
+    text, _ = model.beam_search(prompt, n_beams=1, n_predict=8)
+    model.set_input(prompt)
+    assert model.generate(n_predict=8) == text
+
+
+def test_speculative_decoding(make_session):
+    prompt = " Llama is"
+    outputs = []
+    # The quantized model has the same vocabulary but different logits, so some of its drafts are rejected
+    for path_draft_model in ["", '../models/7B/ggml-model-q4_0.bin']:
+        session = make_session(path_draft_model=path_draft_model, n_draft=4, temp=0.0, repeat_penalty=1.0)
+        session.set_input(session.tokenize(prompt, True))
+        outputs.append(session.generate(n_predict=48))
+        stats = session.get_speculative_stats()
+        del session
+    # Greedy decoding gives the same text with or without a draft
+    assert outputs[0] == outputs[1]
+    assert stats.n_accepted > 0
+    assert stats.n_rejected > 0
+    assert stats.n_accepted + stats.n_rejected <= stats.n_drafted
+
+
+def test_prompt_template(llama_model):
+    template = llamacpp.PromptTemplate(llama_model, "### Instruction:\n\n{input}\n\n### Response:{{ {name} }}")
+    assert template.placeholders == ["input", "name"]
+    for values in [{"input": "Hello World", "name": "Llama"},
+                   {"input": "", "name": ""},
+                   # Values that merge with the text around them
+                   {"input": "#\n\n Instruction", "name": "}"},
+                   {"input": "héllo, wörld ✓", "name": "Response"}]:
+        text = "### Instruction:\n\n" + values["input"] + "\n\n### Response:{ " + values["name"] + " }"
+        for add_bos in [False, True]:
+            assert template.render(values, add_bos) == llama_model.tokenize(text, add_bos)
+
+    template = llamacpp.PromptTemplate(llama_model, "{a}{b}")
+    assert template.render({"a": "", "b": ""}, True) == []
+    assert template.render({"a": "Hel", "b": "lo"}) == llama_model.tokenize("Hello", False)
+    with pytest.raises(ValueError):
+        template.render({"a": "Hello"})
+    with pytest.raises(ValueError):
+        llamacpp.PromptTemplate(llama_model, "{unterminated")
+
+    template = llamacpp.PromptTemplate(llama_model, " Q: {question}\n A:")
+    llama_model.update_input(template, {"question": "What is a llama?"})
+    assert llama_model.has_unconsumed_input()
+    llama_model.ingest_all_pending_input()
+    assert not llama_model.has_unconsumed_input()
+
+
+def test_prompt_lookup_decoding(make_session):
+    prompt = " def add(a, b):\n    return a + b\n\n def add(a, b):\n"
+    outputs = []
+    for n_lookup in [0, 8]:
+        model = make_session(n_lookup=n_lookup, temp=0.0, repeat_penalty=1.0)
+        model.set_input(model.tokenize(prompt, True))
+        outputs.append(model.generate(n_predict=16))
+        del model
+    assert outputs[0] == outputs[1]